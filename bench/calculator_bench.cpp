@@ -0,0 +1,677 @@
+#include "calculator.h"
+#include "kernels.h"
+
+#include <benchmark/benchmark.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <random>
+#include <signal.h>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Microbenchmarks of the libcalculator core, plus end-to-end runs of the
+// calculator executable over generated batch files. print_result() and the
+// rest of the output layer live in the executable, so their cost shows up
+// in the end-to-end numbers only.
+
+using calc::CalcData;
+using calc::CalcDataT;
+
+extern char** environ;
+
+// records per generated input
+static const size_t BENCH_RECORDS = 1 << 16;
+static const size_t BATCH_RECORDS = 1 << 20;
+
+// realistic mixes of batch input
+enum Mix { MIX_UNIFORM, MIX_SKEWED, MIX_ERRORS, MIX_OVERFLOW, MIX_COUNT };
+
+static const char* const MIX_NAMES[MIX_COUNT] = {"uniform", "skewed",
+                                                 "errors", "overflow"};
+
+static const char OPS[] = {'+', '-', 'x', '/', '^', '!'};
+static const int OP_COUNT = (int)sizeof(OPS);
+
+static int pick(std::mt19937* rng, int lo, int hi)
+{
+    return std::uniform_int_distribution<int>(lo, hi)(*rng);
+}
+
+// a valid record for op whose result fits in an int
+static CalcData make_valid(std::mt19937* rng, char op)
+{
+    CalcData d = {0, 0, op, 0};
+
+    switch (op) {
+    case '^':
+        d.a = pick(rng, -9, 9);
+        d.b = pick(rng, 0, 9);
+        break;
+    case '!':
+        d.a = pick(rng, 0, 12);
+        break;
+    case '/':
+        d.a = pick(rng, -1000000, 1000000);
+        d.b = pick(rng, 1, 1000);
+        break;
+    default:
+        d.a = pick(rng, -1000000, 1000000);
+        d.b = pick(rng, -1000, 1000);
+        break;
+    }
+
+    return d;
+}
+
+// a record every engine rejects, half of them in check()
+static CalcData make_error(std::mt19937* rng)
+{
+    switch (pick(rng, 0, 3)) {
+    case 0:
+        return {pick(rng, -1000, 1000), 0, '/', 0};
+    case 1:
+        return {pick(rng, -1000, 1000), pick(rng, -1000, 1000), 'q', 0};
+    case 2:
+        return {pick(rng, 2, 9), pick(rng, -9, -1), '^', 0};
+    default:
+        return {pick(rng, -20, -1), 0, '!', 0};
+    }
+}
+
+static CalcData make_overflow(std::mt19937* rng)
+{
+    switch (pick(rng, 0, 3)) {
+    case 0:
+        return {pick(rng, 2000000000, INT_MAX), pick(rng, 2000000000, INT_MAX),
+                '+', 0};
+    case 1:
+        return {pick(rng, 100000, 1000000), pick(rng, 100000, 1000000), 'x', 0};
+    case 2:
+        return {pick(rng, 2, 9), pick(rng, 40, 60), '^', 0};
+    default:
+        return {pick(rng, 13, 100), 0, '!', 0};
+    }
+}
+
+static CalcData make_record(std::mt19937* rng, Mix mix)
+{
+    switch (mix) {
+    case MIX_SKEWED:
+        // nine in ten are additions
+        if (pick(rng, 0, 9) != 0) return make_valid(rng, '+');
+        break;
+    case MIX_ERRORS:
+        if (pick(rng, 0, 1)) return make_error(rng);
+        break;
+    case MIX_OVERFLOW:
+        if (pick(rng, 0, 1)) return make_overflow(rng);
+        break;
+    default:
+        break;
+    }
+
+    return make_valid(rng, OPS[pick(rng, 0, OP_COUNT - 1)]);
+}
+
+static std::vector<CalcData> make_records(Mix mix, size_t n)
+{
+    std::mt19937 rng(12345);
+    std::vector<CalcData> v(n);
+    for (CalcData& d : v) d = make_record(&rng, mix);
+
+    return v;
+}
+
+static std::string to_line(const CalcData* d)
+{
+    char buf[64];
+    if (d->op == '!') {
+        snprintf(buf, sizeof(buf), "%d !\n", d->a);
+    } else {
+        snprintf(buf, sizeof(buf), "%d %d %c\n", d->a, d->b, d->op);
+    }
+
+    return buf;
+}
+
+static void BM_ParseInt(benchmark::State& state)
+{
+    std::mt19937 rng(1);
+    std::vector<std::string> text(BENCH_RECORDS);
+    int digits = (int)state.range(0);
+    for (std::string& s : text) {
+        int v = pick(&rng, 0, 2147483647);
+        for (int i = 10; i > digits; --i) v /= 10;
+        s = std::to_string(pick(&rng, 0, 1) ? v : -v);
+    }
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        for (const std::string& s : text) {
+            int v;
+            calc::parse_int_span(s.data(), s.data() + s.size(), &v);
+            benchmark::DoNotOptimize(v);
+            bytes += s.size();
+        }
+    }
+
+    state.SetItemsProcessed((int64_t)(state.iterations() * text.size()));
+    state.SetBytesProcessed((int64_t)bytes);
+}
+BENCHMARK(BM_ParseInt)->Arg(1)->Arg(4)->Arg(10);
+
+static void BM_Check(benchmark::State& state)
+{
+    std::vector<CalcData> d =
+        make_records((Mix)state.range(0), BENCH_RECORDS);
+
+    for (auto _ : state) {
+        for (const CalcData& x : d) benchmark::DoNotOptimize(calc::check(&x));
+    }
+
+    state.SetLabel(MIX_NAMES[state.range(0)]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * d.size()));
+}
+BENCHMARK(BM_Check)->DenseRange(0, MIX_COUNT - 1);
+
+// compute() on checked records of one op, per width
+template <typename T>
+static void BM_Compute(benchmark::State& state)
+{
+    char op = OPS[state.range(0)];
+    std::mt19937 rng(2);
+    std::vector<CalcDataT<T>> d(BENCH_RECORDS);
+    for (CalcDataT<T>& x : d) {
+        CalcData v = make_valid(&rng, op);
+        x = {v.a, v.b, v.op, 0};
+    }
+
+    for (auto _ : state) {
+        for (CalcDataT<T>& x : d) {
+            benchmark::DoNotOptimize(calc::compute(&x));
+        }
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(std::string(1, op));
+    state.SetItemsProcessed((int64_t)(state.iterations() * d.size()));
+}
+BENCHMARK_TEMPLATE(BM_Compute, int)->DenseRange(0, OP_COUNT - 1);
+BENCHMARK_TEMPLATE(BM_Compute, int64_t)->DenseRange(0, OP_COUNT - 1);
+#if CALC_HAVE_INT128
+BENCHMARK_TEMPLATE(BM_Compute, calc::int128)->DenseRange(0, OP_COUNT - 1);
+#endif
+
+// one kernel set against another on one op: scalar, sse, avx2, avx512, neon
+static const char* const KERNEL_NAMES[] = {"scalar", "sse", "avx2", "avx512",
+                                           "neon"};
+
+static void BM_Kernel(benchmark::State& state)
+{
+    const char* name = KERNEL_NAMES[state.range(0)];
+    const KernelSet* k;
+    if (kernels_select(name, &k) != 0) {
+        state.SkipWithError("kernel not available on this machine");
+        return;
+    }
+
+    int op = (int)state.range(1);
+    std::mt19937 rng(3);
+    std::vector<int> a(BENCH_RECORDS), b(BENCH_RECORDS), r(BENCH_RECORDS),
+        st(BENCH_RECORDS);
+    for (size_t i = 0; i < a.size(); ++i) {
+        CalcData d = make_valid(&rng, OPS[op]);
+        a[i] = d.a;
+        b[i] = d.b;
+    }
+
+    BinaryKernel f = kernels_op(k, op);
+    for (auto _ : state) {
+        f(a.data(), b.data(), r.data(), st.data(), a.size());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(std::string(name) + " " + OPS[op]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * a.size()));
+}
+BENCHMARK(BM_Kernel)->ArgsProduct({{0, 1, 2, 3, 4}, {0, 1, 2, 3}});
+
+// the same for the --real kernels, on doubles of a few magnitudes
+static void BM_RealKernel(benchmark::State& state)
+{
+    const char* name = KERNEL_NAMES[state.range(0)];
+    const KernelSet* k;
+    if (kernels_select(name, &k) != 0) {
+        state.SkipWithError("kernel not available on this machine");
+        return;
+    }
+
+    int op = (int)state.range(1);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> value(-1e6, 1e6);
+    std::vector<double> a(BENCH_RECORDS), b(BENCH_RECORDS), r(BENCH_RECORDS);
+    std::vector<int> st(BENCH_RECORDS);
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = value(rng);
+        b[i] = value(rng);
+    }
+
+    RealKernel f = kernels_real_op(k, op);
+    for (auto _ : state) {
+        f(a.data(), b.data(), r.data(), st.data(), a.size());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(std::string(name) + " " + OPS[op]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * a.size()));
+}
+BENCHMARK(BM_RealKernel)->ArgsProduct({{0, 1, 2, 3, 4}, {0, 1, 2, 3}});
+
+// a set's check kernel on columns, next to BM_Check a record at a time
+static void BM_CheckColumns(benchmark::State& state)
+{
+    const char* name = KERNEL_NAMES[state.range(0)];
+    const KernelSet* k;
+    if (kernels_select(name, &k) != 0) {
+        state.SkipWithError("kernel not available on this machine");
+        return;
+    }
+
+    std::vector<CalcData> d =
+        make_records((Mix)state.range(1), BENCH_RECORDS);
+    std::vector<int> a(d.size()), b(d.size());
+    std::vector<char> op(d.size());
+    for (size_t i = 0; i < d.size(); ++i) {
+        a[i] = d[i].a;
+        b[i] = d[i].b;
+        op[i] = d[i].op;
+    }
+
+    std::vector<uint8_t> status(d.size());
+    std::vector<unsigned> lists[KERNEL_LISTS];
+    unsigned* idx[KERNEL_LISTS];
+    for (int l = 0; l < KERNEL_LISTS; ++l) {
+        lists[l].resize(d.size());
+        idx[l] = lists[l].data();
+    }
+
+    size_t counts[KERNEL_LISTS];
+    for (auto _ : state) {
+        k->check(a.data(), b.data(), op.data(), d.size(), status.data(), idx,
+                 counts);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(std::string(name) + " " + MIX_NAMES[state.range(1)]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * d.size()));
+}
+BENCHMARK(BM_CheckColumns)->ArgsProduct({{0, 1, 2, 3, 4}, {0, 1, 2, 3}});
+
+// the library batch entry point, best kernels for this CPU
+static void BM_Evaluate(benchmark::State& state)
+{
+    std::vector<CalcData> d =
+        make_records((Mix)state.range(0), BENCH_RECORDS);
+    std::vector<int> results(d.size());
+    std::vector<uint8_t> status(d.size());
+
+    for (auto _ : state) {
+        calc::evaluate(d.data(), d.size(), results.data(), status.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(MIX_NAMES[state.range(0)]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * d.size()));
+}
+BENCHMARK(BM_Evaluate)->DenseRange(0, MIX_COUNT - 1);
+
+// the same formula tokenized per row against compiled once and run over
+// columns
+static const char* const RPN_FORMULA[] = {"$1", "$2", "+", "3", "x",
+                                          "$1", "$2", "x", "-"};
+static const int RPN_FORMULA_LEN = 9;
+
+static void BM_RpnEval(benchmark::State& state)
+{
+    std::mt19937 rng(4);
+    std::vector<std::string> rows(BENCH_RECORDS);
+    for (std::string& s : rows) {
+        std::string x = std::to_string(pick(&rng, -1000, 1000));
+        std::string y = std::to_string(pick(&rng, -1000, 1000));
+        s = x + " " + y + " + 3 x " + x + " " + y + " x -";
+    }
+
+    calc::Token toks[RPN_FORMULA_LEN];
+    for (auto _ : state) {
+        for (const std::string& s : rows) {
+            // rows are single-space separated, as the generator writes them
+            int n = 0;
+            const char* p = s.data();
+            const char* e = p + s.size();
+            while (p != e) {
+                toks[n].b = p;
+                while (p != e && *p != ' ') ++p;
+                toks[n++].e = p;
+                if (p != e) ++p;
+            }
+
+            int r;
+            int pos;
+            benchmark::DoNotOptimize(calc::rpn_eval(toks, n, &r, &pos));
+        }
+    }
+
+    state.SetItemsProcessed((int64_t)(state.iterations() * rows.size()));
+}
+BENCHMARK(BM_RpnEval);
+
+static void BM_RpnColumns(benchmark::State& state)
+{
+    calc::Token toks[RPN_FORMULA_LEN];
+    for (int i = 0; i < RPN_FORMULA_LEN; ++i) {
+        toks[i].b = RPN_FORMULA[i];
+        toks[i].e = toks[i].b + strlen(toks[i].b);
+    }
+
+    static calc::RpnProgramT<int> p;
+    int pos;
+    calc::rpn_compile(toks, RPN_FORMULA_LEN, &p, &pos);
+    calc::rpn_optimize(&p);
+
+    std::mt19937 rng(4);
+    std::vector<int> x(BENCH_RECORDS), y(BENCH_RECORDS), r(BENCH_RECORDS);
+    std::vector<uint8_t> st(BENCH_RECORDS);
+    for (size_t i = 0; i < x.size(); ++i) {
+        x[i] = pick(&rng, -1000, 1000);
+        y[i] = pick(&rng, -1000, 1000);
+    }
+
+    const int* cols[] = {x.data(), y.data()};
+    for (auto _ : state) {
+        calc::rpn_run_columns(&p, cols, x.size(), r.data(), st.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetItemsProcessed((int64_t)(state.iterations() * x.size()));
+}
+BENCHMARK(BM_RpnColumns);
+
+// generated batch files, removed again by main()
+static std::string batch_paths[MIX_COUNT];
+
+// return: path of a batch file of mix, written on first use
+static const char* batch_file(Mix mix)
+{
+    std::string* paths = batch_paths;
+    if (!paths[mix].empty()) return paths[mix].c_str();
+
+    char path[] = "/tmp/calculator_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return nullptr;
+
+    std::string text;
+    for (const CalcData& d : make_records(mix, BATCH_RECORDS)) {
+        text += to_line(&d);
+    }
+
+    ssize_t n = write(fd, text.data(), text.size());
+    close(fd);
+    if (n != (ssize_t)text.size()) return nullptr;
+
+    paths[mix] = path;
+
+    return paths[mix].c_str();
+}
+
+// the batch engines an end-to-end run can pick
+enum Engine { ENGINE_SCALAR, ENGINE_SIMD, ENGINE_THREADS, ENGINE_COUNT };
+
+static const char* const ENGINE_NAMES[ENGINE_COUNT] = {"scalar", "simd",
+                                                       "threads"};
+
+// the calculator executable over a whole batch file, output discarded
+static void BM_Batch(benchmark::State& state)
+{
+    Mix mix = (Mix)state.range(0);
+    Engine engine = (Engine)state.range(1);
+
+    const char* in = batch_file(mix);
+    if (!in) {
+        state.SkipWithError("cannot write the batch file");
+        return;
+    }
+
+    std::vector<const char*> argv = {CALCULATOR_EXE, "--input", in,
+                                     "--output", "/dev/null"};
+    if (engine == ENGINE_SCALAR) {
+        argv.push_back("--kernel");
+        argv.push_back("scalar");
+    } else if (engine == ENGINE_THREADS) {
+        argv.push_back("--threads");
+        argv.push_back("0");
+    }
+    argv.push_back(nullptr);
+
+    for (auto _ : state) {
+        pid_t pid;
+        if (posix_spawn(&pid, CALCULATOR_EXE, nullptr, nullptr,
+                        (char* const*)argv.data(), environ) != 0) {
+            state.SkipWithError("cannot run " CALCULATOR_EXE);
+            return;
+        }
+
+        // per-record errors make the exit status 1 or 2; only a crash
+        // counts
+        int ws;
+        waitpid(pid, &ws, 0);
+        if (!WIFEXITED(ws)) {
+            state.SkipWithError("calculator did not exit normally");
+            return;
+        }
+    }
+
+    state.SetLabel(std::string(MIX_NAMES[mix]) + " " + ENGINE_NAMES[engine]);
+    state.SetItemsProcessed((int64_t)(state.iterations() * BATCH_RECORDS));
+}
+BENCHMARK(BM_Batch)
+    ->ArgsProduct({{MIX_UNIFORM, MIX_SKEWED, MIX_ERRORS, MIX_OVERFLOW},
+                   {ENGINE_SCALAR, ENGINE_SIMD, ENGINE_THREADS}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime(); // the work is in the child, not this process
+
+// --block-size and --queue of the piped runs below, and the padding of
+// every PIPED_LONG_EVERY-th line, which outgrows a block many times over
+static const char PIPED_BLOCK[] = "4096";
+static const char PIPED_QUEUE[] = "1";
+static const size_t PIPED_PAD = 5 * 4096;
+static const size_t PIPED_LONG_EVERY = 997;
+
+// return: uniform records with every PIPED_LONG_EVERY-th line padded past
+// PIPED_PAD bytes, generated on first use
+static const std::string& long_line_text()
+{
+    static std::string text;
+    if (!text.empty()) return text;
+
+    std::vector<CalcData> v = make_records(MIX_UNIFORM, BENCH_RECORDS);
+    for (size_t i = 0; i < v.size(); ++i) {
+        std::string line = to_line(&v[i]);
+        if (i % PIPED_LONG_EVERY == 0) {
+            line.insert(line.find(' ') + 1, PIPED_PAD, ' ');
+        }
+        text += line;
+    }
+
+    return text;
+}
+
+// runs argv with text written to its stdin through a pipe, and its stdout
+// read into *out
+// return: 0 - ok; -1 - it could not be run or did not exit normally
+static int run_piped(const std::vector<const char*>& argv,
+                     const std::string& text, std::string* out)
+{
+    int in[2], res[2];
+    if (pipe(in) != 0) return -1;
+    if (pipe(res) != 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, res[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&fa, in[1]);
+    posix_spawn_file_actions_addclose(&fa, res[0]);
+
+    pid_t pid;
+    int spawned = posix_spawn(&pid, argv[0], &fa, nullptr,
+                              (char* const*)argv.data(), environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(in[0]);
+    close(res[1]);
+    if (spawned != 0) {
+        close(in[1]);
+        close(res[0]);
+        return -1;
+    }
+
+    // the child may stop reading early; then the write fails with EPIPE
+    // instead of raising SIGPIPE in this process
+    std::thread writer([&text, fd = in[1]] {
+        sigset_t pipe_sig;
+        sigemptyset(&pipe_sig);
+        sigaddset(&pipe_sig, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_sig, nullptr);
+
+        size_t at = 0;
+        while (at < text.size()) {
+            ssize_t n = write(fd, text.data() + at, text.size() - at);
+            if (n <= 0) break;
+            at += (size_t)n;
+        }
+        close(fd);
+    });
+
+    out->clear();
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(res[0], buf, sizeof(buf))) > 0) {
+        out->append(buf, (size_t)n);
+    }
+    close(res[0]);
+    writer.join();
+
+    int ws;
+    waitpid(pid, &ws, 0);
+
+    return WIFEXITED(ws) ? 0 : -1;
+}
+
+// the piped evaluators against the single-threaded stream over lines longer
+// than --block-size, with the reader bounded by --queue; a stress check of
+// growing a block while every other one is in flight as much as a benchmark
+static void BM_PipedLongLines(benchmark::State& state)
+{
+    const std::string& text = long_line_text();
+
+    std::string want;
+    std::vector<const char*> single = {CALCULATOR_EXE, "--threads", "1",
+                                       nullptr};
+    if (run_piped(single, text, &want) != 0) {
+        state.SkipWithError("cannot run " CALCULATOR_EXE);
+        return;
+    }
+
+    std::vector<const char*> argv = {CALCULATOR_EXE, "--threads", "2",
+                                     "--block-size", PIPED_BLOCK,
+                                     "--queue", PIPED_QUEUE, nullptr};
+
+    std::string got;
+    for (auto _ : state) {
+        if (run_piped(argv, text, &got) != 0) {
+            state.SkipWithError("calculator did not exit normally");
+            return;
+        }
+        if (got != want) {
+            state.SkipWithError("piped results differ from --threads 1");
+            return;
+        }
+    }
+
+    state.SetItemsProcessed((int64_t)(state.iterations() * BENCH_RECORDS));
+}
+BENCHMARK(BM_PipedLongLines)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// the argv a per-process caller passes: operands only, taking the path
+// that skips getopt_long(), and the same expression behind an option
+static const char* const STARTUP_NAMES[] = {"operands", "options"};
+
+// exec to exit of the calculator executable on one expression
+static void BM_Startup(benchmark::State& state)
+{
+    std::vector<const char*> argv = {CALCULATOR_EXE};
+    if (state.range(0) == 1) {
+        argv.push_back("--width");
+        argv.push_back("32");
+    }
+    argv.push_back("3");
+    argv.push_back("4");
+    argv.push_back("+");
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+
+    for (auto _ : state) {
+        pid_t pid;
+        if (posix_spawn(&pid, CALCULATOR_EXE, &fa, nullptr,
+                        (char* const*)argv.data(), environ) != 0) {
+            state.SkipWithError("cannot run " CALCULATOR_EXE);
+            break;
+        }
+
+        int ws;
+        waitpid(pid, &ws, 0);
+        if (!WIFEXITED(ws) || WEXITSTATUS(ws) != 0) {
+            state.SkipWithError("calculator failed");
+            break;
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+
+    state.SetLabel(STARTUP_NAMES[state.range(0)]);
+}
+BENCHMARK(BM_Startup)
+    ->DenseRange(0, 1)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    for (const std::string& path : batch_paths) {
+        if (!path.empty()) unlink(path.c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,928 @@
+#include "bigint.h"
+#include "calculator.h"
+#include "calculator_constexpr.h"
+#include "kernels.h"
+#include "memo.h"
+
+#include <mathlib.h>
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Differential fuzzing of every engine against the reference: check(), then
+// the mathlib::math_* call for the op. One input is a batch of expressions
+// and an RPN program over it. Each expression goes through compute<int>,
+// evaluate(), every kernel and check kernel this CPU runs, the memo,
+// rpn_eval(), the compiled "$1 $2 op" run by rows and by columns, and the
+// constexpr eval(); the 64 and 128-bit engines and bigint have to agree
+// with it and with each other. The program runs before and after
+// rpn_optimize(), by rows and by columns, against rpn_eval() of the same
+// tokens with the values written in. The --real and --fixed kernels run on
+// values made from the same records, against compute<double>() and
+// compute_fixed(). Any difference prints the expression and aborts.
+//
+// Against libFuzzer with Clang (CALC_FUZZ_LIBFUZZER). Other compilers get a
+// driver of its own that takes libFuzzer's -runs= and -seed= and feeds
+// random inputs, or replays the files named on the command line.
+
+using calc::CalcData;
+using calc::CalcDataT;
+using calc::Status;
+using calc::Token;
+
+static const size_t FUZZ_RECORDS_MAX = 256;
+static const int FUZZ_PROGRAM_MAX = 48;
+static const int FUZZ_COLS = 3;
+
+// INT_MIN/INT_MAX and their neighbours, divisors around 0, and the
+// exponents and factorials where 32, 64 and 128 bits stop being enough
+static const int SPECIALS[] = {
+    0,     1,     -1,     2,      -2,      3,       -3,         INT_MAX,
+    INT_MIN, INT_MAX - 1, INT_MIN + 1,    10,      12,         13,
+    20,    21,    30,     31,     32,      33,      34,         62,
+    63,    64,    126,    127,    128,     215,     216,        1290,
+    1291,  46340, 46341,  -46340, -46341,  65535,   65536,      -65536,
+    2097151, 2097152, -2097152, 1 << 30, -(1 << 30),
+};
+
+static const int SPECIAL_COUNT = (int)(sizeof(SPECIALS) / sizeof(int));
+
+static const char OPS[] = {'+', '-', 'x', '/', '^', '!'};
+static const int OP_COUNT = (int)sizeof(OPS);
+
+struct Input
+{
+    const uint8_t* p;
+    size_t n;
+};
+
+// bytes past the end read as 0
+static uint8_t take_u8(Input* in)
+{
+    if (in->n == 0) return 0;
+
+    in->n--;
+    return *in->p++;
+}
+
+static int take_value(Input* in)
+{
+    uint8_t sel = take_u8(in);
+    if ((sel & 3) < 2) return SPECIALS[(sel >> 2) % SPECIAL_COUNT];
+    if ((sel & 3) == 2) return (int8_t)take_u8(in);
+
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v = v << 8 | take_u8(in);
+
+    return (int)v;
+}
+
+// mostly a real op, now and then any byte
+static char take_op(Input* in)
+{
+    uint8_t sel = take_u8(in);
+    if (sel < 240) return OPS[sel % OP_COUNT];
+
+    return (char)take_u8(in);
+}
+
+// return: buf, holding v in decimal
+template <typename T>
+static char* to_dec(T v, char* buf)
+{
+    char tmp[48];
+    int len = 0;
+    int neg = v < 0;
+
+    // digit by digit from a negative v, so the smallest T needs no care
+    do {
+        int digit = (int)(v % 10);
+        tmp[len++] = (char)('0' + (digit < 0 ? -digit : digit));
+        v /= 10;
+    } while (v != 0);
+
+    char* out = buf;
+    if (neg) *out++ = '-';
+    while (len > 0) *out++ = tmp[--len];
+    *out = '\0';
+
+    return buf;
+}
+
+template <typename T>
+struct Outcome
+{
+    Status status;
+    T value; // 0 unless status is STATUS_OK
+};
+
+template <typename T>
+static Outcome<T> outcome(Status status, T value)
+{
+    Outcome<T> r = {status, status == calc::STATUS_OK ? value : T(0)};
+    return r;
+}
+
+template <typename T>
+static bool same(Outcome<T> want, Outcome<T> got)
+{
+    return want.status == got.status && want.value == got.value;
+}
+
+template <typename T>
+static const char* describe(Outcome<T> r, char* buf)
+{
+    if (r.status == calc::STATUS_OK) return to_dec(r.value, buf);
+
+    snprintf(buf, 64, "status %d (%s)", (int)r.status,
+             calc::status_message(r.status));
+
+    return buf;
+}
+
+template <typename T>
+[[noreturn]] static void fail(const char* engine, const char* expr,
+                              Outcome<T> want, Outcome<T> got)
+{
+    char w[64];
+    char g[64];
+    fprintf(stderr, "calculator_fuzz: %s disagrees on %s: want %s, got %s\n",
+            engine, expr, describe(want, w), describe(got, g));
+    abort();
+}
+
+template <typename T>
+static void expect(const char* engine, const char* expr, Outcome<T> want,
+                   Outcome<T> got)
+{
+    if (!same(want, got)) fail(engine, expr, want, got);
+}
+
+// a wider W agrees with the narrower N where N has room, and overflows N
+// only with a value out of N's range
+template <typename N, typename W>
+static void expect_wider(const char* engine, const char* expr, Outcome<N> n,
+                         Outcome<W> got)
+{
+    int ok;
+    if (n.status == calc::STATUS_OVERFLOW) {
+        ok = got.status == calc::STATUS_OVERFLOW ||
+             (got.status == calc::STATUS_OK &&
+              (got.value > (W)calc::eval_max<N>() ||
+               got.value < (W)calc::eval_min<N>()));
+    } else {
+        ok = got.status == n.status && got.value == (W)n.value;
+    }
+
+    if (!ok) fail(engine, expr, outcome(n.status, (W)n.value), got);
+}
+
+static void format_expr(int a, int b, char op, char* buf, size_t n)
+{
+    if (op > ' ' && op < 0x7f) {
+        snprintf(buf, n, "%d %d %c", a, b, op);
+    } else {
+        snprintf(buf, n, "%d %d \\x%02x", a, b, (unsigned)(unsigned char)op);
+    }
+}
+
+// return: the mathlib code of a op b for an op with a mathlib call
+static int math_code(int a, int b, char op, int* out)
+{
+    switch (op) {
+    case '+':
+        return mathlib::math_add(a, b, out);
+    case '-':
+        return mathlib::math_sub(a, b, out);
+    case 'x':
+        return mathlib::math_mul(a, b, out);
+    case '/':
+        return mathlib::math_div(a, b, out);
+    case '^':
+        // mathlib may take a step per unit of exponent; for bases 0 and +-1
+        // only its parity, and whether it is 0, count
+        if (a >= -1 && a <= 1 && b > 2) b = 2 - (b & 1);
+        return mathlib::math_pow(a, b, out);
+    default:
+        return mathlib::math_fact(a, out);
+    }
+}
+
+static Outcome<int> reference(int a, int b, char op)
+{
+    CalcData d = {a, b, op, 0};
+    Status st = calc::check(&d);
+    if (st != calc::STATUS_OK) return outcome(st, 0);
+
+    int v = 0;
+    st = calc::status_from_math(math_code(a, b, op, &v));
+
+    return outcome(st, v);
+}
+
+template <typename T>
+static Outcome<T> computed(T a, T b, char op)
+{
+    CalcDataT<T> d = {a, b, op, 0};
+    Status st = calc::check(&d);
+    if (st == calc::STATUS_OK) st = calc::compute(&d);
+
+    return outcome(st, d.result);
+}
+
+// checked expressions only, as the batch engine asks it
+template <typename T>
+static Outcome<T> memoized(MemoCache<T>* memo, T a, T b, char op)
+{
+    CalcDataT<T> d = {a, b, op, 0};
+    Status st = calc::check(&d);
+    if (st != calc::STATUS_OK) return outcome(st, T(0));
+    if (!memo) return computed(a, b, op);
+
+    if (!memo_find(memo, &d, &st)) {
+        st = calc::compute(&d);
+        memo_store(memo, &d, st);
+    }
+
+    return outcome(st, d.result);
+}
+
+template <typename T>
+static Outcome<T> folded(T a, T b, char op)
+{
+    calc::EvalResultT<T> r = calc::eval(a, b, op);
+
+    return outcome(r.status, r.value);
+}
+
+// return: 0 - a b op, or a ! for '!', is not RPN the op can be read from
+template <typename T>
+static int rpn(int a, int b, char op, Outcome<T>* out)
+{
+    if (!memchr(OPS, op, sizeof(OPS)) || (op == '!' && b != 0)) return 0;
+
+    char ta[16];
+    char tb[16];
+    to_dec(a, ta);
+    to_dec(b, tb);
+
+    Token toks[3] = {{ta, ta + strlen(ta)}, {tb, tb + strlen(tb)}, {&op, &op}};
+    toks[2].e = toks[2].b + 1;
+    if (op == '!') toks[1] = toks[2];
+
+    T v = 0;
+    int pos = 0;
+    Status st = calc::rpn_eval(toks, op == '!' ? 2 : 3, &v, &pos);
+    *out = outcome(st, v);
+
+    return 1;
+}
+
+static void check_bigint(int a, int b, char op, Outcome<calc::int128> wide,
+                         const char* expr)
+{
+    std::string digits;
+    int rc;
+    if (op == '!' && b == 0 && a >= 0 && a <= 64) {
+        rc = bigint_fact((uint64_t)a, &digits);
+    } else if (op == '^' && b >= 0 && b <= 512) {
+        char base[16];
+        to_dec(a, base);
+        rc = bigint_pow(base, base + strlen(base), (uint64_t)b, &digits);
+    } else {
+        return;
+    }
+
+    char want[48];
+    if (rc != 0) {
+        fprintf(stderr, "calculator_fuzz: bigint refuses %s\n", expr);
+        abort();
+    }
+
+    if (wide.status == calc::STATUS_OK) {
+        if (digits != to_dec(wide.value, want)) {
+            fprintf(stderr, "calculator_fuzz: bigint disagrees on %s: "
+                            "want %s, got %s\n",
+                    expr, want, digits.c_str());
+            abort();
+        }
+        return;
+    }
+
+    // beyond int128 means at least 39 digits
+    size_t len = digits.size() - (digits[0] == '-');
+    if (wide.status != calc::STATUS_OVERFLOW || len < 39) {
+        fprintf(stderr, "calculator_fuzz: bigint gives %s for %s, int128 "
+                        "status %d\n",
+                digits.c_str(), expr, (int)wide.status);
+        abort();
+    }
+}
+
+static void check_record(const CalcData* d, const char* expr)
+{
+    static MemoCache<int>* memo32 = memo_open<int>(64);
+    static MemoCache<int64_t>* memo64 = memo_open<int64_t>(64);
+
+    int a = d->a;
+    int b = d->b;
+    char op = d->op;
+    Outcome<int> ref = reference(a, b, op);
+
+    expect("compute<int>", expr, ref, computed(a, b, op));
+    expect("eval<int>", expr, ref, folded(a, b, op));
+    expect("memo<int>", expr, ref, memoized(memo32, a, b, op));
+
+    Outcome<int> r32;
+    if (rpn(a, b, op, &r32)) expect("rpn_eval<int>", expr, ref, r32);
+
+    Outcome<int64_t> c64 = computed<int64_t>(a, b, op);
+    expect_wider("compute<int64_t>", expr, ref, c64);
+    expect("eval<int64_t>", expr, c64, folded<int64_t>(a, b, op));
+    expect("memo<int64_t>", expr, c64, memoized<int64_t>(memo64, a, b, op));
+
+    Outcome<int64_t> r64;
+    if (rpn(a, b, op, &r64)) expect("rpn_eval<int64_t>", expr, c64, r64);
+
+#if CALC_HAVE_INT128
+    typedef calc::int128 int128;
+
+    Outcome<int128> c128 = computed<int128>(a, b, op);
+    expect_wider("compute<int128>", expr, c64, c128);
+    expect("eval<int128>", expr, c128, folded<int128>(a, b, op));
+
+    Outcome<int128> r128;
+    if (rpn(a, b, op, &r128)) expect("rpn_eval<int128>", expr, c128, r128);
+
+    check_bigint(a, b, op, c128, expr);
+#endif
+}
+
+// sets of this build and CPU, scalar included
+static std::vector<const KernelSet*> kernel_sets()
+{
+    static const char* const NAMES[] = {"scalar", "sse", "avx2", "avx512",
+                                        "neon"};
+
+    std::vector<const KernelSet*> sets;
+    for (const char* name : NAMES) {
+        const KernelSet* k;
+        if (kernels_select(name, &k) == 0) sets.push_back(k);
+    }
+
+    return sets;
+}
+
+// each kernel against the mathlib code for every expression of its op,
+// whether or not check() would let it through
+static void check_kernels(const CalcData* d, size_t n, char (*exprs)[48])
+{
+    static const std::vector<const KernelSet*> sets = kernel_sets();
+
+    std::vector<int> a(n), b(n), want(n), code(n), result(n), status(n);
+    std::vector<size_t> idx(n);
+
+    for (int k = 0; k < KERNEL_OPS; ++k) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (kernels_op_index(d[i].op) != k) continue;
+
+            a[m] = d[i].a;
+            b[m] = d[i].b;
+            want[m] = 0;
+            code[m] = math_code(a[m], b[m], d[i].op, &want[m]);
+            idx[m] = i;
+            m++;
+        }
+        if (m == 0) continue;
+
+        for (const KernelSet* set : sets) {
+            kernels_op(set, k)(a.data(), b.data(), result.data(),
+                               status.data(), m);
+
+            for (size_t i = 0; i < m; ++i) {
+                int ok = status[i] == code[i] &&
+                         (code[i] != mathlib::MATH_OK || result[i] == want[i]);
+                if (ok) continue;
+
+                fprintf(stderr, "calculator_fuzz: kernels %s disagree on %s: "
+                                "want code %d value %d, got code %d value %d\n",
+                        set->name, exprs[idx[i]], code[i], want[i], status[i],
+                        status[i] == mathlib::MATH_OK ? result[i] : 0);
+                abort();
+            }
+        }
+    }
+}
+
+// a finite double of any magnitude from two ints: v scaled by 2^(e % 2100
+// - 1050), or v itself where that is not finite
+static double real_value(int v, int e)
+{
+    double r = std::ldexp((double)v, (int)((unsigned)e % 2100) - 1050);
+    return std::isfinite(r) ? r : (double)v;
+}
+
+// each --real kernel against compute<double>() of the op, bit for bit
+static void check_real_kernels(const CalcData* d, size_t n,
+                               char (*exprs)[48])
+{
+    static const std::vector<const KernelSet*> sets = kernel_sets();
+
+    std::vector<double> a(n), b(n), want(n), result(n);
+    std::vector<int> code(n), status(n);
+    std::vector<size_t> idx(n);
+
+    for (int k = 0; k < KERNEL_OPS; ++k) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (kernels_op_index(d[i].op) != k) continue;
+
+            calc::CalcDataT<double> r = {real_value(d[i].a, d[i].b),
+                                         real_value(d[i].b, d[i].a),
+                                         d[i].op, 0};
+            a[m] = r.a;
+            b[m] = r.b;
+            code[m] = calc::compute(&r);
+            want[m] = r.result;
+            idx[m] = i;
+            m++;
+        }
+        if (m == 0) continue;
+
+        for (const KernelSet* set : sets) {
+            kernels_real_op(set, k)(a.data(), b.data(), result.data(),
+                                    status.data(), m);
+
+            for (size_t i = 0; i < m; ++i) {
+                int ok = status[i] == code[i] &&
+                         (code[i] != calc::STATUS_OK ||
+                          memcmp(&result[i], &want[i], sizeof(double)) == 0);
+                if (ok) continue;
+
+                fprintf(stderr, "calculator_fuzz: real kernels %s disagree "
+                                "on %s as %a %c %a: want status %d value %a, "
+                                "got status %d value %a\n",
+                        set->name, exprs[idx[i]], a[i], d[idx[i]].op, b[i],
+                        code[i], want[i], status[i], result[i]);
+                abort();
+            }
+        }
+    }
+}
+
+#if CALC_HAVE_INT128
+// each --fixed kernel against compute_fixed() of the op, on 64-bit values
+// made of two records
+static void check_fixed_kernels(const CalcData* d, size_t n,
+                                char (*exprs)[48])
+{
+    static const std::vector<const KernelSet*> sets = kernel_sets();
+
+    std::vector<int64_t> a(n), b(n), want(n), result(n);
+    std::vector<int> code(n), status(n);
+    std::vector<size_t> idx(n);
+
+    for (int k = 0; k < FIXED_KERNEL_OPS; ++k) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (kernels_op_index(d[i].op) != k) continue;
+
+            const CalcData* next = &d[(i + 1) % n];
+            calc::CalcDataT<int64_t> r = {
+                (int64_t)((uint64_t)(int64_t)d[i].a << 32 ^
+                          (uint32_t)next->b),
+                (int64_t)((uint64_t)(int64_t)d[i].b << 32 ^
+                          (uint32_t)next->a),
+                d[i].op, 0};
+            a[m] = r.a;
+            b[m] = r.b;
+            code[m] = calc::compute_fixed(&r, 2);
+            want[m] = r.result;
+            idx[m] = i;
+            m++;
+        }
+        if (m == 0) continue;
+
+        for (const KernelSet* set : sets) {
+            kernels_fixed_op(set, k)(a.data(), b.data(), result.data(),
+                                     status.data(), m);
+
+            for (size_t i = 0; i < m; ++i) {
+                int ok = status[i] == code[i] &&
+                         (code[i] != calc::STATUS_OK || result[i] == want[i]);
+                if (ok) continue;
+
+                fprintf(stderr, "calculator_fuzz: fixed kernels %s disagree "
+                                "on %s as %lld %c %lld: want status %d, got "
+                                "status %d\n",
+                        set->name, exprs[idx[i]], (long long)a[i],
+                        d[idx[i]].op, (long long)b[i], code[i], status[i]);
+                abort();
+            }
+        }
+    }
+}
+#endif
+
+// each check kernel against check(), and its split of the batch against
+// the one that follows from check(): every record in the list of its op,
+// or the failed one, in input order
+static void check_validators(const CalcData* d, size_t n, char (*exprs)[48])
+{
+    static const std::vector<const KernelSet*> sets = kernel_sets();
+
+    std::vector<int> a(n), b(n);
+    std::vector<char> op(n);
+    std::vector<uint8_t> want(n), status(n);
+    std::vector<unsigned> lists[KERNEL_LISTS];
+    unsigned* idx[KERNEL_LISTS];
+    size_t counts[KERNEL_LISTS];
+
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = d[i].a;
+        b[i] = d[i].b;
+        op[i] = d[i].op;
+        want[i] = calc::check(&d[i]);
+    }
+    for (int l = 0; l < KERNEL_LISTS; ++l) {
+        lists[l].resize(n);
+        idx[l] = lists[l].data();
+    }
+
+    for (const KernelSet* set : sets) {
+        set->check(a.data(), b.data(), op.data(), n, status.data(), idx,
+                   counts);
+
+        size_t at[KERNEL_LISTS] = {};
+        for (size_t i = 0; i < n; ++i) {
+            int col = kernels_op_index(op[i]);
+            int l = want[i] != calc::STATUS_OK ? KERNEL_LIST_FAILED
+                    : col < 0                   ? KERNEL_LIST_OTHER
+                                                : col;
+
+            int ok = status[i] == want[i] && at[l] < counts[l] &&
+                     lists[l][at[l]] == i;
+            at[l]++;
+            if (ok) continue;
+
+            fprintf(stderr, "calculator_fuzz: check kernel %s disagrees on "
+                            "%s: want status %d in list %d, got status %d\n",
+                    set->name, exprs[i], want[i], l, status[i]);
+            abort();
+        }
+
+        for (int l = 0; l < KERNEL_LISTS; ++l) {
+            if (at[l] == counts[l]) continue;
+
+            fprintf(stderr, "calculator_fuzz: check kernel %s puts %zu "
+                            "records in list %d, not %zu\n",
+                    set->name, counts[l], l, at[l]);
+            abort();
+        }
+    }
+}
+
+static void check_evaluate(const CalcData* d, size_t n, char (*exprs)[48])
+{
+    static const std::vector<const KernelSet*> sets = kernel_sets();
+
+    std::vector<int> results(n);
+    std::vector<uint8_t> status(n);
+    for (const KernelSet* set : sets) {
+        calc::evaluate(set, d, n, results.data(), status.data());
+
+        for (size_t i = 0; i < n; ++i) {
+            Outcome<int> got = {(Status)status[i], results[i]};
+            expect(set->name, exprs[i], reference(d[i].a, d[i].b, d[i].op),
+                   got);
+        }
+    }
+}
+
+// "$1 $2 op", or "$1 !", compiled and run on the batch as columns
+static void check_columns(const CalcData* d, size_t n, char (*exprs)[48])
+{
+    static calc::RpnProgramT<int> prog;
+
+    std::vector<int> a(n), b(n), results(n);
+    std::vector<uint8_t> status(n);
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = d[i].a;
+        b[i] = d[i].b;
+    }
+    const int* cols[2] = {a.data(), b.data()};
+
+    for (char op : OPS) {
+        char text[] = "$1 $2 ?";
+        text[6] = op;
+        Token toks[3] = {{text, text + 2}, {text + 3, text + 5},
+                         {text + 6, text + 7}};
+        if (op == '!') toks[1] = toks[2];
+
+        int ntok = op == '!' ? 2 : 3;
+        int pos = 0;
+        if (calc::rpn_compile(toks, ntok, &prog, &pos) != calc::STATUS_OK) {
+            fprintf(stderr, "calculator_fuzz: %s does not compile\n", text);
+            abort();
+        }
+        calc::rpn_optimize(&prog);
+
+        calc::rpn_run_columns(&prog, cols, n, results.data(), status.data());
+
+        for (size_t i = 0; i < n; ++i) {
+            Outcome<int> want = reference(a[i], op == '!' ? 0 : b[i], op);
+            Outcome<int> got = {(Status)status[i], results[i]};
+            if (!same(want, got)) {
+                char expr[96];
+                snprintf(expr, sizeof(expr), "%s with $1=%d $2=%d", text, a[i],
+                         b[i]);
+                fail("rpn_run_columns", expr, want, got);
+            }
+
+            int args[2] = {a[i], b[i]};
+            int v = 0;
+            Status st = calc::rpn_run(&prog, args, &v, &pos);
+            expect("rpn_run", exprs[i], want, outcome(st, v));
+        }
+    }
+}
+
+// a program of $1..$FUZZ_COLS, numbers and ops whose stack shape holds,
+// one token per row of text
+static int take_program(Input* in, char (*text)[16])
+{
+    int want = take_u8(in) % (FUZZ_PROGRAM_MAX / 2);
+    int n = 0;
+    int depth = 0;
+
+    for (int i = 0; i < want; ++i) {
+        uint8_t t = take_u8(in);
+        char op = OPS[(t >> 2) % OP_COUNT];
+
+        if ((t & 3) >= 2 && depth >= (op == '!' ? 1 : 2)) {
+            text[n][0] = op;
+            text[n][1] = '\0';
+            if (op != '!') depth--;
+        } else if (t & 1) {
+            snprintf(text[n], 16, "$%d", 1 + (t >> 2) % FUZZ_COLS);
+            depth++;
+        } else {
+            to_dec(take_value(in), text[n]);
+            depth++;
+        }
+        n++;
+    }
+
+    if (depth == 0) {
+        snprintf(text[n++], 16, "$1");
+        depth = 1;
+    }
+
+    while (depth > 1) {
+        text[n][0] = OPS[take_u8(in) % (OP_COUNT - 1)];
+        text[n++][1] = '\0';
+        depth--;
+    }
+
+    return n;
+}
+
+static void format_program(char (*text)[16], int ntok, const int* args,
+                           char* buf, size_t n)
+{
+    size_t at = 0;
+    for (int i = 0; i < ntok && at < n; ++i) {
+        at += (size_t)snprintf(buf + at, n - at, "%s ", text[i]);
+    }
+
+    for (int k = 0; k < FUZZ_COLS && at < n; ++k) {
+        at += (size_t)snprintf(buf + at, n - at, "%s$%d=%d", k ? " " : "with ",
+                               k + 1, args[k]);
+    }
+}
+
+// the program compiled, and compiled then optimized, each run by rows and
+// by columns, against rpn_eval() with $k written out as row values
+template <typename T>
+static void check_program(char (*text)[16], int ntok, const int* const* cols,
+                          size_t n)
+{
+    static calc::RpnProgramT<T> plain;
+    static calc::RpnProgramT<T> opt;
+
+    Token toks[FUZZ_PROGRAM_MAX];
+    for (int i = 0; i < ntok; ++i) {
+        toks[i].b = text[i];
+        toks[i].e = text[i] + strlen(text[i]);
+    }
+
+    int pos = 0;
+    if (calc::rpn_compile(toks, ntok, &plain, &pos) != calc::STATUS_OK) {
+        char expr[1024];
+        int none[FUZZ_COLS] = {0, 0, 0};
+        format_program(text, ntok, none, expr, sizeof(expr));
+        fprintf(stderr, "calculator_fuzz: %s does not compile at %d\n", expr,
+                pos);
+        abort();
+    }
+    opt = plain;
+    calc::rpn_optimize(&opt);
+
+    std::vector<T> wide[FUZZ_COLS];
+    const T* tcols[FUZZ_COLS];
+    for (int k = 0; k < FUZZ_COLS; ++k) {
+        wide[k].assign(cols[k], cols[k] + n);
+        tcols[k] = wide[k].data();
+    }
+
+    std::vector<T> res_plain(n), res_opt(n);
+    std::vector<uint8_t> st_plain(n), st_opt(n);
+    calc::rpn_run_columns(&plain, tcols, n, res_plain.data(), st_plain.data());
+    calc::rpn_run_columns(&opt, tcols, n, res_opt.data(), st_opt.data());
+
+    char values[FUZZ_COLS][16];
+    Token row[FUZZ_PROGRAM_MAX];
+    for (size_t i = 0; i < n; ++i) {
+        int args[FUZZ_COLS];
+        T targs[FUZZ_COLS];
+        for (int k = 0; k < FUZZ_COLS; ++k) {
+            args[k] = cols[k][i];
+            targs[k] = (T)args[k];
+            to_dec(args[k], values[k]);
+        }
+
+        for (int t = 0; t < ntok; ++t) {
+            row[t] = toks[t];
+            if (text[t][0] == '$') {
+                const char* v = values[text[t][1] - '1'];
+                row[t].b = v;
+                row[t].e = v + strlen(v);
+            }
+        }
+
+        T v = 0;
+        int want_pos = 0;
+        Status st = calc::rpn_eval(row, ntok, &v, &want_pos);
+        Outcome<T> want = outcome(st, v);
+
+        const char* names[4] = {"rpn_run", "rpn_run optimized",
+                                "rpn_run_columns", "rpn_run_columns optimized"};
+        Outcome<T> got[4];
+        int got_pos[2] = {0, 0};
+
+        v = 0;
+        st = calc::rpn_run(&plain, targs, &v, &got_pos[0]);
+        got[0] = outcome(st, v);
+        v = 0;
+        st = calc::rpn_run(&opt, targs, &v, &got_pos[1]);
+        got[1] = outcome(st, v);
+        got[2] = outcome((Status)st_plain[i], res_plain[i]);
+        got[3] = outcome((Status)st_opt[i], res_opt[i]);
+
+        for (int e = 0; e < 4; ++e) {
+            int pos_ok = e >= 2 || want.status == calc::STATUS_OK ||
+                         got_pos[e] == want_pos;
+            if (same(want, got[e]) && pos_ok) continue;
+
+            char expr[1024];
+            format_program(text, ntok, args, expr, sizeof(expr));
+            if (!pos_ok) {
+                fprintf(stderr, "calculator_fuzz: %s fails %s at token %d, "
+                                "not %d\n",
+                        names[e], expr, got_pos[e], want_pos);
+                abort();
+            }
+            fail(names[e], expr, want, got[e]);
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static CalcData d[FUZZ_RECORDS_MAX];
+    static char exprs[FUZZ_RECORDS_MAX][48];
+    static char text[FUZZ_PROGRAM_MAX][16];
+
+    Input in = {data, size};
+    size_t want = 1 + take_u8(&in) % FUZZ_RECORDS_MAX;
+    int ntok = take_program(&in, text);
+
+    size_t n = 0;
+    do {
+        d[n].a = take_value(&in);
+        d[n].op = take_op(&in);
+        // '!' mostly gets the b of 0 that check() asks for
+        d[n].b = d[n].op == '!' && (take_u8(&in) & 7) != 0 ? 0
+                                                           : take_value(&in);
+        d[n].result = 0;
+        format_expr(d[n].a, d[n].b, d[n].op, exprs[n], sizeof(exprs[n]));
+        n++;
+    } while (n < want && in.n > 0);
+
+    for (size_t i = 0; i < n; ++i) check_record(&d[i], exprs[i]);
+
+    check_kernels(d, n, exprs);
+    check_real_kernels(d, n, exprs);
+#if CALC_HAVE_INT128
+    check_fixed_kernels(d, n, exprs);
+#endif
+    check_validators(d, n, exprs);
+    check_evaluate(d, n, exprs);
+    check_columns(d, n, exprs);
+
+    // $3 is $1 backwards, so rows also combine values of different records
+    std::vector<int> cols[FUZZ_COLS];
+    for (int k = 0; k < FUZZ_COLS; ++k) cols[k].resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        cols[0][i] = d[i].a;
+        cols[1][i] = d[i].b;
+        cols[2][i] = d[n - 1 - i].a;
+    }
+    const int* cp[FUZZ_COLS] = {cols[0].data(), cols[1].data(),
+                                cols[2].data()};
+
+    check_program<int>(text, ntok, cp, n);
+    check_program<int64_t>(text, ntok, cp, n);
+#if CALC_HAVE_INT128
+    check_program<calc::int128>(text, ntok, cp, n);
+#endif
+
+    return 0;
+}
+
+#ifndef CALC_FUZZ_LIBFUZZER
+
+static const size_t FUZZ_INPUT_MAX = 4096;
+
+// return: 0 - ok; -1 - cannot read path
+static int replay(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+
+    std::vector<uint8_t> buf;
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + got);
+    }
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(buf.data(), buf.size());
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long runs = 100000;
+    unsigned long long seed = std::random_device()();
+    std::vector<const char*> files;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = strtoull(argv[i] + 6, nullptr, 10);
+        } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+            seed = strtoull(argv[i] + 6, nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-runs=N] [-seed=N] [FILE...]\n",
+                    argv[0]);
+            return 1;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    if (!files.empty()) {
+        for (const char* path : files) {
+            if (replay(path) != 0) {
+                fprintf(stderr, "Error: cannot read %s\n", path);
+                return 1;
+            }
+        }
+        printf("calculator_fuzz: %zu inputs replayed\n", files.size());
+        return 0;
+    }
+
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> buf(FUZZ_INPUT_MAX);
+    for (unsigned long long r = 0; r < runs; ++r) {
+        size_t n = 1 + (size_t)(rng() % FUZZ_INPUT_MAX);
+        for (size_t i = 0; i < n; ++i) buf[i] = (uint8_t)rng();
+        LLVMFuzzerTestOneInput(buf.data(), n);
+    }
+
+    printf("calculator_fuzz: %llu runs, seed %llu\n", runs, seed);
+
+    return 0;
+}
+
+#endif
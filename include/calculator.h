@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// a set of SIMD kernels, from kernels_select() or kernels_best()
+struct KernelSet;
+
+// In-process calculator core: the same parsing, checks and arithmetic as
+// the calculator executable. Nothing here allocates or touches stdio, and
+// every function is safe to call from several threads at once.
+namespace calc
+{
+
+// T is int, int64_t or, where the compiler has it, int128; double for
+// --real, and int64_t again for --fixed, see compute_fixed()
+template <typename T>
+struct CalcDataT
+{
+    T a;
+    T b;
+    char op; // + - x / ^ !; b is 0 for '!'
+    T result;
+};
+
+typedef CalcDataT<int> CalcData;
+
+#if defined(__SIZEOF_INT128__)
+#define CALC_HAVE_INT128 1
+__extension__ typedef __int128 int128;
+#endif
+
+// outcome of one expression; the binary batch format sends it as is
+enum Status : uint8_t
+{
+    STATUS_OK = 0,
+    STATUS_USAGE,           // not A B OP / N !, or an operand is not an int
+    STATUS_UNKNOWN_OP,
+    STATUS_NOT_UNARY,       // '!' with a second operand
+    STATUS_DIV_BY_ZERO,
+    STATUS_OVERFLOW,
+    STATUS_INVALID_ARG,
+    STATUS_NEGATIVE_EXP,
+    STATUS_NEGATIVE_FACT,
+    STATUS_MATH_ERROR,      // any other mathlib failure
+    STATUS_MISSING_OPERAND, // RPN op with too few values on the stack
+    STATUS_EXTRA_OPERAND,   // RPN values left over at the end
+    STATUS_STACK_FULL,      // more than RPN_STACK_MAX values at once
+};
+
+// return: 0 - ok; 1 - usage error; 2 - runtime error
+int status_exit_code(Status s);
+
+// return: a static message for s, without the "Error: " prefix
+const char* status_message(Status s);
+
+// return: the status for a mathlib return code
+Status status_from_math(int rc);
+
+// same rules as strtol(s, &end, 10) followed by a full-consumption and
+// range check for T, but over [b, e) and without copying
+// return: 0 - ok; -1 - not a T
+template <typename T>
+int parse_int_span(const char* b, const char* e, T* out);
+
+// validates op and operands before computing
+template <typename T>
+Status check(const CalcDataT<T>* d);
+
+// computes d->result for a checked d; the int version goes through
+// mathlib, the wider ones use compiler overflow builtins
+template <typename T>
+Status compute(CalcDataT<T>* d);
+
+template <>
+int parse_int_span<int>(const char* b, const char* e, int* out);
+template <>
+Status compute<int>(CalcData* d);
+
+// --real: like parse_int_span(), for a decimal or exponent number such as
+// -1.5e3; return: 0 - ok; -1 - not a finite double
+int parse_real_span(const char* b, const char* e, double* out);
+
+// check() takes doubles by the same rules; compute() gives
+// STATUS_OVERFLOW for a result that is not finite, and STATUS_INVALID_ARG
+// for '!' of a fraction or '^' of a negative base to a fractional power
+template <>
+Status compute<double>(CalcDataT<double>* d);
+
+#if CALC_HAVE_INT128
+// --fixed: a value of scale s is an int64_t count of 10^-s, so 1.25 is
+// 125 at scale 2; check() takes them as they are
+static const int FIXED_SCALE_MAX = 18;
+
+// [b, e) as [+-]digits[.digits] with at most scale places, which are not
+// rounded off; return: 0 - ok; -1 - not a value of that scale
+int parse_fixed_span(const char* b, const char* e, int scale, int64_t* out);
+
+// compute() for values of a scale: x and / round half away from zero to
+// the last place; ^ squares, each product rounded so; '!' and the
+// exponent of '^' take whole numbers only, else STATUS_INVALID_ARG
+Status compute_fixed(CalcDataT<int64_t>* d, int scale);
+#endif
+
+// [b, e) view into argv or an input buffer, not NUL-terminated
+struct Token
+{
+    const char* b;
+    const char* e;
+};
+
+// values an RPN expression may hold at once
+static const int RPN_STACK_MAX = 64;
+
+// evaluates RPN tokens, integers and single-char ops, left to right on a
+// fixed stack; every op is checked and computed like one check() and
+// compute() pair
+// pos: index of the failing token, or n when the end is at fault
+// return: STATUS_OK with *result set, or the first failure; STATUS_USAGE
+// means toks[*pos] is not an integer
+template <typename T>
+Status rpn_eval(const Token* toks, int n, T* result, int* pos);
+
+#if CALC_HAVE_INT128
+// rpn_eval() on --fixed values of a scale
+Status rpn_eval_fixed(const Token* toks, int n, int scale, int64_t* result,
+                      int* pos);
+#endif
+
+// tokens a compiled RPN program may have, and placeholders $1..$N
+static const int RPN_PROGRAM_MAX = 256;
+static const int RPN_ARGS_MAX = 9;
+
+enum RpnCode : uint8_t
+{
+    RPN_PUSH,     // push imm
+    RPN_PUSH_ARG, // push $(arg + 1)
+    RPN_OP,       // pop b and a, push a op b; '!' pops a, pushes a!
+    RPN_OP_IMM,   // top = top op imm, a push fused into its binary op
+    RPN_OP_ARG,   // top = top op $(arg + 1), likewise
+    RPN_OP_SELF,  // top = top op top, from rpn_optimize()
+};
+
+template <typename T>
+struct RpnInsnT
+{
+    RpnCode code;
+    char op;
+    uint8_t arg;
+    int tok; // token it came from, the op one for fused steps
+    T imm;
+};
+
+// an RPN expression whose numbers may be $N placeholders, compiled once
+// and run on many sets of values
+template <typename T>
+struct RpnProgramT
+{
+    RpnInsnT<T> insns[RPN_PROGRAM_MAX];
+    int n;
+    int args;  // highest N of the $N used
+    int depth; // most values on the stack at once
+};
+
+// compiles tokens as rpn_eval() reads them, where a number may also be $1
+// to $RPN_ARGS_MAX; the stack shape is checked here, the values only when
+// the program runs
+// pos: as for rpn_eval()
+// return: STATUS_OK, or the first failure; STATUS_USAGE means toks[*pos]
+// is neither an integer nor a placeholder, or *pos is RPN_PROGRAM_MAX and
+// there are more tokens than that
+template <typename T>
+Status rpn_compile(const Token* toks, int n, RpnProgramT<T>* p, int* pos);
+
+// rewrites a compiled p into fewer steps with the same result and the same
+// failure, at the same token, for any values: constant steps are folded
+// unless they fail, steps that can neither fail nor change a value
+// (x 1 x, x 0 +, x 0 -, x 1 /, x 1 ^) dropped, and x 2 ^ becomes x x x
+template <typename T>
+void rpn_optimize(RpnProgramT<T>* p);
+
+// runs p on args[0, p->args), one op at a time like rpn_eval()
+// pos: token of the failing op
+template <typename T>
+Status rpn_run(const RpnProgramT<T>* p, const T* args, T* result, int* pos);
+
+// runs p on n rows at once, $k of row i being cols[k - 1][i], into
+// caller-owned results[i] and status[i], a Status; each step goes over a
+// block of rows, through the SIMD kernels for int and double + - x /
+template <typename T>
+void rpn_run_columns(const RpnProgramT<T>* p, const T* const* cols, size_t n,
+                     T* results, uint8_t* status);
+
+// rpn_run_columns() through the kernels of k instead of the best ones
+template <typename T>
+void rpn_run_columns(const KernelSet* k, const RpnProgramT<T>* p,
+                     const T* const* cols, size_t n, T* results,
+                     uint8_t* status);
+
+// evaluate() and the SIMD kernels behind it are 32-bit only
+
+// checks and computes d[i] for i < n into caller-owned results[i] and
+// status[i], a Status; results[i] is 0 unless status[i] is STATUS_OK
+void evaluate(const CalcData* d, size_t n, int* results, uint8_t* status);
+
+// evaluate() through the kernels of k instead of the best ones
+void evaluate(const KernelSet* k, const CalcData* d, size_t n, int* results,
+              uint8_t* status);
+
+} // namespace calc
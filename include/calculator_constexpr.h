@@ -0,0 +1,191 @@
+#pragma once
+
+#include "calculator.h"
+
+#include <type_traits>
+
+// Header-only constexpr counterpart of check() and compute(): the same
+// rules and the same Status values, so an expression built from constants
+// is evaluated by the compiler, e.g.
+//
+//   static_assert(calc::eval<3, 4, '^'>().value == 81);
+//   constexpr auto r = calc::eval<int64_t>(a, b, op);
+//
+// Nothing here links against libcalculator or mathlib.
+namespace calc
+{
+
+template <typename T>
+struct EvalResultT
+{
+    Status status;
+    T value; // 0 unless status is STATUS_OK
+};
+
+// T is a signed integer of 32, 64 or, where the compiler has it, 128 bits;
+// <type_traits> only knows int128 in GNU mode
+template <typename T>
+constexpr bool is_eval_type()
+{
+#if CALC_HAVE_INT128
+    if (std::is_same<T, int128>::value) return true;
+#endif
+
+    return std::is_integral<T>::value && T(-1) < T(0) &&
+           (sizeof(T) == 4 || sizeof(T) == 8);
+}
+
+template <typename T>
+constexpr T eval_max()
+{
+    return ((T(1) << (sizeof(T) * 8 - 2)) - 1) * 2 + 1;
+}
+
+template <typename T>
+constexpr T eval_min()
+{
+    return -eval_max<T>() - 1;
+}
+
+// as check(): the op first, then its operands in the order the runtime
+// reports them
+template <typename T>
+constexpr Status eval_check(T a, T b, char op)
+{
+    switch (op) {
+    case '+':
+    case '-':
+    case 'x':
+        return STATUS_OK;
+    case '/':
+        return b == 0 ? STATUS_DIV_BY_ZERO : STATUS_OK;
+    case '^':
+        return b < 0 ? STATUS_NEGATIVE_EXP : STATUS_OK;
+    case '!':
+        if (b != 0) return STATUS_NOT_UNARY;
+        return a < 0 ? STATUS_NEGATIVE_FACT : STATUS_OK;
+    default:
+        return STATUS_UNKNOWN_OP;
+    }
+}
+
+// squaring as in compute(); any base other than 0 and +-1 overflows within
+// log2(bits) squarings
+template <typename T>
+constexpr Status eval_pow(T base, T exp, T* out)
+{
+    if (exp < 0) return STATUS_INVALID_ARG;
+
+    if (exp == 0 || base == 1) {
+        *out = 1;
+        return STATUS_OK;
+    }
+
+    if (base == 0) {
+        *out = 0;
+        return STATUS_OK;
+    }
+
+    if (base == -1) {
+        *out = (exp & 1) ? -1 : 1;
+        return STATUS_OK;
+    }
+
+    T r = 1;
+    T b = base;
+    for (;;) {
+        if ((exp & 1) && __builtin_mul_overflow(r, b, &r)) {
+            return STATUS_OVERFLOW;
+        }
+
+        exp >>= 1;
+        if (exp == 0) break;
+
+        if (__builtin_mul_overflow(b, b, &b)) return STATUS_OVERFLOW;
+    }
+
+    *out = r;
+
+    return STATUS_OK;
+}
+
+template <typename T>
+constexpr Status eval_fact(T n, T* out)
+{
+    if (n < 0) return STATUS_INVALID_ARG;
+
+    T r = 1;
+    for (T i = 2; i <= n; ++i) {
+        if (__builtin_mul_overflow(r, i, &r)) return STATUS_OVERFLOW;
+    }
+
+    *out = r;
+
+    return STATUS_OK;
+}
+
+// as compute() on an expression that passed eval_check()
+template <typename T>
+constexpr Status eval_compute(T a, T b, char op, T* result)
+{
+    switch (op) {
+    case '+':
+        return __builtin_add_overflow(a, b, result) ? STATUS_OVERFLOW
+                                                    : STATUS_OK;
+    case '-':
+        return __builtin_sub_overflow(a, b, result) ? STATUS_OVERFLOW
+                                                    : STATUS_OK;
+    case 'x':
+        return __builtin_mul_overflow(a, b, result) ? STATUS_OVERFLOW
+                                                    : STATUS_OK;
+    case '/':
+        if (b == 0) return STATUS_DIV_BY_ZERO;
+        if (a == eval_min<T>() && b == -1) return STATUS_OVERFLOW;
+        *result = a / b;
+        return STATUS_OK;
+    case '^':
+        return eval_pow(a, b, result);
+    case '!':
+        return eval_fact(a, result);
+    default:
+        return STATUS_INVALID_ARG;
+    }
+}
+
+// checks and computes a op b; b is 0 for '!'
+template <typename T>
+constexpr EvalResultT<T> eval(T a, T b, char op)
+{
+    static_assert(is_eval_type<T>(), "T must be a 32, 64 or 128-bit int");
+
+    EvalResultT<T> r = {eval_check(a, b, op), 0};
+    if (r.status != STATUS_OK) return r;
+
+    T v = 0;
+    r.status = eval_compute(a, b, op, &v);
+    if (r.status == STATUS_OK) r.value = v;
+
+    return r;
+}
+
+// A B OP, always at compile time; T is the wider of A's and B's types
+template <auto A, auto B, char Op>
+constexpr auto eval()
+{
+    typedef std::common_type_t<decltype(A), decltype(B)> T;
+    constexpr EvalResultT<T> r = eval<T>((T)A, (T)B, Op);
+
+    return r;
+}
+
+// N !, always at compile time
+template <auto N, char Op>
+constexpr auto eval()
+{
+    typedef decltype(N) T;
+    constexpr EvalResultT<T> r = eval<T>(N, 0, Op);
+
+    return r;
+}
+
+} // namespace calc
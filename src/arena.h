@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <sys/mman.h>
+
+// Memory behind the batch buffers, so that evaluation in steady state does
+// not go through malloc():
+//
+// Arena: a per-thread bump allocator over a list of mappings, grown as
+// needed. Chunks, job lists and worker state are carved from it and dropped
+// all at once by moving the top back to a mark, once per batch.
+//
+// OutPool: output buffers in power-of-two classes, shared by every thread.
+// A buffer handed back is kept, pages and all, for the next one of its
+// class; the mutex is taken once per buffer, never per record. Classes
+// from POOL_HUGE up are backed by huge pages where the system has them.
+
+// an arena grows by mappings of this many bytes, or one as large as an
+// allocation that does not fit; only touched pages cost memory
+static const size_t ARENA_STEP = (size_t)4 << 20;
+static const size_t ARENA_ALIGN = 64;
+
+// the head of one mapping of an arena, ARENA_ALIGN bytes before its data;
+// the arena's offsets run on from one mapping to the next
+struct ArenaRegion
+{
+    ArenaRegion* prev;
+    size_t start; // arena offset of the first data byte
+    size_t size;  // data bytes
+};
+
+struct Arena
+{
+    ArenaRegion* top; // the newest mapping, or nullptr before the first
+    size_t used;      // arena offset of the next free byte
+};
+
+static void arena_open(Arena* a)
+{
+    a->top = nullptr;
+    a->used = 0;
+}
+
+static void arena_unmap(ArenaRegion* r)
+{
+    munmap(r, ARENA_ALIGN + r->size);
+}
+
+static void arena_close(Arena* a)
+{
+    while (a->top) {
+        ArenaRegion* r = a->top;
+        a->top = r->prev;
+        arena_unmap(r);
+    }
+    a->used = 0;
+}
+
+// maps a region for at least n bytes on top of a
+// return: the region, or nullptr when out of memory
+static ArenaRegion* arena_grow(Arena* a, size_t n)
+{
+    static_assert(sizeof(ArenaRegion) <= ARENA_ALIGN, "region head");
+
+    size_t map = ARENA_STEP;
+    if (n > ARENA_STEP - ARENA_ALIGN) {
+        if (n > SIZE_MAX - ARENA_STEP - ARENA_ALIGN) return nullptr;
+        map = (n + ARENA_ALIGN + ARENA_STEP - 1) / ARENA_STEP * ARENA_STEP;
+    }
+
+    void* p = mmap(nullptr, map, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    madvise(p, map, MADV_HUGEPAGE);
+
+    ArenaRegion* r = (ArenaRegion*)p;
+    r->prev = a->top;
+    r->start = a->top ? a->top->start + a->top->size : 0;
+    r->size = map - ARENA_ALIGN;
+    a->top = r;
+
+    return r;
+}
+
+// return: n bytes aligned to ARENA_ALIGN, or nullptr when out of memory
+static void* arena_alloc(Arena* a, size_t n)
+{
+    ArenaRegion* r = a->top;
+    size_t at = (a->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (!r || at > r->start + r->size || n > r->start + r->size - at) {
+        r = arena_grow(a, n);
+        if (!r) return nullptr;
+        at = r->start;
+    }
+
+    a->used = at + n;
+
+    return (char*)r + ARENA_ALIGN + (at - r->start);
+}
+
+// return: a mark for arena_reset()
+static size_t arena_mark(const Arena* a)
+{
+    return a->used;
+}
+
+// frees everything allocated since mark; the mappings it grew by are
+// unmapped, the pages of the others stay for reuse
+static void arena_reset(Arena* a, size_t mark)
+{
+    while (a->top && a->top->start > mark) {
+        ArenaRegion* r = a->top;
+        a->top = r->prev;
+        arena_unmap(r);
+    }
+    a->used = mark;
+}
+
+// smallest buffer class, and the first one backed by huge pages
+static const size_t POOL_MIN = (size_t)64 << 10;
+static const size_t POOL_HUGE = (size_t)2 << 20;
+static const int POOL_CLASSES = 24; // up to POOL_MIN << 23, 512 GiB
+
+// idle buffers beyond this many bytes are unmapped instead of kept
+static const size_t POOL_KEEP_MAX = (size_t)256 << 20;
+
+// an idle buffer's first bytes link it into its class
+struct PoolFree
+{
+    PoolFree* next;
+};
+
+struct OutPool
+{
+    std::mutex m;
+    PoolFree* idle[POOL_CLASSES];
+    size_t kept; // bytes in idle
+};
+
+static OutPool out_pool;
+
+// return: class of the smallest buffer of at least n bytes, or -1
+static int pool_class(size_t n)
+{
+    size_t size = POOL_MIN;
+    for (int c = 0; c < POOL_CLASSES; ++c) {
+        if (size >= n) return c;
+        size *= 2;
+    }
+
+    return -1;
+}
+
+static size_t pool_class_size(int c)
+{
+    return POOL_MIN << c;
+}
+
+// return: a buffer of at least n bytes, its size in *cap, or nullptr when
+// out of memory
+static char* pool_get(size_t n, size_t* cap)
+{
+    int c = pool_class(n);
+    if (c < 0) return nullptr;
+
+    size_t size = pool_class_size(c);
+    *cap = size;
+
+    {
+        std::lock_guard<std::mutex> lock(out_pool.m);
+        PoolFree* f = out_pool.idle[c];
+        if (f) {
+            out_pool.idle[c] = f->next;
+            out_pool.kept -= size;
+            return (char*)f;
+        }
+    }
+
+    // reserved huge pages first; failing that, transparent ones
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (size >= POOL_HUGE) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+        if (size >= POOL_HUGE) madvise(p, size, MADV_HUGEPAGE);
+    }
+
+    return (char*)p;
+}
+
+// hands back a buffer from pool_get() with the *cap it got
+static void pool_put(char* p, size_t cap)
+{
+    if (!p) return;
+
+    {
+        std::lock_guard<std::mutex> lock(out_pool.m);
+        if (out_pool.kept + cap <= POOL_KEEP_MAX) {
+            int c = pool_class(cap);
+            PoolFree* f = (PoolFree*)(void*)p;
+            f->next = out_pool.idle[c];
+            out_pool.idle[c] = f;
+            out_pool.kept += cap;
+            return;
+        }
+    }
+
+    munmap(p, cap);
+}
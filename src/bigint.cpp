@@ -0,0 +1,288 @@
+#include "bigint.h"
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+typedef std::vector<uint32_t> Limbs;
+
+static const uint32_t LIMB_BASE = 1000000000;
+static const int LIMB_DIGITS = 9;
+
+// below this many limbs in the shorter operand, schoolbook is faster
+static const size_t KARATSUBA_CUTOFF = 32;
+
+// factorial leaves multiply this many small factors one at a time
+static const uint64_t FACT_LEAF = 16;
+
+static void trim(Limbs* a)
+{
+    while (!a->empty() && a->back() == 0) a->pop_back();
+}
+
+// r[0, n) += a[0, na), na <= n; the final carry must fit in r
+static void add_at(uint32_t* r, size_t n, const uint32_t* a, size_t na)
+{
+    uint32_t carry = 0;
+    size_t i = 0;
+
+    for (; i < na; ++i) {
+        uint32_t v = r[i] + a[i] + carry;
+        carry = (v >= LIMB_BASE);
+        r[i] = carry ? v - LIMB_BASE : v;
+    }
+
+    for (; carry && i < n; ++i) {
+        uint32_t v = r[i] + 1;
+        carry = (v == LIMB_BASE);
+        r[i] = carry ? 0 : v;
+    }
+}
+
+// r[0, n) -= a[0, na), na <= n; r must not be less than a
+static void sub_at(uint32_t* r, size_t n, const uint32_t* a, size_t na)
+{
+    uint32_t borrow = 0;
+    size_t i = 0;
+
+    for (; i < na; ++i) {
+        int64_t v = (int64_t)r[i] - a[i] - borrow;
+        borrow = (v < 0);
+        r[i] = (uint32_t)(borrow ? v + LIMB_BASE : v);
+    }
+
+    for (; borrow && i < n; ++i) {
+        borrow = (r[i] == 0);
+        r[i] = borrow ? LIMB_BASE - 1 : r[i] - 1;
+    }
+}
+
+static size_t used(const uint32_t* a, size_t n)
+{
+    while (n != 0 && a[n - 1] == 0) --n;
+    return n;
+}
+
+// r[0, na + nb) = a * b; r must be zero on entry
+static void mul_school(const uint32_t* a, size_t na, const uint32_t* b,
+                       size_t nb, uint32_t* r)
+{
+    for (size_t i = 0; i < na; ++i) {
+        uint64_t ai = a[i];
+        if (ai == 0) continue;
+
+        uint64_t carry = 0;
+        for (size_t j = 0; j < nb; ++j) {
+            uint64_t cur = r[i + j] + ai * b[j] + carry;
+            r[i + j] = (uint32_t)(cur % LIMB_BASE);
+            carry = cur / LIMB_BASE;
+        }
+
+        for (size_t k = i + nb; carry != 0; ++k) {
+            uint64_t cur = r[k] + carry;
+            r[k] = (uint32_t)(cur % LIMB_BASE);
+            carry = cur / LIMB_BASE;
+        }
+    }
+}
+
+// r[0, na + nb) = a * b; r must be zero on entry
+static void mul_limbs(const uint32_t* a, size_t na, const uint32_t* b,
+                      size_t nb, uint32_t* r)
+{
+    if (na < nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+
+    if (nb < KARATSUBA_CUTOFF) {
+        mul_school(a, na, b, nb, r);
+        return;
+    }
+
+    size_t h = na / 2;
+
+    if (nb <= h) {
+        // lopsided: split a alone, a0 * b + a1 * b * BASE^h
+        mul_limbs(a, h, b, nb, r);
+
+        Limbs t(na - h + nb);
+        mul_limbs(a + h, na - h, b, nb, t.data());
+        add_at(r + h, na + nb - h, t.data(), used(t.data(), t.size()));
+        return;
+    }
+
+    // a = a0 + a1 * BASE^h, b = b0 + b1 * BASE^h; z0 and z2 go straight
+    // into their places in r
+    size_t na1 = na - h;
+    size_t nb1 = nb - h;
+    mul_limbs(a, h, b, h, r);
+    mul_limbs(a + h, na1, b + h, nb1, r + 2 * h);
+
+    Limbs sa(a + h, a + na);
+    sa.push_back(0);
+    add_at(sa.data(), sa.size(), a, h);
+
+    Limbs sb;
+    if (nb1 >= h) {
+        sb.assign(b + h, b + nb);
+        sb.push_back(0);
+        add_at(sb.data(), sb.size(), b, h);
+    } else {
+        sb.assign(b, b + h);
+        sb.push_back(0);
+        add_at(sb.data(), sb.size(), b + h, nb1);
+    }
+
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2
+    Limbs z1(sa.size() + sb.size());
+    mul_limbs(sa.data(), sa.size(), sb.data(), sb.size(), z1.data());
+    sub_at(z1.data(), z1.size(), r, 2 * h);
+    sub_at(z1.data(), z1.size(), r + 2 * h, na1 + nb1);
+
+    add_at(r + h, na + nb - h, z1.data(), used(z1.data(), z1.size()));
+}
+
+static Limbs mul(const Limbs& a, const Limbs& b)
+{
+    if (a.empty() || b.empty()) return Limbs();
+
+    Limbs r(a.size() + b.size());
+    mul_limbs(a.data(), a.size(), b.data(), b.size(), r.data());
+    trim(&r);
+
+    return r;
+}
+
+static void mul_small(Limbs* a, uint32_t k)
+{
+    uint64_t carry = 0;
+
+    for (uint32_t& limb : *a) {
+        uint64_t cur = (uint64_t)limb * k + carry;
+        limb = (uint32_t)(cur % LIMB_BASE);
+        carry = cur / LIMB_BASE;
+    }
+
+    while (carry != 0) {
+        a->push_back((uint32_t)(carry % LIMB_BASE));
+        carry /= LIMB_BASE;
+    }
+}
+
+// lo * (lo + 1) * ... * hi, split in halves so the big products are of
+// similar size and Karatsuba pays off
+static Limbs product(uint64_t lo, uint64_t hi)
+{
+    if (hi - lo < FACT_LEAF) {
+        Limbs r(1, 1);
+        for (uint64_t k = lo; k <= hi; ++k) mul_small(&r, (uint32_t)k);
+        return r;
+    }
+
+    uint64_t mid = lo + (hi - lo) / 2;
+
+    return mul(product(lo, mid), product(mid + 1, hi));
+}
+
+static void to_decimal(const Limbs& a, int neg, std::string* out)
+{
+    out->clear();
+
+    if (a.empty()) {
+        out->push_back('0');
+        return;
+    }
+
+    out->reserve(a.size() * LIMB_DIGITS + 1);
+    if (neg) out->push_back('-');
+
+    char tmp[LIMB_DIGITS];
+    for (size_t i = a.size(); i-- != 0;) {
+        uint32_t v = a[i];
+        for (int d = LIMB_DIGITS - 1; d >= 0; --d) {
+            tmp[d] = (char)('0' + v % 10);
+            v /= 10;
+        }
+
+        // the top limb is not zero-padded
+        int skip = 0;
+        if (i == a.size() - 1) {
+            while (skip < LIMB_DIGITS - 1 && tmp[skip] == '0') ++skip;
+        }
+        out->append(tmp + skip, (size_t)(LIMB_DIGITS - skip));
+    }
+}
+
+int bigint_fact(uint64_t n, std::string* out)
+{
+    // log10(n!) from lgamma, with a digit of slack for rounding
+    if (n > 1 && std::lgamma((double)n + 1) / std::log(10.0) >
+                     (double)(BIGINT_MAX_DIGITS - 1)) {
+        return 1;
+    }
+
+    to_decimal(n < 2 ? Limbs(1, 1) : product(2, n), 0, out);
+
+    return 0;
+}
+
+int bigint_pow(const char* b, const char* e, uint64_t exp, std::string* out)
+{
+    int neg = 0;
+    if (b != e && *b == '-') {
+        neg = 1;
+        ++b;
+    }
+
+    if (b == e) return 2;
+
+    Limbs base;
+    for (const char* end = e; end != b;) {
+        const char* start = (end - b > LIMB_DIGITS) ? end - LIMB_DIGITS : b;
+
+        uint32_t v = 0;
+        for (const char* p = start; p != end; ++p) {
+            unsigned digit = (unsigned)(*p - '0');
+            if (digit > 9) return 2;
+            v = v * 10 + digit;
+        }
+
+        base.push_back(v);
+        end = start;
+    }
+    trim(&base);
+
+    neg = neg && (exp & 1) && !base.empty();
+
+    if (exp == 0) {
+        to_decimal(Limbs(1, 1), 0, out);
+        return 0;
+    }
+
+    if (base.empty() || (base.size() == 1 && base[0] == 1)) {
+        to_decimal(base, neg, out);
+        return 0;
+    }
+
+    // exp * log10(base), from the top two limbs
+    double top = base.back();
+    if (base.size() > 1) top += base[base.size() - 2] / (double)LIMB_BASE;
+    double digits = (double)exp * (std::log10(top) +
+                                   (double)(base.size() - 1) * LIMB_DIGITS);
+    if (digits > (double)(BIGINT_MAX_DIGITS - 1)) return 1;
+
+    Limbs r(1, 1);
+    for (;;) {
+        if (exp & 1) r = mul(r, base);
+
+        exp >>= 1;
+        if (exp == 0) break;
+
+        base = mul(base, base);
+    }
+
+    to_decimal(r, neg, out);
+
+    return 0;
+}
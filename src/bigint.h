@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Arbitrary-precision '!' and '^' for --bigint. Numbers are little-endian
+// arrays of base 10^9 limbs, so printing one is a straight digit copy;
+// products use Karatsuba above a schoolbook cutoff.
+
+// results longer than this are refused rather than computed
+static const size_t BIGINT_MAX_DIGITS = 1 << 20;
+
+// out: decimal n!
+// return: 0 - ok; 1 - more than BIGINT_MAX_DIGITS digits
+int bigint_fact(uint64_t n, std::string* out);
+
+// base: [b, e) decimal digits with an optional leading '-'
+// out: decimal base^exp
+// return: 0 - ok; 1 - more than BIGINT_MAX_DIGITS digits; 2 - bad base
+int bigint_pow(const char* b, const char* e, uint64_t exp, std::string* out);
@@ -0,0 +1,1482 @@
+#include "calculator.h"
+
+#include "calculator_constexpr.h"
+#include "kernels.h"
+#include "mathlib.h"
+
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+namespace calc
+{
+
+int status_exit_code(Status s)
+{
+    switch (s) {
+    case STATUS_OK:
+        return 0;
+    case STATUS_USAGE:
+    case STATUS_UNKNOWN_OP:
+    case STATUS_NOT_UNARY:
+    case STATUS_MISSING_OPERAND:
+    case STATUS_EXTRA_OPERAND:
+    case STATUS_STACK_FULL:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+const char* status_message(Status s)
+{
+    switch (s) {
+    case STATUS_OK:
+        return "ok";
+    case STATUS_USAGE:
+        return "usage error";
+    case STATUS_UNKNOWN_OP:
+        return "unknown operation";
+    case STATUS_NOT_UNARY:
+        return "'!' must be used in unary form: N !";
+    case STATUS_DIV_BY_ZERO:
+        return "division by zero";
+    case STATUS_OVERFLOW:
+        return "overflow";
+    case STATUS_INVALID_ARG:
+        return "invalid argument";
+    case STATUS_NEGATIVE_EXP:
+        return "power requires exp >= 0";
+    case STATUS_NEGATIVE_FACT:
+        return "factorial requires n >= 0";
+    case STATUS_MISSING_OPERAND:
+        return "missing operand";
+    case STATUS_EXTRA_OPERAND:
+        return "too many operands";
+    case STATUS_STACK_FULL:
+        return "expression too deep";
+    default:
+        return "math error";
+    }
+}
+
+Status status_from_math(int rc)
+{
+    switch (rc) {
+    case mathlib::MATH_OK:
+        return STATUS_OK;
+    case mathlib::MATH_ERR_OVERFLOW:
+        return STATUS_OVERFLOW;
+    case mathlib::MATH_ERR_DIV_BY_ZERO:
+        return STATUS_DIV_BY_ZERO;
+    case mathlib::MATH_ERR_INVALID_ARG:
+        return STATUS_INVALID_ARG;
+    default:
+        return STATUS_MATH_ERROR;
+    }
+}
+
+// unsigned counterpart and limits of each supported width; <limits> and
+// <type_traits> only know __int128 in GNU mode
+template <typename T>
+struct IntTraits;
+
+template <>
+struct IntTraits<int>
+{
+    typedef unsigned U;
+};
+
+template <>
+struct IntTraits<int64_t>
+{
+    typedef uint64_t U;
+};
+
+#if CALC_HAVE_INT128
+template <>
+struct IntTraits<int128>
+{
+    __extension__ typedef unsigned __int128 U;
+};
+#endif
+
+template <typename T>
+static constexpr T int_max()
+{
+    return (T)(~(typename IntTraits<T>::U)0 >> 1);
+}
+
+template <typename T>
+static constexpr T int_min()
+{
+    return -int_max<T>() - 1;
+}
+
+static int is_space(char c)
+{
+    return (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+            c == '\r');
+}
+
+template <>
+int parse_int_span<int>(const char* b, const char* e, int* out)
+{
+    while (b != e && is_space(*b)) ++b;
+
+    int neg = 0;
+    if (b != e && (*b == '+' || *b == '-')) {
+        neg = (*b == '-');
+        ++b;
+    }
+
+    if (b == e) return -1;
+
+    const unsigned long long limit = neg ? (unsigned long long)INT_MAX + 1
+                                         : (unsigned long long)INT_MAX;
+    unsigned long long v = 0;
+
+    for (; b != e; ++b) {
+        unsigned digit = (unsigned)(*b - '0');
+        if (digit > 9) return -1;
+
+        v = v * 10 + digit;
+        if (v > limit) return -1;
+    }
+
+    *out = neg ? (int)(0 - v) : (int)v;
+
+    return 0;
+}
+
+// the int version accumulates in 64 bits; wider ones test before each step
+template <typename T>
+int parse_int_span(const char* b, const char* e, T* out)
+{
+    typedef typename IntTraits<T>::U U;
+
+    while (b != e && is_space(*b)) ++b;
+
+    int neg = 0;
+    if (b != e && (*b == '+' || *b == '-')) {
+        neg = (*b == '-');
+        ++b;
+    }
+
+    if (b == e) return -1;
+
+    const U limit = neg ? (U)int_max<T>() + 1 : (U)int_max<T>();
+    U v = 0;
+
+    for (; b != e; ++b) {
+        unsigned digit = (unsigned)(*b - '0');
+        if (digit > 9) return -1;
+
+        if (v > (limit - digit) / 10) return -1;
+        v = v * 10 + digit;
+    }
+
+    *out = neg ? (T)(0 - v) : (T)v;
+
+    return 0;
+}
+
+int parse_real_span(const char* b, const char* e, double* out)
+{
+    // from_chars() takes neither the leading blanks nor the '+' of strtod()
+    while (b != e && is_space(*b)) ++b;
+    if (b != e && *b == '+') {
+        ++b;
+        if (b != e && *b == '-') return -1;
+    }
+
+    double v;
+    std::from_chars_result r = std::from_chars(b, e, v);
+    if (r.ec != std::errc() || r.ptr != e || !std::isfinite(v)) return -1;
+
+    *out = v;
+
+    return 0;
+}
+
+#if CALC_HAVE_INT128
+// 10^scale, the fixed-point 1 of each scale
+struct Pow10Table
+{
+    int64_t v[FIXED_SCALE_MAX + 1];
+};
+
+static constexpr Pow10Table make_pow10_table()
+{
+    Pow10Table t = {};
+    t.v[0] = 1;
+    for (int i = 1; i <= FIXED_SCALE_MAX; ++i) t.v[i] = t.v[i - 1] * 10;
+
+    return t;
+}
+
+static constexpr Pow10Table POW10 = make_pow10_table();
+
+int parse_fixed_span(const char* b, const char* e, int scale, int64_t* out)
+{
+    while (b != e && is_space(*b)) ++b;
+
+    int neg = 0;
+    if (b != e && (*b == '+' || *b == '-')) {
+        neg = (*b == '-');
+        ++b;
+    }
+
+    const uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t v = 0;
+    int digits = 0;
+    int places = -1; // past the point
+
+    for (; b != e; ++b) {
+        if (*b == '.' && places < 0) {
+            places = 0;
+            continue;
+        }
+
+        unsigned digit = (unsigned)(*b - '0');
+        if (digit > 9) return -1;
+        if (places >= 0 && ++places > scale) return -1;
+
+        if (v > (limit - digit) / 10) return -1;
+        v = v * 10 + digit;
+        ++digits;
+    }
+
+    if (digits == 0) return -1;
+
+    uint64_t unit = (uint64_t)POW10.v[scale - (places < 0 ? 0 : places)];
+    if (v > limit / unit) return -1;
+    v *= unit;
+
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+
+    return 0;
+}
+#endif
+
+// handler slots of the op table; + - x / come first, in the order of
+// kernels_op_index()
+enum OpIndex : uint8_t
+{
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_FACT,
+    OP_INVALID, // any other char
+    OP_COUNT,
+};
+
+// what check() tests for an op, one bit each; where an op has several,
+// the lowest failing one is reported
+enum : uint8_t
+{
+    CHECK_UNKNOWN = 1 << 0,
+    CHECK_B_ZERO = 1 << 1,
+    CHECK_A_NONNEG = 1 << 2,
+    CHECK_B_NONNEG = 1 << 3,
+    CHECK_B_NONZERO = 1 << 4,
+};
+
+// by bit position in OpInfo::checks
+static const Status CHECK_STATUS[] = {STATUS_UNKNOWN_OP, STATUS_NOT_UNARY,
+                                      STATUS_NEGATIVE_FACT,
+                                      STATUS_NEGATIVE_EXP, STATUS_DIV_BY_ZERO};
+
+struct OpInfo
+{
+    uint8_t index; // OpIndex
+    uint8_t arity; // 0 - not an op
+    uint8_t checks;
+};
+
+// one entry per char, so validating and dispatching an op is a load
+// instead of a chain of compares
+struct OpTable
+{
+    OpInfo v[256];
+};
+
+static constexpr OpTable make_op_table()
+{
+    OpTable t = {};
+    for (int c = 0; c < 256; ++c) t.v[c] = {OP_INVALID, 0, CHECK_UNKNOWN};
+
+    t.v['+'] = {OP_ADD, 2, 0};
+    t.v['-'] = {OP_SUB, 2, 0};
+    t.v['x'] = {OP_MUL, 2, 0};
+    t.v['/'] = {OP_DIV, 2, CHECK_B_NONZERO};
+    t.v['^'] = {OP_POW, 2, CHECK_B_NONNEG};
+    t.v['!'] = {OP_FACT, 1, CHECK_B_ZERO | CHECK_A_NONNEG};
+
+    return t;
+}
+
+static constexpr OpTable OPS = make_op_table();
+
+static const OpInfo* op_info(char op)
+{
+    return &OPS.v[(unsigned char)op];
+}
+
+static int is_binary_op(char op)
+{
+    return op_info(op)->arity == 2;
+}
+
+template <typename T>
+Status check(const CalcDataT<T>* d)
+{
+    unsigned checks = op_info(d->op)->checks;
+
+    // all tests are evaluated and masked by the op's, so a mix of ops
+    // costs no branch until one fails
+    unsigned failed = (checks & CHECK_UNKNOWN) |
+                      (checks & CHECK_B_ZERO & -(unsigned)(d->b != 0)) |
+                      (checks & CHECK_A_NONNEG & -(unsigned)(d->a < 0)) |
+                      (checks & CHECK_B_NONNEG & -(unsigned)(d->b < 0)) |
+                      (checks & CHECK_B_NONZERO & -(unsigned)(d->b == 0));
+    if (failed == 0) return STATUS_OK;
+
+    return CHECK_STATUS[__builtin_ctz(failed)];
+}
+
+// largest n whose factorial fits in an int
+static const int FACT_MAX = 12;
+
+struct FactTable
+{
+    int v[FACT_MAX + 1];
+};
+
+static constexpr FactTable make_fact_table()
+{
+    FactTable t = {};
+    t.v[0] = 1;
+    for (int i = 1; i <= FACT_MAX; ++i) t.v[i] = t.v[i - 1] * i;
+
+    return t;
+}
+
+static constexpr FactTable FACT = make_fact_table();
+
+static_assert((long long)FACT.v[FACT_MAX] * (FACT_MAX + 1) > INT_MAX,
+              "FACT_MAX must be the last factorial that fits");
+
+// return: mathlib return code, same as mathlib::math_fact
+static int fact_lookup(int n, int* out)
+{
+    if ((unsigned)n > (unsigned)FACT_MAX) {
+        return n < 0 ? mathlib::MATH_ERR_INVALID_ARG
+                     : mathlib::MATH_ERR_OVERFLOW;
+    }
+
+    *out = FACT.v[n];
+
+    return mathlib::MATH_OK;
+}
+
+// bases up to POW_CUBE_MAX can be raised to at least the third power;
+// above it the largest exponent is 2 up to POW_SQUARE_MAX and 1 beyond
+static const unsigned POW_CUBE_MAX = 1290;
+static const unsigned POW_SQUARE_MAX = 46340;
+
+static_assert(1290LL * 1290 * 1290 <= INT_MAX &&
+                  1291LL * 1291 * 1291 > INT_MAX,
+              "POW_CUBE_MAX must be the last base whose cube fits");
+static_assert(46340LL * 46340 <= INT_MAX && 46341LL * 46341 > INT_MAX,
+              "POW_SQUARE_MAX must be the last base whose square fits");
+
+struct PowTable
+{
+    unsigned char max_exp[POW_CUBE_MAX + 1];
+};
+
+static constexpr PowTable make_pow_table()
+{
+    PowTable t = {};
+    for (unsigned b = 2; b <= POW_CUBE_MAX; ++b) {
+        long long v = b;
+        unsigned char e = 1;
+        while (v * b <= INT_MAX) {
+            v *= b;
+            ++e;
+        }
+        t.max_exp[b] = e;
+    }
+
+    return t;
+}
+
+static constexpr PowTable POW = make_pow_table();
+
+// calculator_constexpr.h must agree with the tables at their edges
+static_assert(eval(FACT_MAX, 0, '!').value == FACT.v[FACT_MAX] &&
+                  eval(FACT_MAX + 1, 0, '!').status == STATUS_OVERFLOW,
+              "eval() and FACT disagree on the last factorial");
+static_assert(eval((int)POW_CUBE_MAX, 3, '^').status == STATUS_OK &&
+                  eval((int)POW_CUBE_MAX + 1, 3, '^').status ==
+                      STATUS_OVERFLOW &&
+                  eval(-2, 31, '^').value == INT_MIN,
+              "eval() and POW disagree on the largest powers");
+
+// return: largest e with mag^e <= INT_MAX, for mag >= 2
+static int pow_max_exp(unsigned mag)
+{
+    if (mag <= POW_CUBE_MAX) return POW.max_exp[mag];
+    if (mag <= POW_SQUARE_MAX) return 2;
+
+    return 1;
+}
+
+// return: mathlib return code, same as mathlib::math_pow
+static int pow_fast(int base, int exp, int* out)
+{
+    if (exp < 0) return mathlib::MATH_ERR_INVALID_ARG;
+
+    if (exp == 0 || base == 1) {
+        *out = 1;
+        return mathlib::MATH_OK;
+    }
+
+    if (base == 0) {
+        *out = 0;
+        return mathlib::MATH_OK;
+    }
+
+    if (base == -1) {
+        *out = (exp & 1) ? -1 : 1;
+        return mathlib::MATH_OK;
+    }
+
+    unsigned mag = base < 0 ? 0u - (unsigned)base : (unsigned)base;
+
+    // (-2)^31 is INT_MIN, the only power whose magnitude exceeds INT_MAX
+    if (exp > pow_max_exp(mag) && !(base == -2 && exp == 31)) {
+        return mathlib::MATH_ERR_OVERFLOW;
+    }
+
+    int r = 1;
+    int b = base;
+    for (;;) {
+        if ((exp & 1) && __builtin_mul_overflow(r, b, &r)) {
+            return mathlib::MATH_ERR_OVERFLOW;
+        }
+
+        exp >>= 1;
+        if (exp == 0) break;
+
+        if (__builtin_mul_overflow(b, b, &b)) {
+            return mathlib::MATH_ERR_OVERFLOW;
+        }
+    }
+
+    *out = r;
+
+    return mathlib::MATH_OK;
+}
+
+// int handlers, by OpIndex; return: mathlib return code
+typedef int (*MathOp)(CalcData* d);
+
+static int math_add(CalcData* d)
+{
+    return mathlib::math_add(d->a, d->b, &d->result);
+}
+
+static int math_sub(CalcData* d)
+{
+    return mathlib::math_sub(d->a, d->b, &d->result);
+}
+
+static int math_mul(CalcData* d)
+{
+    return mathlib::math_mul(d->a, d->b, &d->result);
+}
+
+static int math_div(CalcData* d)
+{
+    return mathlib::math_div(d->a, d->b, &d->result);
+}
+
+static int math_pow(CalcData* d)
+{
+    return pow_fast(d->a, d->b, &d->result);
+}
+
+static int math_fact(CalcData* d)
+{
+    return fact_lookup(d->a, &d->result);
+}
+
+static int math_invalid(CalcData*)
+{
+    return mathlib::MATH_ERR_INVALID_ARG;
+}
+
+static const MathOp MATH_OPS[OP_COUNT] = {math_add, math_sub, math_mul,
+                                          math_div, math_pow, math_fact,
+                                          math_invalid};
+
+// return: mathlib return code
+static int compute_math(CalcData* d)
+{
+    return MATH_OPS[op_info(d->op)->index](d);
+}
+
+template <>
+Status compute<int>(CalcData* d)
+{
+    return status_from_math(compute_math(d));
+}
+
+// wide factorials come from a table like FACT, sized for the widest T
+static const int FACT_WIDE_SIZE = 40;
+
+template <typename T>
+struct FactTableWide
+{
+    int max;
+    T v[FACT_WIDE_SIZE];
+};
+
+template <typename T>
+static constexpr FactTableWide<T> make_fact_table_wide()
+{
+    FactTableWide<T> t = {};
+    t.v[0] = 1;
+    while (t.v[t.max] <= int_max<T>() / (t.max + 1)) {
+        t.v[t.max + 1] = t.v[t.max] * (t.max + 1);
+        ++t.max;
+    }
+
+    return t;
+}
+
+template <typename T>
+static constexpr FactTableWide<T> FACT_WIDE = make_fact_table_wide<T>();
+
+static_assert(FACT_WIDE<int64_t>.max == 20, "20! is the last in 64 bits");
+#if CALC_HAVE_INT128
+static_assert(FACT_WIDE<int128>.max == 33, "33! is the last in 128 bits");
+#endif
+
+template <typename T>
+static Status fact_wide(T n, T* out)
+{
+    if (n < 0) return STATUS_INVALID_ARG;
+    if (n > FACT_WIDE<T>.max) return STATUS_OVERFLOW;
+
+    *out = FACT_WIDE<T>.v[(int)n];
+
+    return STATUS_OK;
+}
+
+// squaring as in pow_fast(); without its table the loop still ends within
+// log2(bits) squarings, as any base other than 0 and +-1 overflows by then
+template <typename T>
+static Status pow_wide(T base, T exp, T* out)
+{
+    if (exp < 0) return STATUS_INVALID_ARG;
+
+    if (exp == 0 || base == 1) {
+        *out = 1;
+        return STATUS_OK;
+    }
+
+    if (base == 0) {
+        *out = 0;
+        return STATUS_OK;
+    }
+
+    if (base == -1) {
+        *out = (exp & 1) ? -1 : 1;
+        return STATUS_OK;
+    }
+
+    T r = 1;
+    T b = base;
+    for (;;) {
+        if ((exp & 1) && __builtin_mul_overflow(r, b, &r)) {
+            return STATUS_OVERFLOW;
+        }
+
+        exp >>= 1;
+        if (exp == 0) break;
+
+        if (__builtin_mul_overflow(b, b, &b)) return STATUS_OVERFLOW;
+    }
+
+    *out = r;
+
+    return STATUS_OK;
+}
+
+// wide handlers, by OpIndex
+template <typename T>
+using WideOp = Status (*)(CalcDataT<T>* d);
+
+template <typename T>
+static Status wide_add(CalcDataT<T>* d)
+{
+    if (__builtin_add_overflow(d->a, d->b, &d->result)) return STATUS_OVERFLOW;
+
+    return STATUS_OK;
+}
+
+template <typename T>
+static Status wide_sub(CalcDataT<T>* d)
+{
+    if (__builtin_sub_overflow(d->a, d->b, &d->result)) return STATUS_OVERFLOW;
+
+    return STATUS_OK;
+}
+
+template <typename T>
+static Status wide_mul(CalcDataT<T>* d)
+{
+    if (__builtin_mul_overflow(d->a, d->b, &d->result)) return STATUS_OVERFLOW;
+
+    return STATUS_OK;
+}
+
+template <typename T>
+static Status wide_div(CalcDataT<T>* d)
+{
+    if (d->b == 0) return STATUS_DIV_BY_ZERO;
+    if (d->a == int_min<T>() && d->b == -1) return STATUS_OVERFLOW;
+
+    d->result = d->a / d->b;
+
+    return STATUS_OK;
+}
+
+template <typename T>
+static Status wide_pow(CalcDataT<T>* d)
+{
+    return pow_wide(d->a, d->b, &d->result);
+}
+
+template <typename T>
+static Status wide_fact(CalcDataT<T>* d)
+{
+    return fact_wide(d->a, &d->result);
+}
+
+template <typename T>
+static Status wide_invalid(CalcDataT<T>*)
+{
+    return STATUS_INVALID_ARG;
+}
+
+template <typename T>
+static const WideOp<T> WIDE_OPS[OP_COUNT] = {
+    wide_add<T>, wide_sub<T>, wide_mul<T>, wide_div<T>,
+    wide_pow<T>, wide_fact<T>, wide_invalid<T>};
+
+template <typename T>
+Status compute(CalcDataT<T>* d)
+{
+    return WIDE_OPS<T>[op_info(d->op)->index](d);
+}
+
+// '!' of a double up to 170, the last below DBL_MAX
+static const int FACT_REAL_MAX = 170;
+
+struct FactTableReal
+{
+    double v[FACT_REAL_MAX + 1];
+};
+
+static constexpr FactTableReal make_fact_table_real()
+{
+    FactTableReal t = {};
+    t.v[0] = 1;
+    for (int i = 1; i <= FACT_REAL_MAX; ++i) t.v[i] = t.v[i - 1] * i;
+
+    return t;
+}
+
+static constexpr FactTableReal FACT_REAL = make_fact_table_real();
+
+// + - x / round as the SIMD kernels do, so either gives the same bits
+template <>
+Status compute<double>(CalcDataT<double>* d)
+{
+    double a = d->a;
+    double b = d->b;
+    double r;
+
+    switch (op_info(d->op)->index) {
+    case OP_ADD:
+        r = a + b;
+        break;
+    case OP_SUB:
+        r = a - b;
+        break;
+    case OP_MUL:
+        r = a * b;
+        break;
+    case OP_DIV:
+        if (b == 0) return STATUS_DIV_BY_ZERO;
+        r = a / b;
+        break;
+    case OP_POW:
+        if (b < 0 || (a < 0 && b != std::floor(b))) return STATUS_INVALID_ARG;
+        r = std::pow(a, b);
+        break;
+    case OP_FACT:
+        if (a < 0 || a != std::floor(a)) return STATUS_INVALID_ARG;
+        if (a > FACT_REAL_MAX) return STATUS_OVERFLOW;
+        r = FACT_REAL.v[(int)a];
+        break;
+    default:
+        return STATUS_INVALID_ARG;
+    }
+
+    if (!std::isfinite(r)) return STATUS_OVERFLOW;
+
+    d->result = r;
+
+    return STATUS_OK;
+}
+
+#if CALC_HAVE_INT128
+static Status fixed_narrow(int128 v, int64_t* out)
+{
+    if (v > INT64_MAX || v < INT64_MIN) return STATUS_OVERFLOW;
+
+    *out = (int64_t)v;
+
+    return STATUS_OK;
+}
+
+// n / d rounded half away from zero; d is not 0
+static int128 div_round(int128 n, int128 d)
+{
+    int128 q = n / d;
+    int128 r = n % d;
+    int128 ar = r < 0 ? -r : r;
+    int128 ad = d < 0 ? -d : d;
+
+    if (ar >= ad - ar) q += ((n < 0) != (d < 0)) ? -1 : 1;
+
+    return q;
+}
+
+// a product of two int64_t always fits in an int128
+static Status fixed_mul(int64_t a, int64_t b, int scale, int64_t* out)
+{
+    return fixed_narrow(div_round((int128)a * b, POW10.v[scale]), out);
+}
+
+// as pow_wide(), on values of a scale
+static Status fixed_pow(int64_t base, int64_t exp, int scale, int64_t* out)
+{
+    const int64_t one = POW10.v[scale];
+
+    if (exp < 0 || exp % one != 0) return STATUS_INVALID_ARG;
+    exp /= one;
+
+    if (exp == 0 || base == one) {
+        *out = one;
+        return STATUS_OK;
+    }
+
+    if (base == 0) {
+        *out = 0;
+        return STATUS_OK;
+    }
+
+    if (base == -one) {
+        *out = (exp & 1) ? -one : one;
+        return STATUS_OK;
+    }
+
+    int64_t r = one;
+    int64_t b = base;
+    for (;;) {
+        if ((exp & 1) && fixed_mul(r, b, scale, &r) != STATUS_OK) {
+            return STATUS_OVERFLOW;
+        }
+
+        exp >>= 1;
+        if (exp == 0) break;
+
+        if (fixed_mul(b, b, scale, &b) != STATUS_OK) return STATUS_OVERFLOW;
+    }
+
+    *out = r;
+
+    return STATUS_OK;
+}
+
+Status compute_fixed(CalcDataT<int64_t>* d, int scale)
+{
+    const int64_t one = POW10.v[scale];
+    int64_t a = d->a;
+    int64_t b = d->b;
+
+    switch (op_info(d->op)->index) {
+    case OP_ADD:
+    case OP_SUB:
+        return compute(d);
+    case OP_MUL:
+        return fixed_mul(a, b, scale, &d->result);
+    case OP_DIV:
+        if (b == 0) return STATUS_DIV_BY_ZERO;
+        return fixed_narrow(div_round((int128)a * one, b), &d->result);
+    case OP_POW:
+        return fixed_pow(a, b, scale, &d->result);
+    case OP_FACT: {
+        if (a < 0 || a % one != 0) return STATUS_INVALID_ARG;
+
+        int64_t f;
+        if (fact_wide(a / one, &f) != STATUS_OK) return STATUS_OVERFLOW;
+        if (__builtin_mul_overflow(f, one, &d->result)) return STATUS_OVERFLOW;
+
+        return STATUS_OK;
+    }
+    default:
+        return STATUS_INVALID_ARG;
+    }
+}
+#endif
+
+// a number of T as rpn_eval() and rpn_compile() read it
+template <typename T>
+static int parse_value(const char* b, const char* e, T* out)
+{
+    return parse_int_span(b, e, out);
+}
+
+static int parse_value(const char* b, const char* e, double* out)
+{
+    return parse_real_span(b, e, out);
+}
+
+// how rpn_eval() reads and computes T: by check() and compute(), or as
+// --fixed values of a scale
+template <typename T>
+struct RpnNum
+{
+    int parse(const char* b, const char* e, T* out) const
+    {
+        return parse_value(b, e, out);
+    }
+
+    Status compute(CalcDataT<T>* d) const
+    {
+        return calc::compute(d);
+    }
+};
+
+#if CALC_HAVE_INT128
+struct RpnFixed
+{
+    int scale;
+
+    int parse(const char* b, const char* e, int64_t* out) const
+    {
+        return parse_fixed_span(b, e, scale, out);
+    }
+
+    Status compute(CalcDataT<int64_t>* d) const
+    {
+        return compute_fixed(d, scale);
+    }
+};
+#endif
+
+template <typename T, typename Num>
+static Status rpn_eval_num(const Num* num, const Token* toks, int n,
+                           T* result, int* pos)
+{
+    T stack[RPN_STACK_MAX];
+    int depth = 0;
+
+    for (int i = 0; i < n; ++i) {
+        const Token* t = &toks[i];
+        *pos = i;
+
+        if (t->e - t->b == 1 && !(*t->b >= '0' && *t->b <= '9')) {
+            CalcDataT<T> d;
+            d.op = *t->b;
+            d.result = 0;
+
+            if (d.op == '!') {
+                if (depth < 1) return STATUS_MISSING_OPERAND;
+                d.a = stack[--depth];
+                d.b = 0;
+            } else if (is_binary_op(d.op)) {
+                if (depth < 2) return STATUS_MISSING_OPERAND;
+                d.b = stack[--depth];
+                d.a = stack[--depth];
+            } else {
+                return STATUS_UNKNOWN_OP;
+            }
+
+            Status st = check(&d);
+            if (st == STATUS_OK) st = num->compute(&d);
+            if (st != STATUS_OK) return st;
+
+            stack[depth++] = d.result;
+            continue;
+        }
+
+        if (depth == RPN_STACK_MAX) return STATUS_STACK_FULL;
+        if (num->parse(t->b, t->e, &stack[depth]) != 0) return STATUS_USAGE;
+        ++depth;
+    }
+
+    *pos = n;
+    if (depth == 0) return STATUS_MISSING_OPERAND;
+    if (depth > 1) return STATUS_EXTRA_OPERAND;
+
+    *result = stack[0];
+
+    return STATUS_OK;
+}
+
+template <typename T>
+Status rpn_eval(const Token* toks, int n, T* result, int* pos)
+{
+    const RpnNum<T> num = {};
+
+    return rpn_eval_num(&num, toks, n, result, pos);
+}
+
+#if CALC_HAVE_INT128
+Status rpn_eval_fixed(const Token* toks, int n, int scale, int64_t* result,
+                      int* pos)
+{
+    const RpnFixed num = {scale};
+
+    return rpn_eval_num(&num, toks, n, result, pos);
+}
+#endif
+
+// return: k - 1 for a "$k" token, or -1
+static int placeholder(const Token* t)
+{
+    if (t->e - t->b != 2 || t->b[0] != '$') return -1;
+
+    int k = t->b[1] - '0';
+
+    return (k >= 1 && k <= RPN_ARGS_MAX) ? k - 1 : -1;
+}
+
+template <typename T>
+Status rpn_compile(const Token* toks, int n, RpnProgramT<T>* p, int* pos)
+{
+    p->n = 0;
+    p->args = 0;
+    p->depth = 0;
+
+    if (n > RPN_PROGRAM_MAX) {
+        *pos = RPN_PROGRAM_MAX;
+        return STATUS_USAGE;
+    }
+
+    int depth = 0;
+
+    for (int i = 0; i < n; ++i) {
+        const Token* t = &toks[i];
+        *pos = i;
+
+        if (t->e - t->b == 1 && !(*t->b >= '0' && *t->b <= '9')) {
+            char op = *t->b;
+            int pops = (op == '!') ? 1 : 2;
+
+            if (op != '!' && !is_binary_op(op)) return STATUS_UNKNOWN_OP;
+            if (depth < pops) return STATUS_MISSING_OPERAND;
+            depth -= pops - 1;
+
+            // a value pushed right before a binary op is only ever its b
+            RpnInsnT<T>* last = &p->insns[p->n - 1];
+            if (pops == 2 &&
+                (last->code == RPN_PUSH || last->code == RPN_PUSH_ARG)) {
+                last->code = (last->code == RPN_PUSH) ? RPN_OP_IMM : RPN_OP_ARG;
+                last->op = op;
+                last->tok = i;
+                continue;
+            }
+
+            RpnInsnT<T>* in = &p->insns[p->n++];
+            in->code = RPN_OP;
+            in->op = op;
+            in->arg = 0;
+            in->tok = i;
+            in->imm = 0;
+            continue;
+        }
+
+        if (depth == RPN_STACK_MAX) return STATUS_STACK_FULL;
+
+        RpnInsnT<T>* in = &p->insns[p->n++];
+        in->op = 0;
+        in->arg = 0;
+        in->tok = i;
+        in->imm = 0;
+
+        int k = placeholder(t);
+        if (k >= 0) {
+            in->code = RPN_PUSH_ARG;
+            in->arg = (uint8_t)k;
+            if (k + 1 > p->args) p->args = k + 1;
+        } else {
+            in->code = RPN_PUSH;
+            if (parse_value(t->b, t->e, &in->imm) != 0) return STATUS_USAGE;
+        }
+
+        if (++depth > p->depth) p->depth = depth;
+    }
+
+    *pos = n;
+    if (depth == 0) return STATUS_MISSING_OPERAND;
+    if (depth > 1) return STATUS_EXTRA_OPERAND;
+
+    return STATUS_OK;
+}
+
+// *r = a op b, checked and computed like one expression
+template <typename T>
+static Status rpn_step(char op, T a, T b, T* r)
+{
+    CalcDataT<T> d;
+    d.a = a;
+    d.b = b;
+    d.op = op;
+    d.result = 0;
+
+    Status st = check(&d);
+    if (st == STATUS_OK) st = compute(&d);
+    *r = d.result;
+
+    return st;
+}
+
+template <typename T>
+Status rpn_run(const RpnProgramT<T>* p, const T* args, T* result, int* pos)
+{
+    T stack[RPN_STACK_MAX];
+    int depth = 0;
+
+    for (int i = 0; i < p->n; ++i) {
+        const RpnInsnT<T>* in = &p->insns[i];
+        T b = 0;
+
+        switch (in->code) {
+        case RPN_PUSH:
+            stack[depth++] = in->imm;
+            continue;
+        case RPN_PUSH_ARG:
+            stack[depth++] = args[in->arg];
+            continue;
+        case RPN_OP:
+            if (in->op != '!') b = stack[--depth];
+            break;
+        case RPN_OP_IMM:
+            b = in->imm;
+            break;
+        case RPN_OP_ARG:
+            b = args[in->arg];
+            break;
+        case RPN_OP_SELF:
+            b = stack[depth - 1];
+            break;
+        }
+
+        Status st = rpn_step(in->op, stack[depth - 1], b, &stack[depth - 1]);
+        if (st != STATUS_OK) {
+            *pos = in->tok;
+            return st;
+        }
+    }
+
+    *result = stack[0];
+
+    return STATUS_OK;
+}
+
+// return: 1 if in can neither fail nor change the value it is applied to
+template <typename T>
+static int rpn_is_identity(const RpnInsnT<T>* in)
+{
+    if (in->code != RPN_OP_IMM) return 0;
+
+    switch (in->op) {
+    case '+':
+        // -0.0 + 0 is 0.0
+        return in->imm == 0 && !std::is_floating_point<T>::value;
+    case '-':
+        return in->imm == 0;
+    case 'x':
+    case '/':
+    case '^':
+        return in->imm == 1;
+    default:
+        return 0;
+    }
+}
+
+// a^2 fails exactly when a * a overflows, with the same status; pow() of
+// a double need not round as a * a does
+template <typename T>
+static int rpn_is_square(const RpnInsnT<T>* in)
+{
+    return in->code == RPN_OP_IMM && in->op == '^' && in->imm == 2 &&
+           !std::is_floating_point<T>::value;
+}
+
+// return: 1 - last, a push, now holds the value in computes from it
+template <typename T>
+static int rpn_fold(RpnInsnT<T>* last, const RpnInsnT<T>* in)
+{
+    T b = 0;
+
+    switch (in->code) {
+    case RPN_OP:
+        if (in->op != '!') return 0;
+        break;
+    case RPN_OP_IMM:
+        b = in->imm;
+        break;
+    case RPN_OP_SELF:
+        b = last->imm;
+        break;
+    default:
+        return 0;
+    }
+
+    // a failing step stays, so each row still reports it where it would
+    T v;
+    if (rpn_step(in->op, last->imm, b, &v) != STATUS_OK) return 0;
+
+    last->imm = v;
+
+    return 1;
+}
+
+template <typename T>
+void rpn_optimize(RpnProgramT<T>* p)
+{
+    // p->insns[0, n) is the rewritten program so far; each step is
+    // rewritten against its end until no rule applies, then appended
+    int n = 0;
+
+    for (int i = 0; i < p->n; ++i) {
+        RpnInsnT<T> in = p->insns[i];
+        int keep = 1;
+
+        while (keep) {
+            RpnInsnT<T>* last = (n != 0) ? &p->insns[n - 1] : nullptr;
+            int pushed = last && (last->code == RPN_PUSH ||
+                                  last->code == RPN_PUSH_ARG);
+
+            if (in.code == RPN_OP && in.op != '!' && pushed) {
+                // a push left right before a binary op by the rules below
+                in.code = (last->code == RPN_PUSH) ? RPN_OP_IMM : RPN_OP_ARG;
+                in.arg = last->arg;
+                in.imm = last->imm;
+                --n;
+            } else if (rpn_is_identity(&in)) {
+                keep = 0;
+            } else if (rpn_is_square(&in)) {
+                in.code = RPN_OP_SELF;
+                in.op = 'x';
+                in.imm = 0;
+            } else if (last && last->code == RPN_PUSH && rpn_fold(last, &in)) {
+                keep = 0;
+            } else {
+                break;
+            }
+        }
+
+        if (keep) p->insns[n++] = in;
+    }
+
+    p->n = n;
+}
+
+// rows per rpn_run_block(); its value columns live on the stack
+static const size_t RPN_BLOCK = 64;
+
+// out[i] = a[i] op b[i] for the rows whose status is still STATUS_OK; out
+// may be a
+template <typename T>
+static void rpn_step_column(const KernelSet* k, char op, const T* a,
+                            const T* b, T* out, uint8_t* status, size_t n)
+{
+    if constexpr (std::is_same<T, int>::value) {
+        int col = kernels_op_index(op);
+        if (col >= 0) {
+            int st[RPN_BLOCK];
+            kernels_op(k, col)(a, b, out, st, n);
+
+            for (size_t i = 0; i < n; ++i) {
+                if (status[i] == STATUS_OK) status[i] = status_from_math(st[i]);
+            }
+            return;
+        }
+    } else if constexpr (std::is_same<T, double>::value) {
+        int col = kernels_op_index(op);
+        if (col >= 0) {
+            int st[RPN_BLOCK];
+            kernels_real_op(k, col)(a, b, out, st, n);
+
+            for (size_t i = 0; i < n; ++i) {
+                if (status[i] == STATUS_OK) status[i] = (uint8_t)st[i];
+            }
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (status[i] == STATUS_OK) {
+            status[i] = rpn_step(op, a[i], b[i], &out[i]);
+        } else {
+            out[i] = 0;
+        }
+    }
+}
+
+// the stack holds columns: a pushed $k is the input column itself, every
+// other value a column of vals
+template <typename T>
+static void rpn_run_block(const KernelSet* k, const RpnProgramT<T>* p,
+                          const T* const* cols, size_t n, T* results,
+                          uint8_t* status)
+{
+    T vals[RPN_STACK_MAX][RPN_BLOCK];
+    T imm[RPN_BLOCK];
+    const T* stack[RPN_STACK_MAX];
+    int depth = 0;
+
+    memset(status, STATUS_OK, n);
+
+    for (int i = 0; i < p->n; ++i) {
+        const RpnInsnT<T>* in = &p->insns[i];
+        const T* b = imm;
+
+        switch (in->code) {
+        case RPN_PUSH:
+            for (size_t j = 0; j < n; ++j) vals[depth][j] = in->imm;
+            stack[depth] = vals[depth];
+            ++depth;
+            continue;
+        case RPN_PUSH_ARG:
+            stack[depth++] = cols[in->arg];
+            continue;
+        case RPN_OP:
+            if (in->op == '!') {
+                for (size_t j = 0; j < n; ++j) imm[j] = 0;
+            } else {
+                b = stack[--depth];
+            }
+            break;
+        case RPN_OP_IMM:
+            for (size_t j = 0; j < n; ++j) imm[j] = in->imm;
+            break;
+        case RPN_OP_ARG:
+            b = cols[in->arg];
+            break;
+        case RPN_OP_SELF:
+            b = stack[depth - 1];
+            break;
+        }
+
+        T* out = vals[depth - 1];
+        rpn_step_column(k, in->op, stack[depth - 1], b, out, status, n);
+        stack[depth - 1] = out;
+    }
+
+    for (size_t j = 0; j < n; ++j) {
+        results[j] = (status[j] == STATUS_OK) ? stack[0][j] : 0;
+    }
+}
+
+template <typename T>
+void rpn_run_columns(const KernelSet* k, const RpnProgramT<T>* p,
+                     const T* const* cols, size_t n, T* results,
+                     uint8_t* status)
+{
+    const T* block[RPN_ARGS_MAX];
+
+    for (size_t i = 0; i < n; i += RPN_BLOCK) {
+        size_t m = (n - i < RPN_BLOCK) ? n - i : RPN_BLOCK;
+        for (int j = 0; j < p->args; ++j) block[j] = cols[j] + i;
+
+        rpn_run_block(k, p, block, m, results + i, status + i);
+    }
+}
+
+template <typename T>
+void rpn_run_columns(const RpnProgramT<T>* p, const T* const* cols, size_t n,
+                     T* results, uint8_t* status)
+{
+    rpn_run_columns(kernels_best(), p, cols, n, results, status);
+}
+
+// records per evaluate_block(); its column buffers live on the stack
+static const size_t EVAL_BLOCK = 256;
+
+struct EvalColumn
+{
+    int a[EVAL_BLOCK];
+    int b[EVAL_BLOCK];
+    int result[EVAL_BLOCK];
+    int status[EVAL_BLOCK];
+    unsigned idx[EVAL_BLOCK];
+    size_t n;
+};
+
+// checks the block as columns, then computes what passed: the + - x /
+// records through the kernels, the other ops one at a time
+static void evaluate_block(const KernelSet* k, const CalcData* d, size_t n,
+                           int* results, uint8_t* status)
+{
+    int a[EVAL_BLOCK];
+    int b[EVAL_BLOCK];
+    char op[EVAL_BLOCK];
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = d[i].a;
+        b[i] = d[i].b;
+        op[i] = d[i].op;
+        results[i] = 0;
+    }
+
+    // failures have their status already
+    EvalColumn cols[KERNEL_OPS];
+    unsigned other[EVAL_BLOCK];
+    unsigned failed[EVAL_BLOCK];
+    unsigned* idx[KERNEL_LISTS] = {cols[0].idx, cols[1].idx, cols[2].idx,
+                                   cols[3].idx, other,       failed};
+    size_t counts[KERNEL_LISTS];
+    k->check(a, b, op, n, status, idx, counts);
+
+    for (size_t j = 0; j < counts[KERNEL_LIST_OTHER]; ++j) {
+        CalcData x = d[other[j]];
+        status[other[j]] = compute(&x);
+        if (status[other[j]] == STATUS_OK) results[other[j]] = x.result;
+    }
+
+    for (int col = 0; col < KERNEL_OPS; ++col) {
+        EvalColumn* c = &cols[col];
+        c->n = counts[col];
+        if (c->n == 0) continue;
+
+        for (size_t j = 0; j < c->n; ++j) {
+            c->a[j] = a[c->idx[j]];
+            c->b[j] = b[c->idx[j]];
+        }
+
+        kernels_op(k, col)(c->a, c->b, c->result, c->status, c->n);
+
+        for (size_t j = 0; j < c->n; ++j) {
+            status[c->idx[j]] = status_from_math(c->status[j]);
+            if (c->status[j] == mathlib::MATH_OK) {
+                results[c->idx[j]] = c->result[j];
+            }
+        }
+    }
+}
+
+void evaluate(const KernelSet* k, const CalcData* d, size_t n, int* results,
+              uint8_t* status)
+{
+    for (size_t i = 0; i < n; i += EVAL_BLOCK) {
+        size_t m = (n - i < EVAL_BLOCK) ? n - i : EVAL_BLOCK;
+        evaluate_block(k, d + i, m, results + i, status + i);
+    }
+}
+
+void evaluate(const CalcData* d, size_t n, int* results, uint8_t* status)
+{
+    evaluate(kernels_best(), d, n, results, status);
+}
+
+template Status check<int>(const CalcData* d);
+template Status rpn_eval<int>(const Token* toks, int n, int* result,
+                              int* pos);
+template Status rpn_compile<int>(const Token* toks, int n,
+                                 RpnProgramT<int>* p, int* pos);
+template void rpn_optimize<int>(RpnProgramT<int>* p);
+template Status rpn_run<int>(const RpnProgramT<int>* p,
+                             const int* args, int* result, int* pos);
+template void rpn_run_columns<int>(const RpnProgramT<int>* p,
+                                   const int* const* cols, size_t n,
+                                   int* results, uint8_t* status);
+template void rpn_run_columns<int>(const KernelSet* k,
+                                   const RpnProgramT<int>* p,
+                                   const int* const* cols, size_t n,
+                                   int* results, uint8_t* status);
+
+template int parse_int_span<int64_t>(const char* b, const char* e,
+                                     int64_t* out);
+template Status check<int64_t>(const CalcDataT<int64_t>* d);
+template Status compute<int64_t>(CalcDataT<int64_t>* d);
+template Status rpn_eval<int64_t>(const Token* toks, int n, int64_t* result,
+                                  int* pos);
+template Status rpn_compile<int64_t>(const Token* toks, int n,
+                                     RpnProgramT<int64_t>* p, int* pos);
+template void rpn_optimize<int64_t>(RpnProgramT<int64_t>* p);
+template Status rpn_run<int64_t>(const RpnProgramT<int64_t>* p,
+                                 const int64_t* args, int64_t* result,
+                                 int* pos);
+template void rpn_run_columns<int64_t>(const RpnProgramT<int64_t>* p,
+                                       const int64_t* const* cols, size_t n,
+                                       int64_t* results, uint8_t* status);
+template void rpn_run_columns<int64_t>(const KernelSet* k,
+                                       const RpnProgramT<int64_t>* p,
+                                       const int64_t* const* cols, size_t n,
+                                       int64_t* results, uint8_t* status);
+
+template Status check<double>(const CalcDataT<double>* d);
+template Status rpn_eval<double>(const Token* toks, int n, double* result,
+                                 int* pos);
+template Status rpn_compile<double>(const Token* toks, int n,
+                                    RpnProgramT<double>* p, int* pos);
+template void rpn_optimize<double>(RpnProgramT<double>* p);
+template Status rpn_run<double>(const RpnProgramT<double>* p,
+                                const double* args, double* result,
+                                int* pos);
+template void rpn_run_columns<double>(const RpnProgramT<double>* p,
+                                      const double* const* cols, size_t n,
+                                      double* results, uint8_t* status);
+template void rpn_run_columns<double>(const KernelSet* k,
+                                      const RpnProgramT<double>* p,
+                                      const double* const* cols, size_t n,
+                                      double* results, uint8_t* status);
+
+#if CALC_HAVE_INT128
+template int parse_int_span<int128>(const char* b, const char* e,
+                                    int128* out);
+template Status check<int128>(const CalcDataT<int128>* d);
+template Status compute<int128>(CalcDataT<int128>* d);
+template Status rpn_eval<int128>(const Token* toks, int n, int128* result,
+                                 int* pos);
+template Status rpn_compile<int128>(const Token* toks, int n,
+                                    RpnProgramT<int128>* p, int* pos);
+template void rpn_optimize<int128>(RpnProgramT<int128>* p);
+template Status rpn_run<int128>(const RpnProgramT<int128>* p,
+                                const int128* args, int128* result,
+                                int* pos);
+template void rpn_run_columns<int128>(const RpnProgramT<int128>* p,
+                                      const int128* const* cols, size_t n,
+                                      int128* results, uint8_t* status);
+template void rpn_run_columns<int128>(const KernelSet* k,
+                                      const RpnProgramT<int128>* p,
+                                      const int128* const* cols, size_t n,
+                                      int128* results, uint8_t* status);
+#endif
+
+} // namespace calc
@@ -0,0 +1,260 @@
+#include "kernels.h"
+
+#include "calculator.h"
+#include "mathlib.h"
+
+#include <cstring>
+
+static void scalar_add(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = mathlib::math_add(a[i], b[i], &result[i]);
+    }
+}
+
+static void scalar_sub(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = mathlib::math_sub(a[i], b[i], &result[i]);
+    }
+}
+
+static void scalar_mul(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = mathlib::math_mul(a[i], b[i], &result[i]);
+    }
+}
+
+static void scalar_div(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = mathlib::math_div(a[i], b[i], &result[i]);
+    }
+}
+
+static void scalar_check(const int* a, const int* b, const char* op,
+                         size_t n, uint8_t* status, unsigned* const* idx,
+                         size_t* counts)
+{
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = 0;
+
+    kernels_check_tail(a, b, op, 0, n, status, idx, counts);
+}
+
+static void scalar_real(char op, const double* a, const double* b,
+                        double* result, int* status, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        calc::CalcDataT<double> d = {a[i], b[i], op, 0};
+        status[i] = calc::compute(&d);
+        result[i] = d.result;
+    }
+}
+
+static void scalar_real_add(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    scalar_real('+', a, b, result, status, n);
+}
+
+static void scalar_real_sub(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    scalar_real('-', a, b, result, status, n);
+}
+
+static void scalar_real_mul(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    scalar_real('x', a, b, result, status, n);
+}
+
+static void scalar_real_div(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    scalar_real('/', a, b, result, status, n);
+}
+
+static void scalar_fixed_add(const int64_t* a, const int64_t* b,
+                             int64_t* result, int* status, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = __builtin_add_overflow(a[i], b[i], &result[i])
+                        ? calc::STATUS_OVERFLOW
+                        : calc::STATUS_OK;
+    }
+}
+
+static void scalar_fixed_sub(const int64_t* a, const int64_t* b,
+                             int64_t* result, int* status, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        status[i] = __builtin_sub_overflow(a[i], b[i], &result[i])
+                        ? calc::STATUS_OVERFLOW
+                        : calc::STATUS_OK;
+    }
+}
+
+static const KernelSet scalar_set = {
+    "scalar",        scalar_add,       scalar_sub,
+    scalar_mul,      scalar_div,       scalar_check,
+    scalar_real_add, scalar_real_sub,  scalar_real_mul,
+    scalar_real_div, scalar_fixed_add, scalar_fixed_sub};
+
+const KernelSet* kernels_scalar()
+{
+    return &scalar_set;
+}
+
+struct KernelIndexTable
+{
+    signed char v[256];
+};
+
+static constexpr KernelIndexTable make_kernel_index_table()
+{
+    KernelIndexTable t = {};
+    for (int c = 0; c < 256; ++c) t.v[c] = -1;
+
+    t.v['+'] = 0;
+    t.v['-'] = 1;
+    t.v['x'] = 2;
+    t.v['/'] = 3;
+
+    return t;
+}
+
+static constexpr KernelIndexTable KERNEL_INDEX = make_kernel_index_table();
+
+int kernels_op_index(char op)
+{
+    return KERNEL_INDEX.v[(unsigned char)op];
+}
+
+BinaryKernel kernels_op(const KernelSet* k, int index)
+{
+    switch (index) {
+    case 0:
+        return k->add;
+    case 1:
+        return k->sub;
+    case 2:
+        return k->mul;
+    default:
+        return k->div;
+    }
+}
+
+RealKernel kernels_real_op(const KernelSet* k, int index)
+{
+    switch (index) {
+    case 0:
+        return k->real_add;
+    case 1:
+        return k->real_sub;
+    case 2:
+        return k->real_mul;
+    default:
+        return k->real_div;
+    }
+}
+
+FixedKernel kernels_fixed_op(const KernelSet* k, int index)
+{
+    return index == 0 ? k->fixed_add : k->fixed_sub;
+}
+
+void kernels_compact(const char* op, const uint8_t* status, size_t begin,
+                     size_t end, unsigned* const* idx, size_t* counts)
+{
+    size_t c[KERNEL_LISTS];
+    for (int l = 0; l < KERNEL_LISTS; ++l) c[l] = counts[l];
+
+    for (size_t i = begin; i < end; ++i) {
+        int col = KERNEL_INDEX.v[(unsigned char)op[i]];
+        int list = col < 0 ? KERNEL_LIST_OTHER : col;
+        list = status[i] == calc::STATUS_OK ? list : KERNEL_LIST_FAILED;
+
+        idx[list][c[list]++] = (unsigned)i;
+    }
+
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = c[l];
+}
+
+void kernels_check_tail(const int* a, const int* b, const char* op,
+                        size_t begin, size_t n, uint8_t* status,
+                        unsigned* const* idx, size_t* counts)
+{
+    for (size_t i = begin; i < n; ++i) {
+        calc::CalcData d = {a[i], b[i], op[i], 0};
+        status[i] = calc::check(&d);
+    }
+
+    kernels_compact(op, status, begin, n, idx, counts);
+}
+
+// in order of preference
+static const struct
+{
+    const char* name;
+    const KernelSet* (*get)();
+} KERNELS[] = {
+    {"avx512", kernels_avx512}, {"avx2", kernels_avx2}, {"sse", kernels_sse},
+    {"neon", kernels_neon},     {"scalar", kernels_scalar},
+};
+
+static int cpu_supports(const char* name)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_cpu_init();
+
+    if (strcmp(name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse") == 0) return __builtin_cpu_supports("sse4.1");
+#endif
+
+    // NEON is part of the aarch64 baseline, scalar runs anywhere
+    (void)name;
+
+    return 1;
+}
+
+int kernels_select(const char* name, const KernelSet** out)
+{
+    for (const auto& k : KERNELS) {
+        if (strcmp(k.name, name) != 0) continue;
+
+        const KernelSet* set = k.get();
+        if (!set || !cpu_supports(name)) return 2;
+
+        *out = set;
+        return 0;
+    }
+
+    return 1;
+}
+
+static const KernelSet* find_best()
+{
+    const KernelSet* best = kernels_scalar();
+
+    for (const auto& k : KERNELS) {
+        if (kernels_select(k.name, &best) == 0) break;
+    }
+
+    return best;
+}
+
+const KernelSet* kernels_best()
+{
+    // a function-local static, so library callers on several threads can
+    // race to the first call
+    static const KernelSet* const best = find_best();
+
+    return best;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Structure-of-arrays kernels for the batch engine. Each one computes
+// result[i] and status[i] for i < n, where status[i] is the mathlib return
+// code the matching mathlib::math_* call would give for a[i], b[i].
+// result[i] is unspecified when status[i] is not MATH_OK.
+typedef void (*BinaryKernel)(const int* a, const int* b, int* result,
+                             int* status, size_t n);
+
+// calc::check() over columns: status[i] is the calc::Status it gives a[i],
+// b[i] and op[i], and the records are split as by kernels_compact(), all
+// without a branch per record
+typedef void (*CheckKernel)(const int* a, const int* b, const char* op,
+                            size_t n, uint8_t* status, unsigned* const* idx,
+                            size_t* counts);
+
+// the same over the doubles of --real, where status[i] is the calc::Status
+// calc::compute() gives a[i], b[i]; result[i] is unspecified unless it is
+// STATUS_OK
+typedef void (*RealKernel)(const double* a, const double* b, double* result,
+                           int* status, size_t n);
+
+// + and - over int64_t, of --width 64 and the scaled values of --fixed
+// alike, status as for RealKernel; fixed x and / need a 128-bit product per
+// record and have no kernel
+typedef void (*FixedKernel)(const int64_t* a, const int64_t* b,
+                            int64_t* result, int* status, size_t n);
+
+struct KernelSet
+{
+    const char* name;
+    BinaryKernel add;
+    BinaryKernel sub;
+    BinaryKernel mul;
+    BinaryKernel div;
+    CheckKernel check;
+    RealKernel real_add;
+    RealKernel real_sub;
+    RealKernel real_mul;
+    RealKernel real_div;
+    FixedKernel fixed_add;
+    FixedKernel fixed_sub;
+};
+
+// + - x / have kernels, in this order
+static const int KERNEL_OPS = 4;
+
+// return: index of op among KERNEL_OPS, or -1 when it has no kernel
+int kernels_op_index(char op);
+
+// return: the kernel of k for the op at index
+BinaryKernel kernels_op(const KernelSet* k, int index);
+RealKernel kernels_real_op(const KernelSet* k, int index);
+
+// + - have fixed kernels, as the first two of KERNEL_OPS
+static const int FIXED_KERNEL_OPS = 2;
+
+// index is below FIXED_KERNEL_OPS
+FixedKernel kernels_fixed_op(const KernelSet* k, int index);
+
+// lists of kernels_compact(): one per kernel op, then these
+static const int KERNEL_LIST_OTHER = KERNEL_OPS; // passed, op has no kernel
+static const int KERNEL_LIST_FAILED = KERNEL_OPS + 1;
+static const int KERNEL_LISTS = KERNEL_OPS + 2;
+
+// appends records [begin, end) of a checked column to lists by where they
+// go next: list l is idx[l][0, counts[l]), with room for end records
+void kernels_compact(const char* op, const uint8_t* status, size_t begin,
+                     size_t end, unsigned* const* idx, size_t* counts);
+
+// calc::check() and kernels_compact() on records [begin, n), for the tail
+// of a vector CheckKernel
+void kernels_check_tail(const int* a, const int* b, const char* op,
+                        size_t begin, size_t n, uint8_t* status,
+                        unsigned* const* idx, size_t* counts);
+
+// mathlib::math_*, calc::compute() and overflow builtins one element at a
+// time; the reference every other set must agree with
+const KernelSet* kernels_scalar();
+
+// Each kernels_*.cpp is built with its own target flags. return: nullptr
+// when the instruction set was not compiled in; the CPU may still lack it
+const KernelSet* kernels_sse();
+const KernelSet* kernels_avx2();
+const KernelSet* kernels_avx512();
+const KernelSet* kernels_neon();
+
+// return: 0 - ok; 1 - unknown name; 2 - not compiled in or not supported
+// by this CPU
+int kernels_select(const char* name, const KernelSet** out);
+
+// widest set this build and this CPU both support
+const KernelSet* kernels_best();
@@ -0,0 +1,394 @@
+#include "kernels.h"
+
+#if defined(__AVX2__)
+
+#include "calculator.h"
+#include "mathlib.h"
+
+#include <immintrin.h>
+
+// status lanes: MATH_OK where mask is clear, err where it is set
+static __m256i status_from(__m256i mask, int err)
+{
+    return _mm256_blendv_epi8(_mm256_set1_epi32(mathlib::MATH_OK),
+                              _mm256_set1_epi32(err), mask);
+}
+
+static void avx2_add(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i r = _mm256_add_epi32(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __m256i ovf = _mm256_srai_epi32(
+            _mm256_and_si256(_mm256_xor_si256(va, r), _mm256_xor_si256(vb, r)),
+            31);
+
+        _mm256_storeu_si256((__m256i*)(result + i), r);
+        _mm256_storeu_si256((__m256i*)(status + i),
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_sub(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i r = _mm256_sub_epi32(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __m256i ovf = _mm256_srai_epi32(
+            _mm256_and_si256(_mm256_xor_si256(va, vb), _mm256_xor_si256(va, r)),
+            31);
+
+        _mm256_storeu_si256((__m256i*)(result + i), r);
+        _mm256_storeu_si256((__m256i*)(status + i),
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_mul(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i r = _mm256_mullo_epi32(va, vb);
+
+        // full 64-bit products of the even and the odd lanes
+        __m256i even = _mm256_mul_epi32(va, vb);
+        __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(va, 32),
+                                       _mm256_srli_epi64(vb, 32));
+
+        // high halves of all eight products, back in lane order
+        __m256i hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+
+        // fits in 32 bits iff the high half is the sign extension of r
+        __m256i ovf = _mm256_xor_si256(
+            _mm256_cmpeq_epi32(hi, _mm256_srai_epi32(r, 31)),
+            _mm256_set1_epi32(-1));
+
+        _mm256_storeu_si256((__m256i*)(result + i), r);
+        _mm256_storeu_si256((__m256i*)(status + i),
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+// quotient of four lanes; int32 / int32 is exact in double precision
+static __m128i div4(__m128i a, __m128i b)
+{
+    __m256d q = _mm256_div_pd(_mm256_cvtepi32_pd(a), _mm256_cvtepi32_pd(b));
+    return _mm256_cvttpd_epi32(q);
+}
+
+static void avx2_div(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+
+        __m256i zero = _mm256_cmpeq_epi32(vb, _mm256_setzero_si256());
+
+        // avoid the inexact/invalid FP paths for lanes that fail anyway
+        __m256i safe_b = _mm256_blendv_epi8(vb, _mm256_set1_epi32(1), zero);
+
+        __m256i r = _mm256_setr_m128i(
+            div4(_mm256_castsi256_si128(va), _mm256_castsi256_si128(safe_b)),
+            div4(_mm256_extracti128_si256(va, 1),
+                 _mm256_extracti128_si256(safe_b, 1)));
+
+        // INT_MIN / -1 is the only quotient that does not fit
+        __m256i ovf = _mm256_and_si256(
+            _mm256_cmpeq_epi32(va, _mm256_set1_epi32((int)0x80000000u)),
+            _mm256_cmpeq_epi32(vb, _mm256_set1_epi32(-1)));
+
+        __m256i st = status_from(ovf, mathlib::MATH_ERR_OVERFLOW);
+        st = _mm256_blendv_epi8(
+            st, _mm256_set1_epi32(mathlib::MATH_ERR_DIV_BY_ZERO), zero);
+
+        _mm256_storeu_si256((__m256i*)(result + i), r);
+        _mm256_storeu_si256((__m256i*)(status + i), st);
+    }
+
+    kernels_scalar()->div(a + i, b + i, result + i, status + i, n - i);
+}
+
+static __m256i op_is(__m256i op, char c)
+{
+    return _mm256_cmpeq_epi32(op, _mm256_set1_epi32((unsigned char)c));
+}
+
+static int lane_bits(__m256i mask)
+{
+    return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+}
+
+// for each 8-bit mask, the lanes whose bit is set in order, 4 bits a lane,
+// and how many there are; popcnt is not part of AVX2
+struct Avx2PackTable
+{
+    uint32_t v[256];
+    uint8_t n[256];
+};
+
+static constexpr Avx2PackTable make_pack_table()
+{
+    Avx2PackTable t = {};
+    for (int m = 0; m < 256; ++m) {
+        int k = 0;
+        for (int lane = 0; lane < 8; ++lane) {
+            if (m >> lane & 1) t.v[m] |= (uint32_t)lane << (4 * k++);
+        }
+        t.n[m] = (uint8_t)k;
+    }
+
+    return t;
+}
+
+static constexpr Avx2PackTable PACK = make_pack_table();
+
+// appends the lanes of v set in mask to list[*n]; all eight lanes are
+// stored, so list needs room for 8 from there
+static void pack8(__m256i v, int mask, unsigned* list, size_t* n)
+{
+    __m256i perm = _mm256_srlv_epi32(_mm256_set1_epi32((int)PACK.v[mask]),
+                                     _mm256_setr_epi32(0, 4, 8, 12, 16, 20,
+                                                       24, 28));
+
+    _mm256_storeu_si256((__m256i*)(void*)(list + *n),
+                        _mm256_permutevar8x32_epi32(v, perm));
+    *n += PACK.n[mask];
+}
+
+static void avx2_check(const int* a, const int* b, const char* op, size_t n,
+                       uint8_t* status, unsigned* const* idx, size_t* counts)
+{
+    size_t c[KERNEL_LISTS] = {};
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i vop = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)(const void*)(op + i)));
+
+        __m256i add = op_is(vop, '+');
+        __m256i sub = op_is(vop, '-');
+        __m256i mul = op_is(vop, 'x');
+        __m256i div = op_is(vop, '/');
+        __m256i pow = op_is(vop, '^');
+        __m256i fact = op_is(vop, '!');
+        __m256i known = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(add, sub),
+                            _mm256_or_si256(mul, div)),
+            _mm256_or_si256(pow, fact));
+
+        __m256i zero = _mm256_setzero_si256();
+        __m256i b_zero = _mm256_cmpeq_epi32(vb, zero);
+
+        // the ops exclude each other but for '!', where not being unary
+        // is reported first, so it is blended in last
+        __m256i st = _mm256_and_si256(
+            _mm256_and_si256(div, b_zero),
+            _mm256_set1_epi32(calc::STATUS_DIV_BY_ZERO));
+        st = _mm256_blendv_epi8(
+            st, _mm256_set1_epi32(calc::STATUS_NEGATIVE_EXP),
+            _mm256_and_si256(pow, _mm256_cmpgt_epi32(zero, vb)));
+        st = _mm256_blendv_epi8(
+            st, _mm256_set1_epi32(calc::STATUS_NEGATIVE_FACT),
+            _mm256_and_si256(fact, _mm256_cmpgt_epi32(zero, va)));
+        st = _mm256_blendv_epi8(st, _mm256_set1_epi32(calc::STATUS_NOT_UNARY),
+                                _mm256_andnot_si256(b_zero, fact));
+        st = _mm256_blendv_epi8(_mm256_set1_epi32(calc::STATUS_UNKNOWN_OP), st,
+                                known);
+
+        // the low byte of each lane: packing leaves lanes 0-3 in dword 0
+        // and lanes 4-7 in dword 4
+        __m256i p = _mm256_packus_epi16(_mm256_packs_epi32(st, st), zero);
+        p = _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0, 4, 0, 0, 0, 0,
+                                                             0, 0));
+        _mm_storel_epi64((__m128i*)(void*)(status + i),
+                         _mm256_castsi256_si128(p));
+
+        // c[l] <= i, so the eight lanes pack8() stores stay within n
+        int ok = lane_bits(_mm256_cmpeq_epi32(st, zero));
+        int lists[KERNEL_LISTS] = {
+            lane_bits(add) & ok, lane_bits(sub) & ok,
+            lane_bits(mul) & ok, lane_bits(div) & ok,
+            lane_bits(_mm256_or_si256(pow, fact)) & ok, ~ok & 0xff};
+
+        __m256i at = _mm256_add_epi32(lanes, _mm256_set1_epi32((int)i));
+        for (int l = 0; l < KERNEL_LISTS; ++l) {
+            pack8(at, lists[l], idx[l], &c[l]);
+        }
+    }
+
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = c[l];
+
+    kernels_check_tail(a, b, op, i, n, status, idx, counts);
+}
+
+// the four 64-bit lane masks as four 32-bit lanes
+static __m128i narrow4(__m256i mask)
+{
+    return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+        mask, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+}
+
+// stores four lanes of --real: err where fail is set, else STATUS_OVERFLOW
+// where r is not finite
+static void real_store(double* result, int* status, __m256d r, __m256d fail,
+                       int err)
+{
+    __m256d ovf = _mm256_cmp_pd(_mm256_andnot_pd(_mm256_set1_pd(-0.0), r),
+                                _mm256_set1_pd(__builtin_inf()), _CMP_NLT_UQ);
+
+    __m128i st = _mm_and_si128(narrow4(_mm256_castpd_si256(ovf)),
+                               _mm_set1_epi32(calc::STATUS_OVERFLOW));
+    st = _mm_blendv_epi8(st, _mm_set1_epi32(err),
+                         narrow4(_mm256_castpd_si256(fail)));
+
+    _mm256_storeu_pd(result, r);
+    _mm_storeu_si128((__m128i*)(void*)status, st);
+}
+
+static void avx2_real_add(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d r =
+            _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm256_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_real_sub(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d r =
+            _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm256_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_real_mul(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d r =
+            _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm256_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_real_div(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d vb = _mm256_loadu_pd(b + i);
+        __m256d r = _mm256_div_pd(_mm256_loadu_pd(a + i), vb);
+        real_store(result + i, status + i, r,
+                   _mm256_cmp_pd(vb, _mm256_setzero_pd(), _CMP_EQ_OQ),
+                   calc::STATUS_DIV_BY_ZERO);
+    }
+
+    kernels_scalar()->real_div(a + i, b + i, result + i, status + i, n - i);
+}
+
+// stores four lanes of --fixed: STATUS_OVERFLOW where the sign bit of ovf
+// is set, taken from the high half of each lane
+static void fixed_store(int64_t* result, int* status, __m256i r, __m256i ovf)
+{
+    __m128i st = _mm256_castsi256_si128(
+        _mm256_permutevar8x32_epi32(_mm256_srai_epi32(ovf, 31),
+                                    _mm256_setr_epi32(1, 3, 5, 7, 0, 0, 0, 0)));
+    st = _mm_and_si128(st, _mm_set1_epi32(calc::STATUS_OVERFLOW));
+
+    _mm256_storeu_si256((__m256i*)(void*)result, r);
+    _mm_storeu_si128((__m128i*)(void*)status, st);
+}
+
+static void avx2_fixed_add(const int64_t* a, const int64_t* b,
+                           int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(const void*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(const void*)(b + i));
+        __m256i r = _mm256_add_epi64(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __m256i ovf =
+            _mm256_and_si256(_mm256_xor_si256(va, r), _mm256_xor_si256(vb, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx2_fixed_sub(const int64_t* a, const int64_t* b,
+                           int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(const void*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(const void*)(b + i));
+        __m256i r = _mm256_sub_epi64(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __m256i ovf =
+            _mm256_and_si256(_mm256_xor_si256(va, vb), _mm256_xor_si256(va, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static const KernelSet avx2_set = {
+    "avx2",        avx2_add,      avx2_sub,       avx2_mul,
+    avx2_div,      avx2_check,    avx2_real_add,  avx2_real_sub,
+    avx2_real_mul, avx2_real_div, avx2_fixed_add, avx2_fixed_sub};
+
+const KernelSet* kernels_avx2()
+{
+    return &avx2_set;
+}
+
+#else
+
+const KernelSet* kernels_avx2()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#include "kernels.h"
+
+#if defined(__AVX512F__)
+
+#include "calculator.h"
+#include "mathlib.h"
+
+#include <immintrin.h>
+
+// every lane; the maskz forms of the intrinsics below start from a zero
+// vector, where GCC 12 builds the plain ones on _mm512_undefined_*() and
+// reports them under -Wmaybe-uninitialized
+static const __mmask8 ALL8 = 0xff;
+static const __mmask16 ALL16 = 0xffff;
+
+// status lanes: MATH_OK where the mask bit is clear, err where it is set
+static __m512i status_from(__mmask16 mask, int err)
+{
+    return _mm512_mask_blend_epi32(mask, _mm512_set1_epi32(mathlib::MATH_OK),
+                                   _mm512_set1_epi32(err));
+}
+
+static __mmask16 sign_mask(__m512i v)
+{
+    return _mm512_cmplt_epi32_mask(v, _mm512_setzero_si512());
+}
+
+static void avx512_add(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = _mm512_add_epi32(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __mmask16 ovf = sign_mask(
+            _mm512_and_si512(_mm512_xor_si512(va, r), _mm512_xor_si512(vb, r)));
+
+        _mm512_storeu_si512(result + i, r);
+        _mm512_storeu_si512(status + i,
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_sub(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = _mm512_sub_epi32(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __mmask16 ovf = sign_mask(
+            _mm512_and_si512(_mm512_xor_si512(va, vb), _mm512_xor_si512(va, r)));
+
+        _mm512_storeu_si512(result + i, r);
+        _mm512_storeu_si512(status + i,
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_mul(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = _mm512_mullo_epi32(va, vb);
+
+        // full 64-bit products of the even and the odd lanes
+        __m512i even = _mm512_maskz_mul_epi32(ALL8, va, vb);
+        __m512i odd = _mm512_maskz_mul_epi32(
+            ALL8, _mm512_maskz_srli_epi64(ALL8, va, 32),
+            _mm512_maskz_srli_epi64(ALL8, vb, 32));
+
+        // high halves of all sixteen products, back in lane order
+        __m512i hi = _mm512_mask_blend_epi32(
+            (__mmask16)0xaaaa, _mm512_maskz_srli_epi64(ALL8, even, 32), odd);
+
+        // fits in 32 bits iff the high half is the sign extension of r
+        __mmask16 ovf =
+            _mm512_cmpneq_epi32_mask(hi, _mm512_maskz_srai_epi32(ALL16, r, 31));
+
+        _mm512_storeu_si512(result + i, r);
+        _mm512_storeu_si512(status + i,
+                            status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+// quotient of eight lanes; int32 / int32 is exact in double precision
+static __m256i div8(__m256i a, __m256i b)
+{
+    __m512d q = _mm512_div_pd(_mm512_maskz_cvtepi32_pd(ALL8, a),
+                              _mm512_maskz_cvtepi32_pd(ALL8, b));
+    return _mm512_maskz_cvttpd_epi32(ALL8, q);
+}
+
+static void avx512_div(const int* a, const int* b, int* result, int* status,
+                       size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+
+        __mmask16 zero = _mm512_cmpeq_epi32_mask(vb, _mm512_setzero_si512());
+
+        // avoid the invalid FP paths for lanes that fail anyway
+        __m512i safe_b = _mm512_mask_blend_epi32(zero, vb,
+                                                 _mm512_set1_epi32(1));
+
+        __m512i r = _mm512_maskz_inserti64x4(
+            ALL8,
+            _mm512_castsi256_si512(
+                div8(_mm512_maskz_extracti64x4_epi64(ALL8, va, 0),
+                     _mm512_maskz_extracti64x4_epi64(ALL8, safe_b, 0))),
+            div8(_mm512_maskz_extracti64x4_epi64(ALL8, va, 1),
+                 _mm512_maskz_extracti64x4_epi64(ALL8, safe_b, 1)),
+            1);
+
+        // INT_MIN / -1 is the only quotient that does not fit
+        __mmask16 ovf =
+            _mm512_cmpeq_epi32_mask(va, _mm512_set1_epi32((int)0x80000000u)) &
+            _mm512_cmpeq_epi32_mask(vb, _mm512_set1_epi32(-1));
+
+        __m512i st = status_from(ovf, mathlib::MATH_ERR_OVERFLOW);
+        st = _mm512_mask_blend_epi32(
+            zero, st, _mm512_set1_epi32(mathlib::MATH_ERR_DIV_BY_ZERO));
+
+        _mm512_storeu_si512(result + i, r);
+        _mm512_storeu_si512(status + i, st);
+    }
+
+    kernels_scalar()->div(a + i, b + i, result + i, status + i, n - i);
+}
+
+static __mmask16 op_is(__m512i op, char c)
+{
+    return _mm512_cmpeq_epi32_mask(op, _mm512_set1_epi32((unsigned char)c));
+}
+
+static void avx512_check(const int* a, const int* b, const char* op,
+                         size_t n, uint8_t* status, unsigned* const* idx,
+                         size_t* counts)
+{
+    size_t c[KERNEL_LISTS] = {};
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                            11, 12, 13, 14, 15);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i vop = _mm512_maskz_cvtepu8_epi32(
+            ALL16, _mm_loadu_si128((const __m128i*)(const void*)(op + i)));
+
+        __mmask16 add = op_is(vop, '+');
+        __mmask16 sub = op_is(vop, '-');
+        __mmask16 mul = op_is(vop, 'x');
+        __mmask16 div = op_is(vop, '/');
+        __mmask16 pow = op_is(vop, '^');
+        __mmask16 fact = op_is(vop, '!');
+        __mmask16 known = add | sub | mul | div | pow | fact;
+
+        __mmask16 b_zero =
+            _mm512_cmpeq_epi32_mask(vb, _mm512_setzero_si512());
+
+        // the ops exclude each other but for '!', where not being unary
+        // is reported first, so it is set last
+        __m512i st = _mm512_maskz_mov_epi32(
+            div & b_zero, _mm512_set1_epi32(calc::STATUS_DIV_BY_ZERO));
+        st = _mm512_mask_mov_epi32(
+            st, pow & sign_mask(vb),
+            _mm512_set1_epi32(calc::STATUS_NEGATIVE_EXP));
+        st = _mm512_mask_mov_epi32(
+            st, fact & sign_mask(va),
+            _mm512_set1_epi32(calc::STATUS_NEGATIVE_FACT));
+        st = _mm512_mask_mov_epi32(st, fact & (__mmask16)~b_zero,
+                                   _mm512_set1_epi32(calc::STATUS_NOT_UNARY));
+        st = _mm512_mask_mov_epi32(st, (__mmask16)~known,
+                                   _mm512_set1_epi32(calc::STATUS_UNKNOWN_OP));
+
+        _mm_storeu_si128((__m128i*)(void*)(status + i),
+                         _mm512_maskz_cvtepi32_epi8(ALL16, st));
+
+        // each list gets its lanes' indices packed to the front
+        __mmask16 ok = _mm512_cmpeq_epi32_mask(st, _mm512_setzero_si512());
+        __mmask16 lists[KERNEL_LISTS] = {
+            (__mmask16)(add & ok), (__mmask16)(sub & ok),
+            (__mmask16)(mul & ok), (__mmask16)(div & ok),
+            (__mmask16)((pow | fact) & ok), (__mmask16)~ok};
+
+        __m512i at = _mm512_add_epi32(lanes, _mm512_set1_epi32((int)i));
+        for (int l = 0; l < KERNEL_LISTS; ++l) {
+            _mm512_mask_compressstoreu_epi32(idx[l] + c[l], lists[l], at);
+            c[l] += (size_t)__builtin_popcount(lists[l]);
+        }
+    }
+
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = c[l];
+
+    kernels_check_tail(a, b, op, i, n, status, idx, counts);
+}
+
+// stores eight lanes of --real: err where fail is set, else
+// STATUS_OVERFLOW where r is not finite
+static void real_store(double* result, int* status, __m512d r, __mmask8 fail,
+                       int err)
+{
+    __mmask8 ovf = _mm512_cmp_pd_mask(_mm512_abs_pd(r),
+                                      _mm512_set1_pd(__builtin_inf()),
+                                      _CMP_NLT_UQ);
+
+    __m512i st = _mm512_maskz_set1_epi64(ovf, calc::STATUS_OVERFLOW);
+    st = _mm512_mask_set1_epi64(st, fail, err);
+
+    _mm512_storeu_pd(result, r);
+    _mm256_storeu_si256((__m256i*)(void*)status,
+                        _mm512_maskz_cvtepi64_epi32(ALL8, st));
+}
+
+static void avx512_real_add(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d r =
+            _mm512_add_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        real_store(result + i, status + i, r, 0, 0);
+    }
+
+    kernels_scalar()->real_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_real_sub(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d r =
+            _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        real_store(result + i, status + i, r, 0, 0);
+    }
+
+    kernels_scalar()->real_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_real_mul(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d r =
+            _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        real_store(result + i, status + i, r, 0, 0);
+    }
+
+    kernels_scalar()->real_mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_real_div(const double* a, const double* b, double* result,
+                            int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d vb = _mm512_loadu_pd(b + i);
+        __m512d r = _mm512_div_pd(_mm512_loadu_pd(a + i), vb);
+        real_store(result + i, status + i, r,
+                   _mm512_cmp_pd_mask(vb, _mm512_setzero_pd(), _CMP_EQ_OQ),
+                   calc::STATUS_DIV_BY_ZERO);
+    }
+
+    kernels_scalar()->real_div(a + i, b + i, result + i, status + i, n - i);
+}
+
+// stores eight lanes of --fixed: STATUS_OVERFLOW where ovf is negative
+static void fixed_store(int64_t* result, int* status, __m512i r, __m512i ovf)
+{
+    __mmask8 neg = _mm512_cmplt_epi64_mask(ovf, _mm512_setzero_si512());
+
+    _mm512_storeu_si512(result, r);
+    _mm256_storeu_si256(
+        (__m256i*)(void*)status,
+        _mm512_maskz_cvtepi64_epi32(
+            ALL8, _mm512_maskz_set1_epi64(neg, calc::STATUS_OVERFLOW)));
+}
+
+static void avx512_fixed_add(const int64_t* a, const int64_t* b,
+                             int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = _mm512_add_epi64(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __m512i ovf =
+            _mm512_and_si512(_mm512_xor_si512(va, r), _mm512_xor_si512(vb, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void avx512_fixed_sub(const int64_t* a, const int64_t* b,
+                             int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = _mm512_sub_epi64(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __m512i ovf =
+            _mm512_and_si512(_mm512_xor_si512(va, vb), _mm512_xor_si512(va, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static const KernelSet avx512_set = {
+    "avx512",        avx512_add,       avx512_sub,
+    avx512_mul,      avx512_div,       avx512_check,
+    avx512_real_add, avx512_real_sub,  avx512_real_mul,
+    avx512_real_div, avx512_fixed_add, avx512_fixed_sub};
+
+const KernelSet* kernels_avx512()
+{
+    return &avx512_set;
+}
+
+#else
+
+const KernelSet* kernels_avx512()
+{
+    return nullptr;
+}
+
+#endif
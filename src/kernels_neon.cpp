@@ -0,0 +1,310 @@
+#include "kernels.h"
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+
+#include "calculator.h"
+#include "mathlib.h"
+
+#include <arm_neon.h>
+#include <cstdint>
+
+// status lanes: MATH_OK where mask is clear, err where it is set
+static int32x4_t status_from(uint32x4_t mask, int err)
+{
+    return vbslq_s32(mask, vdupq_n_s32(err), vdupq_n_s32(mathlib::MATH_OK));
+}
+
+static uint32x4_t sign_mask(int32x4_t v)
+{
+    return vcltzq_s32(v);
+}
+
+static void neon_add(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t va = vld1q_s32(a + i);
+        int32x4_t vb = vld1q_s32(b + i);
+        int32x4_t r = vaddq_s32(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        uint32x4_t ovf = sign_mask(vandq_s32(veorq_s32(va, r), veorq_s32(vb, r)));
+
+        vst1q_s32(result + i, r);
+        vst1q_s32(status + i, status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_sub(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t va = vld1q_s32(a + i);
+        int32x4_t vb = vld1q_s32(b + i);
+        int32x4_t r = vsubq_s32(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        uint32x4_t ovf =
+            sign_mask(vandq_s32(veorq_s32(va, vb), veorq_s32(va, r)));
+
+        vst1q_s32(result + i, r);
+        vst1q_s32(status + i, status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_mul(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t va = vld1q_s32(a + i);
+        int32x4_t vb = vld1q_s32(b + i);
+
+        int64x2_t lo = vmull_s32(vget_low_s32(va), vget_low_s32(vb));
+        int64x2_t hi = vmull_high_s32(va, vb);
+
+        int32x4_t r = vcombine_s32(vmovn_s64(lo), vmovn_s64(hi));
+
+        // the saturating narrow only differs from the plain one on overflow
+        int32x4_t sat = vcombine_s32(vqmovn_s64(lo), vqmovn_s64(hi));
+        uint32x4_t ovf = vmvnq_u32(vceqq_s32(r, sat));
+
+        vst1q_s32(result + i, r);
+        vst1q_s32(status + i, status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+// quotient of two lanes; int32 / int32 is exact in double precision
+static int32x2_t div2(int32x2_t a, int32x2_t b)
+{
+    float64x2_t q = vdivq_f64(vcvtq_f64_s64(vmovl_s32(a)),
+                              vcvtq_f64_s64(vmovl_s32(b)));
+    return vmovn_s64(vcvtq_s64_f64(q));
+}
+
+static void neon_div(const int* a, const int* b, int* result, int* status,
+                     size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t va = vld1q_s32(a + i);
+        int32x4_t vb = vld1q_s32(b + i);
+
+        uint32x4_t zero = vceqzq_s32(vb);
+
+        // avoid the invalid FP paths for lanes that fail anyway
+        int32x4_t safe_b = vbslq_s32(zero, vdupq_n_s32(1), vb);
+
+        int32x4_t r =
+            vcombine_s32(div2(vget_low_s32(va), vget_low_s32(safe_b)),
+                         div2(vget_high_s32(va), vget_high_s32(safe_b)));
+
+        // INT_MIN / -1 is the only quotient that does not fit
+        uint32x4_t ovf = vandq_u32(vceqq_s32(va, vdupq_n_s32(INT32_MIN)),
+                                   vceqq_s32(vb, vdupq_n_s32(-1)));
+
+        int32x4_t st = status_from(ovf, mathlib::MATH_ERR_OVERFLOW);
+        st = vbslq_s32(zero, vdupq_n_s32(mathlib::MATH_ERR_DIV_BY_ZERO), st);
+
+        vst1q_s32(result + i, r);
+        vst1q_s32(status + i, st);
+    }
+
+    kernels_scalar()->div(a + i, b + i, result + i, status + i, n - i);
+}
+
+static uint32x4_t op_is(uint32x4_t op, char c)
+{
+    return vceqq_u32(op, vdupq_n_u32((unsigned char)c));
+}
+
+// statuses of four lanes, as check() would give them
+static uint32x4_t neon_check4(int32x4_t va, int32x4_t vb, uint32x4_t vop)
+{
+    uint32x4_t div = op_is(vop, '/');
+    uint32x4_t pow = op_is(vop, '^');
+    uint32x4_t fact = op_is(vop, '!');
+    uint32x4_t known =
+        vorrq_u32(vorrq_u32(vorrq_u32(op_is(vop, '+'), op_is(vop, '-')),
+                            vorrq_u32(op_is(vop, 'x'), div)),
+                  vorrq_u32(pow, fact));
+
+    uint32x4_t b_zero = vceqzq_s32(vb);
+
+    // the ops exclude each other but for '!', where not being unary is
+    // reported first, so it is selected last
+    uint32x4_t st = vandq_u32(vandq_u32(div, b_zero),
+                              vdupq_n_u32(calc::STATUS_DIV_BY_ZERO));
+    st = vbslq_u32(vandq_u32(pow, sign_mask(vb)),
+                   vdupq_n_u32(calc::STATUS_NEGATIVE_EXP), st);
+    st = vbslq_u32(vandq_u32(fact, sign_mask(va)),
+                   vdupq_n_u32(calc::STATUS_NEGATIVE_FACT), st);
+    st = vbslq_u32(vbicq_u32(fact, b_zero),
+                   vdupq_n_u32(calc::STATUS_NOT_UNARY), st);
+
+    return vbslq_u32(known, st, vdupq_n_u32(calc::STATUS_UNKNOWN_OP));
+}
+
+// statuses by vector; the split is scalar, NEON having no compress
+static void neon_check(const int* a, const int* b, const char* op, size_t n,
+                       uint8_t* status, unsigned* const* idx, size_t* counts)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t vop = vmovl_u8(vld1_u8((const uint8_t*)op + i));
+
+        uint32x4_t lo = neon_check4(vld1q_s32(a + i), vld1q_s32(b + i),
+                                    vmovl_u16(vget_low_u16(vop)));
+        uint32x4_t hi = neon_check4(vld1q_s32(a + i + 4), vld1q_s32(b + i + 4),
+                                    vmovl_u16(vget_high_u16(vop)));
+
+        vst1_u8(status + i,
+                vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi))));
+    }
+
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = 0;
+    kernels_compact(op, status, 0, i, idx, counts);
+
+    kernels_check_tail(a, b, op, i, n, status, idx, counts);
+}
+
+// stores two lanes of --real: err where fail is set, else STATUS_OVERFLOW
+// where r is not finite
+static void real_store(double* result, int* status, float64x2_t r,
+                       uint64x2_t fail, int err)
+{
+    // not below infinity: infinite or NaN
+    uint64x2_t ovf = vreinterpretq_u64_u32(vmvnq_u32(vreinterpretq_u32_u64(
+        vcltq_f64(vabsq_f64(r), vdupq_n_f64(__builtin_inf())))));
+
+    int32x2_t st = vand_s32(vreinterpret_s32_u32(vmovn_u64(ovf)),
+                            vdup_n_s32(calc::STATUS_OVERFLOW));
+    st = vbsl_s32(vmovn_u64(fail), vdup_n_s32(err), st);
+
+    vst1q_f64(result, r);
+    vst1_s32(status, st);
+}
+
+static void neon_real_add(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t r = vaddq_f64(vld1q_f64(a + i), vld1q_f64(b + i));
+        real_store(result + i, status + i, r, vdupq_n_u64(0), 0);
+    }
+
+    kernels_scalar()->real_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_real_sub(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t r = vsubq_f64(vld1q_f64(a + i), vld1q_f64(b + i));
+        real_store(result + i, status + i, r, vdupq_n_u64(0), 0);
+    }
+
+    kernels_scalar()->real_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_real_mul(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t r = vmulq_f64(vld1q_f64(a + i), vld1q_f64(b + i));
+        real_store(result + i, status + i, r, vdupq_n_u64(0), 0);
+    }
+
+    kernels_scalar()->real_mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_real_div(const double* a, const double* b, double* result,
+                          int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t vb = vld1q_f64(b + i);
+        float64x2_t r = vdivq_f64(vld1q_f64(a + i), vb);
+        real_store(result + i, status + i, r, vceqzq_f64(vb),
+                   calc::STATUS_DIV_BY_ZERO);
+    }
+
+    kernels_scalar()->real_div(a + i, b + i, result + i, status + i, n - i);
+}
+
+// stores two lanes of --fixed: STATUS_OVERFLOW where ovf is negative
+static void fixed_store(int64_t* result, int* status, int64x2_t r,
+                        int64x2_t ovf)
+{
+    int32x2_t st = vand_s32(vreinterpret_s32_u32(vmovn_u64(vcltzq_s64(ovf))),
+                            vdup_n_s32(calc::STATUS_OVERFLOW));
+
+    vst1q_s64(result, r);
+    vst1_s32(status, st);
+}
+
+static void neon_fixed_add(const int64_t* a, const int64_t* b,
+                           int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        int64x2_t va = vld1q_s64(a + i);
+        int64x2_t vb = vld1q_s64(b + i);
+        int64x2_t r = vaddq_s64(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        int64x2_t ovf = vandq_s64(veorq_s64(va, r), veorq_s64(vb, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void neon_fixed_sub(const int64_t* a, const int64_t* b,
+                           int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        int64x2_t va = vld1q_s64(a + i);
+        int64x2_t vb = vld1q_s64(b + i);
+        int64x2_t r = vsubq_s64(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        int64x2_t ovf = vandq_s64(veorq_s64(va, vb), veorq_s64(va, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static const KernelSet neon_set = {
+    "neon",        neon_add,      neon_sub,       neon_mul,
+    neon_div,      neon_check,    neon_real_add,  neon_real_sub,
+    neon_real_mul, neon_real_div, neon_fixed_add, neon_fixed_sub};
+
+const KernelSet* kernels_neon()
+{
+    return &neon_set;
+}
+
+#else
+
+const KernelSet* kernels_neon()
+{
+    return nullptr;
+}
+
+#endif
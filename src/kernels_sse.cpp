@@ -0,0 +1,383 @@
+#include "kernels.h"
+
+#if defined(__SSE4_1__)
+
+#include "calculator.h"
+#include "mathlib.h"
+
+#include <cstring>
+#include <immintrin.h>
+
+// status lanes: MATH_OK where mask is clear, err where it is set
+static __m128i status_from(__m128i mask, int err)
+{
+    return _mm_blendv_epi8(_mm_set1_epi32(mathlib::MATH_OK),
+                           _mm_set1_epi32(err), mask);
+}
+
+static void sse_add(const int* a, const int* b, int* result, int* status,
+                    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i r = _mm_add_epi32(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __m128i ovf = _mm_srai_epi32(
+            _mm_and_si128(_mm_xor_si128(va, r), _mm_xor_si128(vb, r)), 31);
+
+        _mm_storeu_si128((__m128i*)(result + i), r);
+        _mm_storeu_si128((__m128i*)(status + i),
+                         status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_sub(const int* a, const int* b, int* result, int* status,
+                    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i r = _mm_sub_epi32(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __m128i ovf = _mm_srai_epi32(
+            _mm_and_si128(_mm_xor_si128(va, vb), _mm_xor_si128(va, r)), 31);
+
+        _mm_storeu_si128((__m128i*)(result + i), r);
+        _mm_storeu_si128((__m128i*)(status + i),
+                         status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_mul(const int* a, const int* b, int* result, int* status,
+                    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i r = _mm_mullo_epi32(va, vb);
+
+        // full 64-bit products of the even and the odd lanes
+        __m128i even = _mm_mul_epi32(va, vb);
+        __m128i odd =
+            _mm_mul_epi32(_mm_srli_epi64(va, 32), _mm_srli_epi64(vb, 32));
+
+        // high halves of all four products, back in lane order
+        __m128i hi = _mm_blend_epi16(_mm_srli_epi64(even, 32), odd, 0xcc);
+
+        // fits in 32 bits iff the high half is the sign extension of r
+        __m128i ovf = _mm_xor_si128(_mm_cmpeq_epi32(hi, _mm_srai_epi32(r, 31)),
+                                    _mm_set1_epi32(-1));
+
+        _mm_storeu_si128((__m128i*)(result + i), r);
+        _mm_storeu_si128((__m128i*)(status + i),
+                         status_from(ovf, mathlib::MATH_ERR_OVERFLOW));
+    }
+
+    kernels_scalar()->mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+// quotient of the two low lanes; int32 / int32 is exact in double precision
+static __m128i div2(__m128i a, __m128i b)
+{
+    __m128d q = _mm_div_pd(_mm_cvtepi32_pd(a), _mm_cvtepi32_pd(b));
+    return _mm_cvttpd_epi32(q);
+}
+
+static void sse_div(const int* a, const int* b, int* result, int* status,
+                    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+        __m128i zero = _mm_cmpeq_epi32(vb, _mm_setzero_si128());
+
+        // avoid the invalid FP paths for lanes that fail anyway
+        __m128i safe_b = _mm_blendv_epi8(vb, _mm_set1_epi32(1), zero);
+
+        __m128i r = _mm_unpacklo_epi64(
+            div2(va, safe_b),
+            div2(_mm_unpackhi_epi64(va, va), _mm_unpackhi_epi64(safe_b, safe_b)));
+
+        // INT_MIN / -1 is the only quotient that does not fit
+        __m128i ovf = _mm_and_si128(
+            _mm_cmpeq_epi32(va, _mm_set1_epi32((int)0x80000000u)),
+            _mm_cmpeq_epi32(vb, _mm_set1_epi32(-1)));
+
+        __m128i st = status_from(ovf, mathlib::MATH_ERR_OVERFLOW);
+        st = _mm_blendv_epi8(st, _mm_set1_epi32(mathlib::MATH_ERR_DIV_BY_ZERO),
+                             zero);
+
+        _mm_storeu_si128((__m128i*)(result + i), r);
+        _mm_storeu_si128((__m128i*)(status + i), st);
+    }
+
+    kernels_scalar()->div(a + i, b + i, result + i, status + i, n - i);
+}
+
+static __m128i op_is(__m128i op, char c)
+{
+    return _mm_cmpeq_epi32(op, _mm_set1_epi32((unsigned char)c));
+}
+
+static int lane_bits(__m128i mask)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(mask));
+}
+
+// for each 4-bit mask, a byte shuffle that moves the lanes whose bit is
+// set to the front, in order, and how many there are; popcnt is not part
+// of SSE4.1
+struct SsePackTable
+{
+    uint8_t v[16][16];
+    uint8_t n[16];
+};
+
+static constexpr SsePackTable make_pack_table()
+{
+    SsePackTable t = {};
+    for (int m = 0; m < 16; ++m) {
+        int k = 0;
+        for (int lane = 0; lane < 4; ++lane) {
+            if (!(m >> lane & 1)) continue;
+            for (int j = 0; j < 4; ++j) {
+                t.v[m][4 * k + j] = (uint8_t)(4 * lane + j);
+            }
+            k++;
+        }
+        t.n[m] = (uint8_t)k;
+    }
+
+    return t;
+}
+
+static constexpr SsePackTable PACK = make_pack_table();
+
+// appends the lanes of v set in mask to list[*n]; all four lanes are
+// stored, so list needs room for 4 from there
+static void pack4(__m128i v, int mask, unsigned* list, size_t* n)
+{
+    __m128i shuf = _mm_loadu_si128((const __m128i*)(const void*)PACK.v[mask]);
+
+    _mm_storeu_si128((__m128i*)(void*)(list + *n), _mm_shuffle_epi8(v, shuf));
+    *n += PACK.n[mask];
+}
+
+static void sse_check(const int* a, const int* b, const char* op, size_t n,
+                      uint8_t* status, unsigned* const* idx, size_t* counts)
+{
+    size_t c[KERNEL_LISTS] = {};
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+        int ops;
+        memcpy(&ops, op + i, sizeof(ops));
+        __m128i vop = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(ops));
+
+        __m128i add = op_is(vop, '+');
+        __m128i sub = op_is(vop, '-');
+        __m128i mul = op_is(vop, 'x');
+        __m128i div = op_is(vop, '/');
+        __m128i pow = op_is(vop, '^');
+        __m128i fact = op_is(vop, '!');
+        __m128i known = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(add, sub), _mm_or_si128(mul, div)),
+            _mm_or_si128(pow, fact));
+
+        __m128i zero = _mm_setzero_si128();
+        __m128i b_zero = _mm_cmpeq_epi32(vb, zero);
+
+        // the ops exclude each other but for '!', where not being unary
+        // is reported first, so it is blended in last
+        __m128i st = _mm_and_si128(_mm_and_si128(div, b_zero),
+                                   _mm_set1_epi32(calc::STATUS_DIV_BY_ZERO));
+        st = _mm_blendv_epi8(st, _mm_set1_epi32(calc::STATUS_NEGATIVE_EXP),
+                             _mm_and_si128(pow, _mm_cmplt_epi32(vb, zero)));
+        st = _mm_blendv_epi8(st, _mm_set1_epi32(calc::STATUS_NEGATIVE_FACT),
+                             _mm_and_si128(fact, _mm_cmplt_epi32(va, zero)));
+        st = _mm_blendv_epi8(st, _mm_set1_epi32(calc::STATUS_NOT_UNARY),
+                             _mm_andnot_si128(b_zero, fact));
+        st = _mm_blendv_epi8(_mm_set1_epi32(calc::STATUS_UNKNOWN_OP), st,
+                             known);
+
+        // the low byte of each lane
+        int bytes = _mm_cvtsi128_si32(
+            _mm_packus_epi16(_mm_packs_epi32(st, st), zero));
+        memcpy(status + i, &bytes, sizeof(bytes));
+
+        // c[l] <= i, so the four lanes pack4() stores stay within n
+        int ok = lane_bits(_mm_cmpeq_epi32(st, zero));
+        int lists[KERNEL_LISTS] = {
+            lane_bits(add) & ok, lane_bits(sub) & ok,
+            lane_bits(mul) & ok, lane_bits(div) & ok,
+            lane_bits(_mm_or_si128(pow, fact)) & ok, ~ok & 0xf};
+
+        __m128i at = _mm_add_epi32(lanes, _mm_set1_epi32((int)i));
+        for (int l = 0; l < KERNEL_LISTS; ++l) {
+            pack4(at, lists[l], idx[l], &c[l]);
+        }
+    }
+
+    for (int l = 0; l < KERNEL_LISTS; ++l) counts[l] = c[l];
+
+    kernels_check_tail(a, b, op, i, n, status, idx, counts);
+}
+
+// the two 64-bit lane masks as the two low 32-bit lanes
+static __m128i narrow2(__m128i mask)
+{
+    return _mm_shuffle_epi32(mask, _MM_SHUFFLE(3, 3, 2, 0));
+}
+
+// stores two lanes of --real: err where fail is set, else STATUS_OVERFLOW
+// where r is not finite
+static void real_store(double* result, int* status, __m128d r, __m128d fail,
+                       int err)
+{
+    __m128d ovf = _mm_cmpnlt_pd(_mm_andnot_pd(_mm_set1_pd(-0.0), r),
+                                _mm_set1_pd(__builtin_inf()));
+
+    __m128i st = _mm_and_si128(narrow2(_mm_castpd_si128(ovf)),
+                               _mm_set1_epi32(calc::STATUS_OVERFLOW));
+    st = _mm_blendv_epi8(st, _mm_set1_epi32(err),
+                         narrow2(_mm_castpd_si128(fail)));
+
+    _mm_storeu_pd(result, r);
+    _mm_storel_epi64((__m128i*)(void*)status, st);
+}
+
+static void sse_real_add(const double* a, const double* b, double* result,
+                         int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d r = _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_real_sub(const double* a, const double* b, double* result,
+                         int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d r = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_real_mul(const double* a, const double* b, double* result,
+                         int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d r = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        real_store(result + i, status + i, r, _mm_setzero_pd(), 0);
+    }
+
+    kernels_scalar()->real_mul(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_real_div(const double* a, const double* b, double* result,
+                         int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d vb = _mm_loadu_pd(b + i);
+        __m128d r = _mm_div_pd(_mm_loadu_pd(a + i), vb);
+        real_store(result + i, status + i, r,
+                   _mm_cmpeq_pd(vb, _mm_setzero_pd()),
+                   calc::STATUS_DIV_BY_ZERO);
+    }
+
+    kernels_scalar()->real_div(a + i, b + i, result + i, status + i, n - i);
+}
+
+// stores two lanes of --fixed: STATUS_OVERFLOW where the sign bit of ovf
+// is set; SSE4.1 has no 64-bit shift right arithmetic, so the sign is
+// taken from the high half of each lane
+static void fixed_store(int64_t* result, int* status, __m128i r, __m128i ovf)
+{
+    __m128i st = _mm_shuffle_epi32(_mm_srai_epi32(ovf, 31),
+                                   _MM_SHUFFLE(3, 3, 3, 1));
+    st = _mm_and_si128(st, _mm_set1_epi32(calc::STATUS_OVERFLOW));
+
+    _mm_storeu_si128((__m128i*)(void*)result, r);
+    _mm_storel_epi64((__m128i*)(void*)status, st);
+}
+
+static void sse_fixed_add(const int64_t* a, const int64_t* b,
+                          int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(const void*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(const void*)(b + i));
+        __m128i r = _mm_add_epi64(va, vb);
+
+        // overflow iff both operands differ in sign from the result
+        __m128i ovf = _mm_and_si128(_mm_xor_si128(va, r), _mm_xor_si128(vb, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_add(a + i, b + i, result + i, status + i, n - i);
+}
+
+static void sse_fixed_sub(const int64_t* a, const int64_t* b,
+                          int64_t* result, int* status, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(const void*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(const void*)(b + i));
+        __m128i r = _mm_sub_epi64(va, vb);
+
+        // overflow iff the operands differ in sign and a differs from r
+        __m128i ovf =
+            _mm_and_si128(_mm_xor_si128(va, vb), _mm_xor_si128(va, r));
+
+        fixed_store(result + i, status + i, r, ovf);
+    }
+
+    kernels_scalar()->fixed_sub(a + i, b + i, result + i, status + i, n - i);
+}
+
+static const KernelSet sse_set = {
+    "sse",        sse_add,      sse_sub,       sse_mul,
+    sse_div,      sse_check,    sse_real_add,  sse_real_sub,
+    sse_real_mul, sse_real_div, sse_fixed_add, sse_fixed_sub};
+
+const KernelSet* kernels_sse()
+{
+    return &sse_set;
+}
+
+#else
+
+const KernelSet* kernels_sse()
+{
+    return nullptr;
+}
+
+#endif
@@ -1,25 +1,469 @@
-#include "mathlib.h"
+#include "arena.h"
+#include "bigint.h"
+#include "calculator.h"
+#include "kernels.h"
+#include "memo.h"
+#include "metrics.h"
+#include "ring.h"
+#include "stats.h"
 
 #include <cerrno>
-#include <climits>
+#include <charconv>
+#include <chrono>
+#include <csignal>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <getopt.h>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
 
-struct CalcData
+using calc::CalcData;
+using calc::Token;
+
+// tokens an RPN expression may have, on the command line or a batch line
+static const int RPN_TOKENS_MAX = 256;
+
+// --block-size and --queue defaults
+static const int BLOCK_SIZE = 256 << 10;
+static const int QUEUE_DEPTH = 4;
+
+enum { FORMAT_TEXT, FORMAT_BIN };
+
+struct Program;
+
+struct Options
+{
+    int help;
+    int batch;
+    const char* input;
+    const char* output;
+    int format;
+    const KernelSet* kernels;
+    int threads;
+    int block; // --block-size: input bytes a thread takes at a time
+    int queue; // --queue: blocks in flight per thread on unmappable input
+    const char* serve;
+    const char* metrics; // --metrics ADDR of --serve
+    int width; // integer bits: 32, 64 or 128
+    int real; // --real: double arithmetic
+    int fixed; // --fixed places of int64_t values, -1 - off
+    int bigint;
+    int cache; // memo slots, 0 - off
+    int group; // --group-ops
+    const char* program; // --program source
+    const Program* compiled; // set by run() once the width is known
+    int stats; // --stats
+    char** operands;
+    int operand_count;
+};
+
+// OUT_FD: buffered writer over an fd; OUT_MAP: mmap'd --output FILE, grown
+// by remapping when full; OUT_MEM: buffer from out_pool, grown by moving to
+// one of the next class
+enum { OUT_FD, OUT_MAP, OUT_MEM };
+
+struct Output
 {
-    int a;
-    int b;
-    char op;
-    int result;
+    int fd;
+    char* base;
+    size_t len;
+    size_t cap;
+    int kind;
+    int failed;
 };
 
+static const size_t OUT_BUFFER_SIZE = 1 << 20;
+
+// longest put_real() output: "-2.2250738585072014e-308"
+static const size_t REAL_MAX_LEN = 24;
+
+// longest print_result() line for T: "MIN x MIN = MIN\n", a T taking at
+// most 2.5 digits per byte plus the sign, or a --fixed point
+template <typename T>
+static constexpr size_t result_max_len()
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return 3 * REAL_MAX_LEN + 8;
+    }
+
+    return 3 * (sizeof(T) * 5 / 2 + 2) + 8;
+}
+
+static char std_out_buf[OUT_BUFFER_SIZE];
+
+static Output std_out = {STDOUT_FILENO, std_out_buf, 0, OUT_BUFFER_SIZE,
+                         OUT_FD, 0};
+
+// unbuffered: every message is written with a single write()
+static Output std_err = {STDERR_FILENO, nullptr, 0, 0, OUT_FD, 0};
+
+// results go to res_out; errors go to err_out, which text batch mode points
+// at res_out so every input line gets one output line, and binary batch mode
+// clears because the status byte replaces the message. Per thread, so batch
+// workers can each write into their own buffers.
+static thread_local Output* res_out = &std_out;
+static thread_local Output* err_out = &std_err;
+
+static size_t page_round(size_t n)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+// return: 0 - ok; -1 - error (errno set)
+static int out_open(Output* o, const char* path, size_t size_hint)
+{
+    o->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    o->base = nullptr;
+    o->len = 0;
+    o->cap = page_round(size_hint);
+    o->kind = OUT_MAP;
+    o->failed = 0;
+
+    if (o->fd < 0) return -1;
+
+    // a pipe or device such as /dev/null cannot be mapped; write it
+    // through a buffer like stdout
+    struct stat st;
+    if (fstat(o->fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+        o->base = (char*)malloc(OUT_BUFFER_SIZE);
+        o->cap = OUT_BUFFER_SIZE;
+        o->kind = OUT_FD;
+        if (o->base) return 0;
+
+        close(o->fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (ftruncate(o->fd, (off_t)o->cap) == 0) {
+        o->base = (char*)mmap(nullptr, o->cap, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, o->fd, 0);
+        if (o->base != MAP_FAILED) return 0;
+    }
+
+    int saved = errno;
+    close(o->fd);
+    errno = saved;
+
+    return -1;
+}
+
+// return: 0 - ok; -1 - error (errno set)
+static int out_open_mem(Output* o, size_t size_hint)
+{
+    o->fd = -1;
+    o->base = pool_get(size_hint, &o->cap);
+    o->len = 0;
+    if (!o->base) o->cap = 0;
+    o->kind = OUT_MEM;
+    o->failed = o->base ? 0 : ENOMEM;
+
+    return o->base ? 0 : -1;
+}
+
+// return: 0 - ok; -1 - error (errno set)
+static int out_grow(Output* o, size_t need)
+{
+    size_t cap = o->cap * 2;
+    if (cap < o->len + need) cap = page_round(o->len + need);
+
+    if (o->kind == OUT_MEM) {
+        char* base = pool_get(cap, &cap);
+        if (!base) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memcpy(base, o->base, o->len);
+        pool_put(o->base, o->cap);
+        o->base = base;
+        o->cap = cap;
+        return 0;
+    }
+
+    munmap(o->base, o->cap);
+    o->base = nullptr;
+
+    if (ftruncate(o->fd, (off_t)cap) != 0) return -1;
+
+    char* base = (char*)mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             o->fd, 0);
+    if (base == MAP_FAILED) return -1;
+
+    o->base = base;
+    o->cap = cap;
+
+    return 0;
+}
+
+static void write_all(Output* o, const char* p, size_t n)
+{
+    while (n != 0) {
+        ssize_t put = write(o->fd, p, n);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            o->failed = errno;
+            return;
+        }
+        p += put;
+        n -= (size_t)put;
+    }
+}
+
+// return: 0 - ok; -1 - error (errno set)
+static int out_flush(Output* o)
+{
+    if (o->kind == OUT_FD) {
+        if (o->len != 0 && !o->failed) write_all(o, o->base, o->len);
+        o->len = 0;
+    }
+
+    if (o->failed) {
+        errno = o->failed;
+        return -1;
+    }
+
+    return 0;
+}
+
+// return: room for at least n bytes at the write position, or nullptr if
+// the output has failed or is unbuffered and n does not fit
+static char* out_reserve(Output* o, size_t n)
+{
+    if (o->failed) return nullptr;
+    if (o->cap - o->len >= n) return o->base + o->len;
+
+    if (o->kind != OUT_FD) {
+        if (out_grow(o, n) != 0) {
+            o->failed = errno;
+            return nullptr;
+        }
+        return o->base + o->len;
+    }
+
+    out_flush(o);
+
+    return (o->cap >= n && !o->failed) ? o->base : nullptr;
+}
+
+static void out_commit(Output* o, const char* end)
+{
+    o->len = (size_t)(end - o->base);
+}
+
+static void out_write(Output* o, const char* p, size_t n)
+{
+    char* dst = out_reserve(o, n);
+    if (dst) {
+        memcpy(dst, p, n);
+        out_commit(o, dst + n);
+    } else if (o->kind == OUT_FD && !o->failed) {
+        // larger than the buffer, which out_reserve() has just flushed
+        write_all(o, p, n);
+    }
+}
+
+// return: 0 - ok; -1 - error (errno set)
+static int out_close(Output* o)
+{
+    int rc = 0;
+
+    if (o->failed) {
+        errno = o->failed;
+        rc = -1;
+    }
+
+    if (o->kind == OUT_MEM) {
+        pool_put(o->base, o->cap);
+        return rc;
+    }
+
+    if (o->kind == OUT_FD) {
+        if (out_flush(o) != 0) rc = -1;
+        free(o->base);
+        if (close(o->fd) != 0) rc = -1;
+        return rc;
+    }
+
+    if (o->base) munmap(o->base, o->cap);
+    if (ftruncate(o->fd, (off_t)o->len) != 0) rc = -1;
+    if (close(o->fd) != 0) rc = -1;
+
+    return rc;
+}
+
+template <size_t N>
+static char* put_str(char* p, const char (&s)[N])
+{
+    memcpy(p, s, N - 1);
+    return p + N - 1;
+}
+
+// p must have room for 11 bytes
+static char* put_int(char* p, int v)
+{
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+    char tmp[10];
+    char* t = tmp + sizeof(tmp);
+
+    do {
+        *--t = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    if (v < 0) *p++ = '-';
+
+    size_t n = (size_t)(tmp + sizeof(tmp) - t);
+    memcpy(p, t, n);
+
+    return p + n;
+}
+
+// wide T has no unsigned type outside GNU mode, so digits are taken from
+// the value made negative, which always fits
+template <typename T>
+static char* put_int(char* p, T v)
+{
+    T neg = v < 0 ? v : -v;
+    char tmp[sizeof(T) * 5 / 2 + 1];
+    char* t = tmp + sizeof(tmp);
+
+    do {
+        *--t = (char)('0' - neg % 10);
+        neg /= 10;
+    } while (neg != 0);
+
+    if (v < 0) *p++ = '-';
+
+    size_t n = (size_t)(tmp + sizeof(tmp) - t);
+    memcpy(p, t, n);
+
+    return p + n;
+}
+
+// shortest digits that read back as v; p must have room for REAL_MAX_LEN
+static char* put_real(char* p, double v)
+{
+    return std::to_chars(p, p + REAL_MAX_LEN, v).ptr;
+}
+
+// v in units of 10^-places, every place printed; p must have room for 22
+// bytes
+static char* put_fixed(char* p, int64_t v, int places)
+{
+    int64_t neg = v < 0 ? v : -v;
+    char tmp[21];
+    char* t = tmp + sizeof(tmp);
+
+    for (int k = 0; neg != 0 || k <= places; ++k) {
+        if (k == places && places > 0) *--t = '.';
+        *--t = (char)('0' - neg % 10);
+        neg /= 10;
+    }
+
+    if (v < 0) *p++ = '-';
+
+    size_t n = (size_t)(tmp + sizeof(tmp) - t);
+    memcpy(p, t, n);
+
+    return p + n;
+}
+
+// a value of T; places: --fixed places of an int64_t, or -1
+template <typename T>
+static char* put_value(char* p, T v, int places)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return put_real(p, v);
+    } else {
+        if constexpr (std::is_same<T, int64_t>::value) {
+            if (places >= 0) return put_fixed(p, v, places);
+        }
+        return put_int(p, v);
+    }
+}
+
+// as put_value(); return: 0 - ok; -1 - not a value of T
+template <typename T>
+static int parse_value(const char* b, const char* e, int places, T* out)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return calc::parse_real_span(b, e, out);
+    } else {
+#if CALC_HAVE_INT128
+        if constexpr (std::is_same<T, int64_t>::value) {
+            if (places >= 0) return calc::parse_fixed_span(b, e, places, out);
+        }
+#endif
+        return calc::parse_int_span(b, e, out);
+    }
+}
+
+// calc::compute(), or calc::compute_fixed() with places of --fixed
+template <typename T>
+static calc::Status compute_value(calc::CalcDataT<T>* d, int places)
+{
+#if CALC_HAVE_INT128
+    if constexpr (std::is_same<T, int64_t>::value) {
+        if (places >= 0) return calc::compute_fixed(d, places);
+    }
+#endif
+
+    (void)places;
+    return calc::compute(d);
+}
+
+// calc::rpn_eval(), or calc::rpn_eval_fixed() with places of --fixed
+template <typename T>
+static calc::Status rpn_eval_value(const Token* toks, int n, int places,
+                                   T* result, int* pos)
+{
+#if CALC_HAVE_INT128
+    if constexpr (std::is_same<T, int64_t>::value) {
+        if (places >= 0) {
+            return calc::rpn_eval_fixed(toks, n, places, result, pos);
+        }
+    }
+#endif
+
+    (void)places;
+    return calc::rpn_eval(toks, n, result, pos);
+}
+
+// what messages call a value of T
+template <typename T>
+static const char* value_name(int places)
+{
+    return std::is_floating_point<T>::value || places >= 0 ? "number"
+                                                           : "integer";
+}
+
 static void print_help(const char* prog)
 {
     printf("Usage (RPN):\n"
            "  %s A B OP\n"
            "  %s N !\n"
+           "  %s A B OP C OP ...   (any RPN expression, e.g. 3 4 + 5 x)\n"
+           "  %s --batch < FILE\n"
+           "  %s --input FILE [--output FILE]\n"
+           "  %s --serve unix:PATH | tcp:[HOST:]PORT\n"
            "\n"
            "Operations:\n"
            "  +  addition\n"
@@ -30,78 +474,176 @@ static void print_help(const char* prog)
            "  !  factorial\n"
            "\n"
            "Options:\n"
-           "  -h, --help    show this help\n",
-           prog, prog);
+           "  -h, --help          show this help\n"
+           "  -b, --batch         read one expression per line from stdin\n"
+           "  -i, --input FILE    read batch input from FILE (implies --batch)\n"
+           "  -o, --output FILE   write batch results to FILE (implies --batch)\n"
+           "  -f, --format FMT    batch record format: text (default) or bin\n"
+           "  -k, --kernel NAME   batch kernels: scalar, sse, avx2, avx512 or\n"
+           "                      neon (default: best this CPU supports)\n"
+           "  -t, --threads N     evaluate batch input on N threads (0: one per\n"
+           "                      CPU); results keep the input order\n"
+           "  -z, --block-size N  input bytes a thread evaluates at a time\n"
+           "                      (default 262144)\n"
+           "  -q, --queue N       with --threads and a pipe, at most N blocks\n"
+           "                      per thread are read ahead or waiting to be\n"
+           "                      written (default 4)\n"
+           "  -s, --serve ADDR    answer batch requests (text lines, or bin with\n"
+           "                      --format) over a socket until SIGINT/SIGTERM\n"
+           "  -m, --metrics ADDR  with --serve, answer GET /metrics over HTTP on\n"
+           "                      unix:PATH or tcp:[HOST:]PORT (OpenMetrics)\n"
+           "  -w, --width BITS    integer width: 32 (default), 64 or 128;\n"
+           "                      --format bin is 32-bit only\n"
+           "  -r, --real          double arithmetic; results in the shortest\n"
+           "                      digits that read back the same\n"
+           "  -F, --fixed N       decimals with N places (0 to 18) in 64 bits;\n"
+           "                      x and / round half away from zero\n"
+           "  -B, --bigint        exact '!' and '^' results when they overflow\n"
+           "                      the width (text output only)\n"
+           "  -c, --cache N       remember up to N '^' and bigint results in\n"
+           "                      batch and server mode; counts go to stderr\n"
+           "  -p, --program RPN   compile RPN once, with $1..$9 standing for the\n"
+           "                      values on each batch line (implies --batch)\n"
+           "  -g, --group-ops     compute batch records sorted by op, for input\n"
+           "                      that mixes ops; output keeps the input order\n"
+           "  -S, --stats         time parse, check, compute and output and count\n"
+           "                      ops and errors; one JSON line to stderr at exit\n",
+           prog, prog, prog, prog, prog, prog);
 }
 
 static void print_error(const char* fmt, ...)
 {
+    if (!err_out) return;
+
     va_list args;
     va_start(args, fmt);
 
-    fprintf(stderr, "Error: ");
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    // format "Error: <msg>\n" once so it is a single write
+    char buf[256];
+    char* msg = buf;
 
+    va_list again;
+    va_copy(again, args);
+
+    int n = vsnprintf(buf + 7, sizeof(buf) - 8, fmt, args);
+    if (n >= 0 && (size_t)n >= sizeof(buf) - 8) {
+        // long token echoed back, e.g. an invalid integer
+        msg = (char*)malloc((size_t)n + 9);
+        if (msg) vsnprintf(msg + 7, (size_t)n + 1, fmt, again);
+    }
+
+    va_end(again);
     va_end(args);
+
+    if (!msg || n < 0) return;
+
+    memcpy(msg, "Error: ", 7);
+    msg[7 + n] = '\n';
+    out_write(err_out, msg, (size_t)n + 8);
+
+    if (msg != buf) free(msg);
 }
 
-static void print_math_error(int rc)
+static void print_status(calc::Status st)
 {
-    switch (rc) {
-    case mathlib::MATH_ERR_OVERFLOW:
-        print_error("overflow");
-        break;
-    case mathlib::MATH_ERR_DIV_BY_ZERO:
-        print_error("division by zero");
-        break;
-    case mathlib::MATH_ERR_INVALID_ARG:
-        print_error("invalid argument");
-        break;
-    default:
-        print_error("math error (code=%d)", rc);
-        break;
-    }
+    print_error("%s", calc::status_message(st));
 }
 
-static void print_result(const CalcData* d)
+// places: as for put_value()
+template <typename T>
+static void print_result(const calc::CalcDataT<T>* d, int places)
 {
+    char* p = out_reserve(res_out, result_max_len<T>());
+    if (!p) return;
+
     switch (d->op) {
     case '!':
-        printf("fact(%d) = %d\n", d->a, d->result);
+        p = put_str(p, "fact(");
+        p = put_value(p, d->a, places);
+        p = put_str(p, ") = ");
         break;
     case '^':
-        printf("%d^%d = %d\n", d->a, d->b, d->result);
-        break;
-    case 'x':
-        printf("%d x %d = %d\n", d->a, d->b, d->result);
+        p = put_value(p, d->a, places);
+        *p++ = '^';
+        p = put_value(p, d->b, places);
+        p = put_str(p, " = ");
         break;
     default:
-        printf("%d %c %d = %d\n", d->a, d->op, d->b, d->result);
+        p = put_value(p, d->a, places);
+        *p++ = ' ';
+        *p++ = d->op;
+        *p++ = ' ';
+        p = put_value(p, d->b, places);
+        p = put_str(p, " = ");
         break;
     }
+
+    p = put_value(p, d->result, places);
+    *p++ = '\n';
+
+    out_commit(res_out, p);
 }
 
-static int parse_int(const char* s, int* out)
+// '!' and '^' operands are never negative once checked
+template <typename T>
+static uint64_t clamp_u64(T v)
 {
-    char* end = nullptr;
-    errno = 0;
+    if constexpr (sizeof(T) > sizeof(uint64_t)) {
+        if (v > (T)UINT64_MAX) return UINT64_MAX;
+    }
 
-    long v = strtol(s, &end, 10);
+    return (uint64_t)v;
+}
 
-    if (errno == ERANGE) return -1;
-    if (errno != 0) return -1;
-    if (end == s) return -1;
-    if (*end != '\0') return -1;
-    if (v < (long)INT_MIN || v > (long)INT_MAX) return -1;
-    *out = (int)v;
+// --bigint digits of a '!' or '^' that overflowed T
+// return: 0 - ok; 1 - too large even for bigint
+template <typename T>
+static int bigint_digits(const calc::CalcDataT<T>* d, std::string* digits)
+{
+    if (d->op == '!') return bigint_fact(clamp_u64(d->a), digits) != 0;
 
-    return 0;
+    char base[result_max_len<T>()];
+    char* base_end = put_int(base, d->a);
+
+    return bigint_pow(base, base_end, clamp_u64(d->b), digits) != 0;
 }
 
-static int is_binary_op(char op)
+// --bigint answer for a '!' or '^' that overflowed T, through memo if any
+// return: 0 - printed; 1 - another op, or too large even for bigint
+template <typename T>
+static int print_bigint_result(const calc::CalcDataT<T>* d,
+                               MemoCache<T>* memo)
 {
-    return (op == '+' || op == '-' || op == 'x' || op == '/' || op == '^');
+    if (d->op != '!' && d->op != '^') return 1;
+
+    std::string computed;
+    const std::string* digits = memo ? memo_find_big(memo, d) : nullptr;
+
+    if (!digits) {
+        if (bigint_digits(d, &computed) != 0) return 1;
+        if (memo) memo_store_big(memo, d, computed);
+        digits = &computed;
+    }
+
+    char head[result_max_len<T>()];
+    char* p = head;
+
+    if (d->op == '!') {
+        p = put_str(p, "fact(");
+        p = put_int(p, d->a);
+        p = put_str(p, ") = ");
+    } else {
+        p = put_int(p, d->a);
+        *p++ = '^';
+        p = put_int(p, d->b);
+        p = put_str(p, " = ");
+    }
+
+    out_write(res_out, head, (size_t)(p - head));
+    out_write(res_out, digits->data(), digits->size());
+    out_write(res_out, "\n", 1);
+
+    return 0;
 }
 
 static int is_negative_number_token(const char* s)
@@ -109,47 +651,23 @@ static int is_negative_number_token(const char* s)
     return (s && s[0] == '-' && s[1] >= '0' && s[1] <= '9');
 }
 
-// return: 0 - ok; 1 - usage/help requested; 2 - usage error
-static int parse(CalcData* d, int argc, char** argv, int* want_help)
+// return: 1 - s is for getopt_long(): an option, or "--"; 0 - an operand
+static int is_option_token(const char* s)
 {
-    *want_help = 0;
-    static struct option long_opts[] = {{"help", no_argument, 0, 'h'},
-                                        {0, 0, 0, 0}};
-    optind = 1;
-    opterr = 0;
-
-    int opt;
-    int stop_options = 0;
-
-    while (!stop_options &&
-            (opt = getopt_long(argc, argv, "+h", long_opts, nullptr)) != -1) {
-        switch (opt) {
-        case 'h': {
-            *want_help = 1;
-            return 1;
-        }
-        case '?': {
-            const char* bad = argv[optind - 1];
-
-            if (is_negative_number_token(bad)) {
-                optind -= 1;
-                stop_options = 1;
-                break;
-            }
-
-            print_error("unknown option: %s", bad);
+    return (s[0] == '-' && s[1] != '\0' && !is_negative_number_token(s));
+}
 
-            return 2;
-        }
-        default: {
-            print_error("unknown option");
-            return 2;
-        }
-        }
-    }
+static int token_len(const Token* t)
+{
+    return (int)(t->e - t->b);
+}
 
-    int remaining = argc - optind;
-    if (remaining != 2 && remaining != 3) {
+// places: as for put_value(); return: 0 - ok; 2 - usage error
+template <typename T>
+static int parse_operands(calc::CalcDataT<T>* d, int n, const Token* args,
+                          int places)
+{
+    if (n != 2 && n != 3) {
         print_error("invalid number of arguments");
         return 2;
     }
@@ -159,20 +677,20 @@ static int parse(CalcData* d, int argc, char** argv, int* want_help)
     d->op = 0;
     d->result = 0;
 
-    if (remaining == 2) {
+    if (n == 2) {
         // N !
-        if (parse_int(argv[optind], &d->a) != 0) {
-            print_error("invalid integer: %s", argv[optind]);
+        if (parse_value(args[0].b, args[0].e, places, &d->a) != 0) {
+            print_error("invalid %s: %.*s", value_name<T>(places),
+                        token_len(&args[0]), args[0].b);
             return 2;
         }
     
-        const char* op = argv[optind + 1];
-        if (!op || op[0] == '\0' || op[1] != '\0') {
+        if (token_len(&args[1]) != 1) {
             print_error("operation must be a single character");
             return 2;
         }
 
-        d->op = op[0];
+        d->op = args[1].b[0];
 
         if (d->op != '!') {
             print_error("unary form requires '!': N !");
@@ -183,119 +701,2691 @@ static int parse(CalcData* d, int argc, char** argv, int* want_help)
     }
 
     // A B OP
-    if (parse_int(argv[optind], &d->a) != 0) {
-        print_error("invalid integer: %s", argv[optind]);
+    if (parse_value(args[0].b, args[0].e, places, &d->a) != 0) {
+        print_error("invalid %s: %.*s", value_name<T>(places),
+                    token_len(&args[0]), args[0].b);
         return 2;
     }
 
-    if (parse_int(argv[optind + 1], &d->b) != 0) {
-        print_error("invalid integer: %s", argv[optind + 1]);
+    if (parse_value(args[1].b, args[1].e, places, &d->b) != 0) {
+        print_error("invalid %s: %.*s", value_name<T>(places),
+                    token_len(&args[1]), args[1].b);
         return 2;
     }
 
-    const char* op = argv[optind + 2];
-    if (!op || op[0] == '\0' || op[1] != '\0') {
+    if (token_len(&args[2]) != 1) {
         print_error("operation must be a single character");
         return 2;
     }
 
-    d->op = op[0];
+    d->op = args[2].b[0];
 
     return 0;
 }
 
-// return: 0 - ok; 1 - usage error; 2 - runtime error
-static int check(const CalcData* d)
+// operands are left in o for run_single(), which knows their width
+// return: 0 - ok; 1 - usage/help requested; 2 - usage error
+static int parse(int argc, char** argv, Options* o)
 {
-    if (d->op == '!') {
-        if (d->b != 0) {
-            print_error("'!' must be used in unary form: N !");
+    o->help = 0;
+    o->batch = 0;
+    o->input = nullptr;
+    o->output = nullptr;
+    o->format = FORMAT_TEXT;
+    o->kernels = nullptr;
+    o->threads = 1;
+    o->block = BLOCK_SIZE;
+    o->queue = QUEUE_DEPTH;
+    o->serve = nullptr;
+    o->metrics = nullptr;
+    o->width = 32;
+    o->real = 0;
+    o->fixed = -1;
+    o->bigint = 0;
+    o->cache = 0;
+    o->group = 0;
+    o->program = nullptr;
+    o->compiled = nullptr;
+    o->stats = 0;
+    o->operands = nullptr;
+    o->operand_count = 0;
+
+    // operands only, as per-process callers run it: options may not follow
+    // the first operand, so getopt_long() would have nothing to do
+    if (argc > 1 && !is_option_token(argv[1])) {
+        o->operands = argv + 1;
+        o->operand_count = argc - 1;
+        return 0;
+    }
+
+    static const struct option long_opts[] = {{"help", no_argument, 0, 'h'},
+                                        {"batch", no_argument, 0, 'b'},
+                                        {"input", required_argument, 0, 'i'},
+                                        {"output", required_argument, 0, 'o'},
+                                        {"format", required_argument, 0, 'f'},
+                                        {"kernel", required_argument, 0, 'k'},
+                                        {"threads", required_argument, 0, 't'},
+                                        {"serve", required_argument, 0, 's'},
+                                        {"width", required_argument, 0, 'w'},
+                                        {"bigint", no_argument, 0, 'B'},
+                                        {"cache", required_argument, 0, 'c'},
+                                        {"program", required_argument, 0, 'p'},
+                                        {"group-ops", no_argument, 0, 'g'},
+                                        {"stats", no_argument, 0, 'S'},
+                                        {"metrics", required_argument, 0, 'm'},
+                                        {"block-size", required_argument, 0,
+                                         'z'},
+                                        {"queue", required_argument, 0, 'q'},
+                                        {"real", no_argument, 0, 'r'},
+                                        {"fixed", required_argument, 0, 'F'},
+                                        {0, 0, 0, 0}};
+    optind = 1;
+    opterr = 0;
+
+    // a negative operand ends the options before getopt_long() reads it
+    // as a cluster of digit options
+    int opt;
+    while ((optind >= argc || is_option_token(argv[optind])) &&
+           (opt = getopt_long(argc, argv, "+hbi:o:f:k:t:z:q:s:w:rF:Bc:p:gSm:",
+                              long_opts, nullptr)) != -1) {
+        switch (opt) {
+        case 'h': {
+            o->help = 1;
             return 1;
         }
-
-        if (d->a < 0) {
-            print_error("factorial requires n >= 0");
+        case 'b': {
+            o->batch = 1;
+            break;
+        }
+        case 'i': {
+            o->input = optarg;
+            o->batch = 1;
+            break;
+        }
+        case 'o': {
+            o->output = optarg;
+            o->batch = 1;
+            break;
+        }
+        case 'f': {
+            if (strcmp(optarg, "text") == 0) {
+                o->format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "bin") == 0) {
+                o->format = FORMAT_BIN;
+            } else {
+                print_error("unknown format: %s", optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 'k': {
+            switch (kernels_select(optarg, &o->kernels)) {
+            case 0:
+                break;
+            case 1:
+                print_error("unknown kernel: %s", optarg);
+                return 2;
+            default:
+                print_error("kernel not available on this machine: %s",
+                            optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 't': {
+            const char* end = optarg + strlen(optarg);
+            if (calc::parse_int_span(optarg, end, &o->threads) != 0 ||
+                o->threads < 0) {
+                print_error("invalid thread count: %s", optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 'z': {
+            const char* end = optarg + strlen(optarg);
+            if (calc::parse_int_span(optarg, end, &o->block) != 0 ||
+                o->block <= 0) {
+                print_error("invalid block size: %s", optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 'q': {
+            const char* end = optarg + strlen(optarg);
+            if (calc::parse_int_span(optarg, end, &o->queue) != 0 ||
+                o->queue <= 0) {
+                print_error("invalid queue depth: %s", optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 's': {
+            o->serve = optarg;
+            break;
+        }
+        case 'm': {
+            o->metrics = optarg;
+            break;
+        }
+        case 'c': {
+            const char* end = optarg + strlen(optarg);
+            if (calc::parse_int_span(optarg, end, &o->cache) != 0 ||
+                o->cache < 0) {
+                print_error("invalid cache size: %s", optarg);
+                return 2;
+            }
+            o->batch = 1;
+            break;
+        }
+        case 'B': {
+            o->bigint = 1;
+            break;
+        }
+        case 'p': {
+            o->program = optarg;
+            o->batch = 1;
+            break;
+        }
+        case 'g': {
+            o->group = 1;
+            o->batch = 1;
+            break;
+        }
+        case 'S': {
+            if (!CALC_STATS) {
+                print_error("--stats needs a build with CALCULATOR_STATS=ON");
+                return 2;
+            }
+            o->stats = 1;
+            break;
+        }
+        case 'w': {
+            if (strcmp(optarg, "32") == 0) {
+                o->width = 32;
+            } else if (strcmp(optarg, "64") == 0) {
+                o->width = 64;
+#if CALC_HAVE_INT128
+            } else if (strcmp(optarg, "128") == 0) {
+                o->width = 128;
+#endif
+            } else {
+                print_error("unsupported width: %s", optarg);
+                return 2;
+            }
+            break;
+        }
+        case 'r': {
+            o->real = 1;
+            break;
+        }
+        case 'F': {
+#if CALC_HAVE_INT128
+            const char* end = optarg + strlen(optarg);
+            if (calc::parse_int_span(optarg, end, &o->fixed) != 0 ||
+                o->fixed < 0 || o->fixed > calc::FIXED_SCALE_MAX) {
+                print_error("invalid number of places: %s", optarg);
+                return 2;
+            }
+            break;
+#else
+            print_error("--fixed needs a compiler with 128-bit integers");
             return 2;
+#endif
         }
+        case '?': {
+            const char* bad = argv[optind - 1];
 
-        return 0;
-    }
+            if (optopt != 0 && strchr("iofktzqswFcpm", optopt)) {
+                print_error("option requires an argument: %s", bad);
+                return 2;
+            }
 
-    if (!is_binary_op(d->op)) {
-        print_error("unknown operation");
-        return 1;
-    }
+            print_error("unknown option: %s", bad);
 
-    if (d->op == '^' && d->b < 0) {
-        print_error("power requires exp >= 0");
-        return 2;
+            return 2;
+        }
+        default: {
+            print_error("unknown option");
+            return 2;
+        }
+        }
+    }
+
+    if (o->metrics && !o->serve) {
+        print_error("--metrics needs --serve");
+        return 2;
+    }
+
+    if (o->serve && (o->input || o->output || o->threads != 1 ||
+                     o->block != BLOCK_SIZE || o->queue != QUEUE_DEPTH)) {
+        print_error("--serve cannot be combined with --input, --output, "
+                    "--threads, --block-size or --queue");
+        return 2;
+    }
+
+    if (o->real || o->fixed >= 0) {
+        const char* mode = o->real ? "--real" : "--fixed";
+
+        if (o->real && o->fixed >= 0) {
+            print_error("--real cannot be combined with --fixed");
+            return 2;
+        }
+
+        if (o->width != 32 || o->bigint || o->cache ||
+            o->format == FORMAT_BIN) {
+            print_error("%s cannot be combined with --width, --bigint, "
+                        "--cache or --format bin",
+                        mode);
+            return 2;
+        }
+
+        if (o->fixed >= 0 && o->program) {
+            print_error("--fixed cannot be combined with --program");
+            return 2;
+        }
+
+        // scaled values are int64_t
+        if (o->fixed >= 0) o->width = 64;
+    }
+
+    if ((o->width != 32 || o->bigint) && o->format == FORMAT_BIN) {
+        print_error("--format bin is 32-bit only");
+        return 2;
+    }
+
+    if (o->program && o->format == FORMAT_BIN) {
+        print_error("--program reads text lines only");
+        return 2;
+    }
+
+    if (o->batch || o->serve) {
+        if (optind != argc) {
+            print_error("%s mode takes no operands",
+                        o->serve ? "server" : "batch");
+            return 2;
+        }
+
+        return 0;
+    }
+
+    o->operands = argv + optind;
+    o->operand_count = argc - optind;
+
+    return 0;
+}
+
+static int is_blank(char c)
+{
+    return (c == ' ' || c == '\t' || c == '\r');
+}
+
+// splits [b, e) into at most max whitespace-separated tokens; return: token
+// count, or max + 1 if there are more
+static int tokenize(const char* b, const char* e, Token* toks, int max)
+{
+    int n = 0;
+
+    for (;;) {
+        while (b != e && is_blank(*b)) ++b;
+        if (b == e) break;
+
+        if (n == max) return max + 1;
+
+        toks[n].b = b;
+        while (b != e && !is_blank(*b)) ++b;
+        toks[n].e = b;
+        ++n;
+    }
+
+    return n;
+}
+
+// about to print: "A B OP C OP ... = R\n", tokens joined by single spaces;
+// places: as for put_value()
+template <typename T>
+static void print_rpn_result(const Token* toks, int n, T result, int places)
+{
+    for (int i = 0; i < n; ++i) {
+        if (i != 0) out_write(res_out, " ", 1);
+        out_write(res_out, toks[i].b, (size_t)token_len(&toks[i]));
+    }
+
+    char* p = out_reserve(res_out, result_max_len<T>());
+    if (!p) return;
+
+    p = put_str(p, " = ");
+    p = put_value(p, result, places);
+    *p++ = '\n';
+
+    out_commit(res_out, p);
+}
+
+// noun: what a value is called, see value_name()
+static void print_rpn_error(const Token* toks, int n, calc::Status st,
+                            int pos, const char* noun)
+{
+    if (st == calc::STATUS_USAGE) {
+        print_error("invalid %s: %.*s", noun, token_len(&toks[pos]),
+                    toks[pos].b);
+    } else if (pos == n) {
+        print_status(st);
+    } else {
+        print_error("%s at token %d: %.*s", calc::status_message(st), pos + 1,
+                    token_len(&toks[pos]), toks[pos].b);
+    }
+}
+
+// places: as for put_value()
+template <typename T>
+static calc::Status eval_rpn(const Token* toks, int n, T* result, int places)
+{
+    if (n > RPN_TOKENS_MAX) {
+        print_error("too many tokens, at most %d", RPN_TOKENS_MAX);
+        return calc::STATUS_USAGE;
+    }
+
+    int pos = 0;
+    calc::Status st = rpn_eval_value(toks, n, places, result, &pos);
+    if (st != calc::STATUS_OK) {
+        print_rpn_error(toks, n, st, pos, value_name<T>(places));
+    }
+
+    return st;
+}
+
+// a line of more than three tokens is an RPN expression: *rpn is set, its
+// value goes to d->result and d->op is 0; any other line is only parsed,
+// see chunk_check(); places: as for put_value()
+template <typename T>
+static calc::Status load_line(calc::CalcDataT<T>* d, const char* b,
+                              const char* e, int* rpn, int places)
+{
+    uint64_t t = stats_begin();
+
+    Token args[RPN_TOKENS_MAX];
+    int n = tokenize(b, e, args, RPN_TOKENS_MAX);
+
+    *rpn = (n > 3);
+    if (*rpn) {
+        d->a = 0;
+        d->b = 0;
+        d->op = 0;
+        d->result = 0;
+
+        // an RPN line checks and computes op by op; all of it is compute
+        t = stats_lap(STAGE_PARSE, t);
+        calc::Status st = eval_rpn(args, n, &d->result, places);
+        stats_end(STAGE_COMPUTE, t);
+        return st;
+    }
+
+    int rc = parse_operands(d, n, args, places);
+    stats_end(STAGE_PARSE, t);
+
+    return rc != 0 ? calc::STATUS_USAGE : calc::STATUS_OK;
+}
+
+static_assert(RPN_TOKENS_MAX <= calc::RPN_PROGRAM_MAX,
+              "a --program must fit in an RpnProgramT");
+
+// a compiled --program; code holds the RpnProgramT of the --width, or of
+// double with --real
+struct Program
+{
+    Token toks[RPN_TOKENS_MAX]; // into the --program argument
+    int n;
+    int args; // values each input line holds
+    union
+    {
+        calc::RpnProgramT<int> i32;
+        calc::RpnProgramT<int64_t> i64;
+#if CALC_HAVE_INT128
+        calc::RpnProgramT<calc::int128> i128;
+#endif
+        calc::RpnProgramT<double> real;
+    } code;
+};
+
+template <typename T>
+static const calc::RpnProgramT<T>* program_code(const Program* pg)
+{
+    return (const calc::RpnProgramT<T>*)(const void*)&pg->code;
+}
+
+// splits a --program line into its values, out[0], out[stride], ...
+template <typename T>
+static calc::Status load_args(const Program* pg, const char* b, const char* e,
+                              T* out, size_t stride)
+{
+    Token vals[calc::RPN_ARGS_MAX];
+    int n = tokenize(b, e, vals, calc::RPN_ARGS_MAX);
+
+    // the row still goes through the columns, so give it defined values
+    for (int j = 0; j < pg->args; ++j) out[j * stride] = 0;
+
+    if (n != pg->args) {
+        print_error("expected %d value%s per line", pg->args,
+                    pg->args == 1 ? "" : "s");
+        return calc::STATUS_USAGE;
+    }
+
+    for (int j = 0; j < n; ++j) {
+        if (parse_value(vals[j].b, vals[j].e, -1, &out[j * stride]) != 0) {
+            print_error("invalid %s: %.*s", value_name<T>(-1),
+                        token_len(&vals[j]), vals[j].b);
+            return calc::STATUS_USAGE;
+        }
+    }
+
+    return calc::STATUS_OK;
+}
+
+// about to print the --program with the line's values in place of its $N,
+// like print_rpn_result()
+template <typename T>
+static void print_program_result(const Program* pg, const char* b,
+                                 const char* e, T result)
+{
+    Token vals[calc::RPN_ARGS_MAX];
+    tokenize(b, e, vals, calc::RPN_ARGS_MAX);
+
+    for (int i = 0; i < pg->n; ++i) {
+        const Token* t = &pg->toks[i];
+        if (*t->b == '$') t = &vals[t->b[1] - '1'];
+
+        if (i != 0) out_write(res_out, " ", 1);
+        out_write(res_out, t->b, (size_t)token_len(t));
+    }
+
+    char* p = out_reserve(res_out, result_max_len<T>());
+    if (!p) return;
+
+    p = put_str(p, " = ");
+    p = put_value(p, result, -1);
+    *p++ = '\n';
+
+    out_commit(res_out, p);
+}
+
+// reports why a --program line failed, once the columns have said it did
+template <typename T>
+static void print_program_error(const Program* pg, const char* b,
+                                const char* e)
+{
+    T args[calc::RPN_ARGS_MAX];
+    if (load_args(pg, b, e, args, 1) != calc::STATUS_OK) return;
+
+    T result;
+    int pos = 0;
+    calc::Status st = calc::rpn_run(program_code<T>(pg), args, &result, &pos);
+    if (st != calc::STATUS_OK) {
+        print_rpn_error(pg->toks, pg->n, st, pos, value_name<T>(-1));
+    }
+}
+
+// binary batch format, all integers little-endian:
+//   header:  char magic[4], uint16 version, uint16 record size
+//   request: int32 a, int32 b, uint8 op         (magic "CALQ", 9 bytes)
+//   result:  int32 result, uint8 status         (magic "CALR", 5 bytes)
+// status is a calc::Status, result is 0 unless status is STATUS_OK.
+// Version 1 sent the exit code as status; its requests are still accepted
+static const unsigned BIN_VERSION = 2;
+static const size_t BIN_HEADER_SIZE = 8;
+static const size_t BIN_REQUEST_SIZE = 9;
+static const size_t BIN_RESULT_SIZE = 5;
+
+// records evaluated together; also bounds how long input spans are held
+static const size_t BATCH_CHUNK = 4096;
+
+// one input record of the current chunk
+template <typename T>
+struct EntryT
+{
+    const char* b; // line or binary record in the input buffer
+    const char* e;
+    calc::CalcDataT<T> d;
+    calc::Status status; // parse + check, then compute
+    int rpn;             // d holds only the result, see load_line()
+};
+
+// the records of a chunk that go to a kernel, one column buffer per field:
+// + - x / of int and --real, + - of int64_t. status is what the kernel
+// gives, see column_status()
+template <typename T>
+struct ColumnT
+{
+    T a[BATCH_CHUNK];
+    T b[BATCH_CHUNK];
+    T result[BATCH_CHUNK];
+    int status[BATCH_CHUNK];
+    unsigned idx[BATCH_CHUNK]; // position in ChunkT::entries
+    size_t n;
+};
+
+typedef ColumnT<int> Column;
+
+// wider T is checked one entry at a time and leaves ops, checked and
+// failed unused. With a --program, args holds one column per $N for
+// calc::rpn_run_columns(); otherwise args[0], args[1] and ops are the a, b
+// and op columns of an int chunk for chunk_check()
+template <typename T>
+struct ChunkT
+{
+    EntryT<T> entries[BATCH_CHUNK];
+    size_t n;
+    ColumnT<T> cols[KERNEL_OPS];
+    T args[calc::RPN_ARGS_MAX][BATCH_CHUNK];
+    char ops[BATCH_CHUNK]; // 0 where the entry is not left to check
+    T results[BATCH_CHUNK];
+    uint8_t status[BATCH_CHUNK];
+    // chunk_check(): entries that passed with an op that has no kernel,
+    // and those that did not pass
+    unsigned checked[BATCH_CHUNK];
+    unsigned failed[BATCH_CHUNK];
+    // --group-ops: entries left for chunk_flush() to compute, by op
+    unsigned deferred[BATCH_CHUNK];
+    unsigned sorted[BATCH_CHUNK];
+    size_t deferred_n;
+};
+
+struct Batch;
+
+// the chunk functions for one --width or --real, see chunk_ops()
+struct ChunkOps
+{
+    void* (*alloc)(Arena* a);
+    void (*push)(Batch* bt, const char* b, const char* e);
+    void (*flush)(Batch* bt);
+    void* (*memo_open)(size_t slots);
+    // adds the memo's counters to *hits and *misses, then frees it
+    void (*memo_close)(void* memo, uint64_t* hits, uint64_t* misses);
+    void (*memo_counts)(const void* memo, uint64_t* hits, uint64_t* misses);
+    // pos: as for calc::rpn_compile()
+    calc::Status (*compile)(Program* pg, int* pos);
+};
+
+// state of one batch run, shared by the text and binary readers
+struct Batch
+{
+    void* chunk; // ChunkT<T> of ops
+    Arena* arena; // this thread's, for what lives as long as one batch
+    const ChunkOps* ops;
+    void* memo;  // MemoCache<T> of ops, or nullptr without --cache
+    const Program* program; // every line holds its values, if set
+    const KernelSet* kernels;
+    Output* err; // where per-record messages are rendered, if anywhere
+    MetricsShard* metrics; // --metrics of the serving thread
+    uint64_t arrived; // metrics_now() when the records being pushed came in
+    int format;
+    int bigint;
+    int group;
+    int fixed; // --fixed places, or -1
+    int header_seen;
+    int stopped;
+    int worst;
+};
+
+static void batch_status(Batch* bt, int rc)
+{
+    if (rc > bt->worst) bt->worst = rc;
+}
+
+static unsigned get_u16(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (unsigned)u[0] | (unsigned)u[1] << 8;
+}
+
+static int get_i32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (int)((unsigned)u[0] | (unsigned)u[1] << 8 | (unsigned)u[2] << 16 |
+                 (unsigned)u[3] << 24);
+}
+
+static char* put_u16(char* p, unsigned v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)(v >> 8 & 0xff);
+    return p + 2;
+}
+
+static char* put_i32(char* p, int v)
+{
+    unsigned u = (unsigned)v;
+    p[0] = (char)(u & 0xff);
+    p[1] = (char)(u >> 8 & 0xff);
+    p[2] = (char)(u >> 16 & 0xff);
+    p[3] = (char)(u >> 24 & 0xff);
+    return p + 4;
+}
+
+static void print_bin_header()
+{
+    char* p = out_reserve(res_out, BIN_HEADER_SIZE);
+    if (!p) return;
+
+    p = put_str(p, "CALR");
+    p = put_u16(p, BIN_VERSION);
+    p = put_u16(p, BIN_RESULT_SIZE);
+
+    out_commit(res_out, p);
+}
+
+static void load_record(CalcData* d, const char* rec)
+{
+    uint64_t t = stats_begin();
+
+    d->a = get_i32(rec);
+    d->b = get_i32(rec + 4);
+    d->op = rec[8];
+    d->result = 0;
+
+    stats_end(STAGE_PARSE, t);
+}
+
+// return: 0 - ok; 1 - usage error; 2 - runtime error
+template <typename T>
+static int print_entry(const Batch* bt, const EntryT<T>* en)
+{
+    int ok = (en->status == calc::STATUS_OK);
+
+    if (bt->format == FORMAT_BIN) {
+        char* p = out_reserve(res_out, BIN_RESULT_SIZE);
+        if (p) {
+            p = put_i32(p, ok ? en->d.result : 0);
+            *p++ = (char)en->status;
+            out_commit(res_out, p);
+        }
+        return calc::status_exit_code(en->status);
+    }
+
+    if (bt->program) {
+        if (ok) {
+            print_program_result(bt->program, en->b, en->e, en->d.result);
+            return 0;
+        }
+
+        // re-splitting the line is not a stage of its own
+        Stats* st = stats_attach(nullptr);
+        err_out = bt->err;
+        print_program_error<T>(bt->program, en->b, en->e);
+        err_out = nullptr;
+        stats_attach(st);
+
+        return calc::status_exit_code(en->status);
+    }
+
+    if (ok && en->rpn) {
+        Token args[RPN_TOKENS_MAX];
+        int n = tokenize(en->b, en->e, args, RPN_TOKENS_MAX);
+        print_rpn_result(args, n, en->d.result, bt->fixed);
+        return 0;
+    }
+
+    if (ok) {
+        print_result(&en->d, bt->fixed);
+        return 0;
+    }
+
+    if constexpr (!std::is_floating_point<T>::value) {
+        if (en->status == calc::STATUS_OVERFLOW && bt->bigint &&
+            print_bigint_result(&en->d, (MemoCache<T>*)bt->memo) == 0) {
+            return 0;
+        }
+    }
+
+    // messages are rendered only now; parse and RPN errors need the line
+    // again to name the bad token
+    err_out = bt->err;
+    if (en->rpn || en->status == calc::STATUS_USAGE) {
+        Stats* st = stats_attach(nullptr);
+        calc::CalcDataT<T> scratch;
+        int rpn;
+        load_line(&scratch, en->b, en->e, &rpn, bt->fixed);
+        stats_attach(st);
+    } else {
+        print_status(en->status);
+    }
+    err_out = nullptr;
+
+    return calc::status_exit_code(en->status);
+}
+
+// return: an empty chunk from a, or nullptr when out of memory
+template <typename T>
+static void* chunk_alloc(Arena* a)
+{
+    ChunkT<T>* c = (ChunkT<T>*)arena_alloc(a, sizeof(ChunkT<T>));
+    if (!c) return nullptr;
+
+    c->n = 0;
+    c->deferred_n = 0;
+    for (int col = 0; col < KERNEL_OPS; ++col) c->cols[col].n = 0;
+
+    return c;
+}
+
+// runs the --program over the chunk's value columns
+template <typename T>
+static void chunk_run_program(Batch* bt)
+{
+    ChunkT<T>* c = (ChunkT<T>*)bt->chunk;
+
+    const T* cols[calc::RPN_ARGS_MAX];
+    for (int j = 0; j < calc::RPN_ARGS_MAX; ++j) cols[j] = c->args[j];
+
+    uint64_t t = stats_begin();
+    calc::rpn_run_columns(bt->kernels, program_code<T>(bt->program), cols,
+                          c->n, c->results, c->status);
+    stats_end(STAGE_COMPUTE, t, c->n);
+
+    for (size_t i = 0; i < c->n; ++i) {
+        EntryT<T>* en = &c->entries[i];
+        if (en->status != calc::STATUS_OK) continue;
+
+        en->d.result = c->results[i];
+        en->status = (calc::Status)c->status[i];
+    }
+}
+
+// computes the --group-ops entries after a counting sort on op, so that
+// calc::compute() sees long runs of one op instead of a random mix
+template <typename T>
+static void chunk_compute_grouped(const Batch* bt, ChunkT<T>* c)
+{
+    size_t start[256] = {};
+    for (size_t i = 0; i < c->deferred_n; ++i) {
+        start[(unsigned char)c->entries[c->deferred[i]].d.op]++;
+    }
+
+    size_t sum = 0;
+    for (size_t& s : start) {
+        size_t n = s;
+        s = sum;
+        sum += n;
+    }
+
+    for (size_t i = 0; i < c->deferred_n; ++i) {
+        unsigned idx = c->deferred[i];
+        c->sorted[start[(unsigned char)c->entries[idx].d.op]++] = idx;
+    }
+
+    uint64_t t = stats_begin();
+    for (size_t i = 0; i < c->deferred_n; ++i) {
+        EntryT<T>* en = &c->entries[c->sorted[i]];
+        en->status = compute_value(&en->d, bt->fixed);
+    }
+    stats_end(STAGE_COMPUTE, t, c->deferred_n);
+
+    c->deferred_n = 0;
+}
+
+// return: the kernel column of a checked op of T, or -1 if it has none;
+// int ops are split by chunk_check()
+template <typename T>
+static int column_of(char op)
+{
+    int col = kernels_op_index(op);
+
+    if constexpr (std::is_floating_point<T>::value) {
+        return col;
+    } else if constexpr (std::is_same<T, int64_t>::value) {
+        return col < FIXED_KERNEL_OPS ? col : -1;
+    }
+
+    return -1;
+}
+
+// computes a checked entry of wider T in a kernel column, or without one,
+// or leaves it for chunk_compute_grouped()
+template <typename T>
+static void chunk_compute_entry(Batch* bt, ChunkT<T>* c, size_t i)
+{
+    EntryT<T>* en = &c->entries[i];
+
+    if constexpr (!std::is_same<T, int>::value) {
+        int col = column_of<T>(en->d.op);
+        if (col >= 0) {
+            ColumnT<T>* k = &c->cols[col];
+            k->a[k->n] = en->d.a;
+            k->b[k->n] = en->d.b;
+            k->idx[k->n++] = (unsigned)i;
+            return;
+        }
+    }
+
+    // '^' is the only fixed-width op worth remembering; '!' is a table
+    MemoCache<T>* memo = (MemoCache<T>*)bt->memo;
+    if (memo && en->d.op == '^') {
+        uint64_t t = stats_begin();
+        if (!memo_find(memo, &en->d, &en->status)) {
+            en->status = calc::compute(&en->d);
+            memo_store(memo, &en->d, en->status);
+        }
+        stats_end(STAGE_COMPUTE, t);
+        return;
+    }
+
+    if (bt->group) {
+        c->deferred[c->deferred_n++] = (unsigned)i;
+        return;
+    }
+
+    uint64_t t = stats_begin();
+    en->status = compute_value(&en->d, bt->fixed);
+    stats_end(STAGE_COMPUTE, t);
+}
+
+// checks the parsed int entries of the chunk in one pass over their
+// columns, then sends those that passed to the kernel columns or computes
+// them; errors are rendered with the rest at output time
+static void chunk_check(Batch* bt)
+{
+    ChunkT<int>* c = (ChunkT<int>*)bt->chunk;
+
+    unsigned* idx[KERNEL_LISTS];
+    for (int col = 0; col < KERNEL_OPS; ++col) idx[col] = c->cols[col].idx;
+    idx[KERNEL_LIST_OTHER] = c->checked;
+    idx[KERNEL_LIST_FAILED] = c->failed;
+
+    uint64_t t = stats_begin();
+    size_t counts[KERNEL_LISTS];
+    bt->kernels->check(c->args[0], c->args[1], c->ops, c->n, c->status, idx,
+                       counts);
+
+    // usage errors and RPN lines are in failed too, with their own status
+    for (size_t j = 0; j < counts[KERNEL_LIST_FAILED]; ++j) {
+        EntryT<int>* en = &c->entries[c->failed[j]];
+        if (en->status == calc::STATUS_OK && !en->rpn) {
+            en->status = (calc::Status)c->status[c->failed[j]];
+        }
+    }
+    stats_end(STAGE_CHECK, t, c->n);
+
+    for (int col = 0; col < KERNEL_OPS; ++col) {
+        Column* k = &c->cols[col];
+        k->n = counts[col];
+        for (size_t j = 0; j < k->n; ++j) {
+            k->a[j] = c->args[0][k->idx[j]];
+            k->b[j] = c->args[1][k->idx[j]];
+        }
+    }
+
+    for (size_t j = 0; j < counts[KERNEL_LIST_OTHER]; ++j) {
+        chunk_compute_entry(bt, c, c->checked[j]);
+    }
+}
+
+// runs the kernel of column col of T
+template <typename T>
+static void column_run(const KernelSet* ks, int col, ColumnT<T>* k)
+{
+    if constexpr (std::is_same<T, int>::value) {
+        kernels_op(ks, col)(k->a, k->b, k->result, k->status, k->n);
+    } else if constexpr (std::is_floating_point<T>::value) {
+        kernels_real_op(ks, col)(k->a, k->b, k->result, k->status, k->n);
+    } else if constexpr (std::is_same<T, int64_t>::value) {
+        kernels_fixed_op(ks, col)(k->a, k->b, k->result, k->status, k->n);
+    }
+}
+
+// int kernels give mathlib codes, the others a calc::Status
+template <typename T>
+static calc::Status column_status(int st)
+{
+    if constexpr (std::is_same<T, int>::value) {
+        return calc::status_from_math(st);
+    }
+
+    return (calc::Status)st;
+}
+
+// runs the column kernels and writes the chunk out in input order
+template <typename T>
+static void chunk_flush(Batch* bt)
+{
+    ChunkT<T>* c = (ChunkT<T>*)bt->chunk;
+
+    if (bt->program) {
+        chunk_run_program<T>(bt);
+    } else if constexpr (std::is_same<T, int>::value) {
+        chunk_check(bt);
+    }
+    if (c->deferred_n != 0) chunk_compute_grouped(bt, c);
+
+    for (int col = 0; col < KERNEL_OPS; ++col) {
+        ColumnT<T>* k = &c->cols[col];
+        if (k->n == 0) continue;
+
+        uint64_t t = stats_begin();
+        column_run(bt->kernels, col, k);
+
+        for (size_t i = 0; i < k->n; ++i) {
+            EntryT<T>* en = &c->entries[k->idx[i]];
+            en->d.result = k->result[i];
+            en->status = column_status<T>(k->status[i]);
+        }
+        stats_end(STAGE_COMPUTE, t, k->n);
+
+        k->n = 0;
+    }
+
+    for (size_t i = 0; i < c->n; ++i) {
+        const EntryT<T>* en = &c->entries[i];
+
+        // a usage error may have been cut short before its op was read
+        stats_count(en->status == calc::STATUS_USAGE ? 0 : en->d.op,
+                    en->status);
+
+        uint64_t t = stats_begin();
+        batch_status(bt, print_entry(bt, en));
+        stats_end(STAGE_OUTPUT, t);
+    }
+
+    if (bt->metrics) {
+        uint64_t ns = metrics_now() - bt->arrived;
+        for (size_t i = 0; i < c->n; ++i) {
+            const EntryT<T>* en = &c->entries[i];
+            char op = en->status == calc::STATUS_USAGE ? '?' : en->d.op;
+            metrics_request(bt->metrics, op, en->status, ns);
+        }
+    }
+
+    c->n = 0;
+}
+
+static calc::Status load_entry(const Batch* bt, CalcData* d, const char* b,
+                               const char* e, int* rpn)
+{
+    if (bt->format == FORMAT_BIN) {
+        *rpn = 0;
+        load_record(d, b);
+        return calc::STATUS_OK;
+    }
+
+    return load_line(d, b, e, rpn, -1);
+}
+
+// --format bin is 32-bit only
+template <typename T>
+static calc::Status load_entry(const Batch* bt, calc::CalcDataT<T>* d,
+                               const char* b, const char* e, int* rpn)
+{
+    return load_line(d, b, e, rpn, bt->fixed);
+}
+
+// parses one line or record into the chunk; a wider T is also checked
+// straight away and computed or queued for its kernel, see chunk_check()
+// for int
+template <typename T>
+static void chunk_push(Batch* bt, const char* b, const char* e)
+{
+    ChunkT<T>* c = (ChunkT<T>*)bt->chunk;
+    if (c->n == BATCH_CHUNK) chunk_flush<T>(bt);
+
+    EntryT<T>* en = &c->entries[c->n];
+    en->b = b;
+    en->e = e;
+
+    // --program lines are only split here and all run at flush time
+    if (bt->program) {
+        en->d.op = 0;
+        en->rpn = 0;
+
+        uint64_t t = stats_begin();
+        en->status =
+            load_args(bt->program, b, e, &c->args[0][c->n], BATCH_CHUNK);
+        stats_end(STAGE_PARSE, t);
+
+        c->n++;
+        return;
+    }
+
+    en->status = load_entry(bt, &en->d, b, e, &en->rpn);
+    c->n++;
+
+    int parsed = en->status == calc::STATUS_OK && !en->rpn;
+
+    // int entries are checked a chunk at a time as columns
+    if constexpr (std::is_same<T, int>::value) {
+        size_t i = c->n - 1;
+        c->args[0][i] = parsed ? en->d.a : 0;
+        c->args[1][i] = parsed ? en->d.b : 0;
+        c->ops[i] = parsed ? en->d.op : 0;
+        return;
+    }
+
+    if (!parsed) return;
+
+    uint64_t t = stats_begin();
+    en->status = calc::check(&en->d);
+    stats_end(STAGE_CHECK, t);
+
+    if (en->status == calc::STATUS_OK) chunk_compute_entry<T>(bt, c, c->n - 1);
+}
+
+template <typename T>
+static void* memo_alloc(size_t slots)
+{
+    return memo_open<T>(slots);
+}
+
+template <typename T>
+static void memo_free(void* memo, uint64_t* hits, uint64_t* misses)
+{
+    MemoCache<T>* c = (MemoCache<T>*)memo;
+    if (!c) return;
+
+    *hits += c->hits;
+    *misses += c->misses;
+    memo_close(c);
+}
+
+template <typename T>
+static void memo_counts(const void* memo, uint64_t* hits, uint64_t* misses)
+{
+    const MemoCache<T>* c = (const MemoCache<T>*)memo;
+
+    *hits = c ? c->hits : 0;
+    *misses = c ? c->misses : 0;
+}
+
+template <typename T>
+static calc::Status program_compile(Program* pg, int* pos)
+{
+    calc::RpnProgramT<T>* p = (calc::RpnProgramT<T>*)(void*)&pg->code;
+
+    calc::Status st = calc::rpn_compile(pg->toks, pg->n, p, pos);
+    if (st == calc::STATUS_OK) calc::rpn_optimize(p);
+    pg->args = p->args;
+
+    return st;
+}
+
+template <typename T>
+static const ChunkOps CHUNK_OPS = {chunk_alloc<T>,  chunk_push<T>,
+                                   chunk_flush<T>,  memo_alloc<T>,
+                                   memo_free<T>,    memo_counts<T>,
+                                   program_compile<T>};
+
+// return: the chunk functions for the --width, or --real
+static const ChunkOps* chunk_ops(const Options* o)
+{
+    if (o->real) return &CHUNK_OPS<double>;
+
+    switch (o->width) {
+    case 64:
+        return &CHUNK_OPS<int64_t>;
+#if CALC_HAVE_INT128
+    case 128:
+        return &CHUNK_OPS<calc::int128>;
+#endif
+    default:
+        return &CHUNK_OPS<int>;
+    }
+}
+
+// return: 0 - ok; 1 - bad header
+static int check_bin_header(const char* p)
+{
+    if (memcmp(p, "CALQ", 4) != 0) {
+        print_error("not a binary request stream");
+        return 1;
+    }
+
+    unsigned version = get_u16(p + 4);
+    if (version == 0 || version > BIN_VERSION) {
+        print_error("unsupported binary version: %u", version);
+        return 1;
+    }
+
+    if (get_u16(p + 6) != BIN_REQUEST_SIZE) {
+        print_error("unexpected binary record size: %u", get_u16(p + 6));
+        return 1;
+    }
+
+    return 0;
+}
+
+// evaluates every complete record in [b, e); return: start of the trailing
+// partial record
+static const char* evaluate_records(Batch* bt, const char* b, const char* e)
+{
+    if (!bt->header_seen) {
+        if ((size_t)(e - b) < BIN_HEADER_SIZE) return b;
+
+        // stream-level errors go to stderr even though records are silent
+        Output* saved = err_out;
+        err_out = &std_err;
+        int hrc = check_bin_header(b);
+        err_out = saved;
+
+        bt->header_seen = 1;
+        if (hrc != 0) {
+            bt->stopped = 1;
+            batch_status(bt, 1);
+            return e;
+        }
+        b += BIN_HEADER_SIZE;
+    }
+
+    while ((size_t)(e - b) >= BIN_REQUEST_SIZE) {
+        bt->ops->push(bt, b, b + BIN_REQUEST_SIZE);
+        b += BIN_REQUEST_SIZE;
+    }
+
+    return b;
+}
+
+// evaluates every complete line in [b, e); return: start of the trailing
+// partial line
+static const char* evaluate_lines(Batch* bt, const char* b, const char* e)
+{
+    for (;;) {
+        const char* nl = (const char*)memchr(b, '\n', (size_t)(e - b));
+        if (!nl) return b;
+
+        bt->ops->push(bt, b, nl);
+
+        b = nl + 1;
+    }
+}
+
+// return: start of the unconsumed tail of [b, e); everything before it has
+// been written out, so the caller may reuse that part of the buffer
+static const char* batch_block(Batch* bt, const char* b, const char* e)
+{
+    if (bt->stopped) return e;
+
+    const char* tail = (bt->format == FORMAT_BIN) ? evaluate_records(bt, b, e)
+                                                  : evaluate_lines(bt, b, e);
+    bt->ops->flush(bt);
+
+    return tail;
+}
+
+// handles what is left once the input is exhausted
+static void batch_finish(Batch* bt, const char* b, const char* e)
+{
+    if (bt->stopped) return;
+
+    if (bt->format == FORMAT_TEXT) {
+        // last line without a trailing newline
+        if (b != e) {
+            bt->ops->push(bt, b, e);
+            bt->ops->flush(bt);
+        }
+        return;
+    }
+
+    // stream-level errors go to stderr even though records are silent
+    Output* saved = err_out;
+    err_out = &std_err;
+
+    if (!bt->header_seen) {
+        print_error("missing binary header");
+        batch_status(bt, 1);
+    } else if (b != e) {
+        print_error("truncated binary record");
+        batch_status(bt, 1);
+    }
+
+    err_out = saved;
+}
+
+static const size_t BATCH_BLOCK_SIZE = 1 << 20;
+
+// return: 1 - fd has input that read() returns without waiting
+static int input_ready(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// return: 0 - ok; -1 - read error (errno set)
+static int evaluate_stream(Batch* bt, int fd)
+{
+    size_t cap = BATCH_BLOCK_SIZE;
+    char* buf = (char*)malloc(cap);
+    if (!buf) return -1;
+
+    int rc = 0;
+    size_t len = 0;
+    for (;;) {
+        if (len == cap) {
+            // a single line longer than the buffer
+            char* grown = (char*)realloc(buf, cap * 2);
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+
+        ssize_t got = read(fd, buf + len, cap - len);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+
+        if (got == 0) {
+            batch_finish(bt, buf, buf + len);
+            break;
+        }
+
+        len += (size_t)got;
+
+        const char* tail = batch_block(bt, buf, buf + len);
+        len -= (size_t)(tail - buf);
+        memmove(buf, tail, len);
+
+        // a pipe that is slow to fill still gets its results promptly
+        if (!input_ready(fd)) out_flush(res_out);
+    }
+
+    int saved = errno;
+    free(buf);
+    errno = saved;
+
+    return rc;
+}
+
+// maps the size bytes of the regular file fd into *map
+// return: 0 - ok; 1 - read it like a pipe instead; -1 - map error (errno
+// set)
+static int input_map(int fd, size_t size, const char** map)
+{
+    // procfs, sysfs and some FUSE files report a size of 0 but have data,
+    // and some refuse mmap
+    if (size == 0) return 1;
+
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return (errno == ENODEV) ? 1 : -1;
+
+    *map = (const char*)p;
+
+    return 0;
+}
+
+// return: 0 - ok; -1 - map or read error (errno set)
+static int evaluate_mapped(Batch* bt, int fd, size_t size)
+{
+    const char* b;
+    int rc = input_map(fd, size, &b);
+    if (rc != 0) return (rc > 0) ? evaluate_stream(bt, fd) : -1;
+
+    madvise((void*)b, size, MADV_SEQUENTIAL);
+
+    const char* e = b + size;
+    batch_finish(bt, batch_block(bt, b, e), e);
+
+    munmap((void*)b, size);
+
+    return 0;
+}
+
+// records are loaded quietly; print_entry() renders messages later
+// return: the err_out to put back once the records are done
+static Output* quiet_records()
+{
+    Output* saved = err_out;
+    err_out = nullptr;
+
+    return saved;
+}
+
+// return: initial size of the buffer for the results of in input bytes
+static size_t result_hint(size_t in)
+{
+    // results are usually a few times longer than the input lines
+    return in * 4 + 1024;
+}
+
+// what a batch worker hands back besides its output
+struct RunStats
+{
+    int worst;
+    uint64_t hits; // --cache
+    uint64_t misses;
+    Stats stats;   // --stats
+};
+
+static void print_memo_stats(const RunStats* rs)
+{
+    char buf[96];
+    int n = snprintf(buf, sizeof(buf), "cache: %llu hits, %llu misses\n",
+                     (unsigned long long)rs->hits,
+                     (unsigned long long)rs->misses);
+    if (n > 0) out_write(&std_err, buf, (size_t)n);
+}
+
+// a slice of the input, evaluated by one worker into its own buffer
+struct Job
+{
+    const char* b;
+    const char* e;
+    int last; // holds the end of the input, and any partial line or record
+    Output out;
+};
+
+// evaluates job into job->out, which it opens
+// return: 0 - ok; -1 - out of memory for the results
+static int job_run(Batch* bt, Job* job)
+{
+    size_t hint = result_hint((size_t)(job->e - job->b));
+    if (out_open_mem(&job->out, hint) != 0) return -1;
+
+    res_out = &job->out;
+    if (bt->format == FORMAT_TEXT) bt->err = res_out;
+
+    const char* tail = batch_block(bt, job->b, job->e);
+    if (job->last) batch_finish(bt, tail, job->e);
+
+    return 0;
+}
+
+// a worker's share of the jobs: the owner takes from the front, idle
+// workers steal from the back
+struct JobQueue
+{
+    std::mutex m;
+    size_t head;
+    size_t tail;
+};
+
+struct Pool
+{
+    Batch proto; // settings every worker starts from
+    size_t memo_slots;
+    Stats* stats; // the caller's, for the workers to be merged into
+    Job* jobs;    // in the caller's arena, like queues
+    size_t job_n;
+    JobQueue* queues;
+    size_t queue_n;
+};
+
+// return: 1 - *job is set; 0 - no work left anywhere
+static int take_job(Pool* p, size_t self, size_t* job)
+{
+    size_t n = p->queue_n;
+
+    for (size_t k = 0; k < n; ++k) {
+        JobQueue* q = &p->queues[(self + k) % n];
+        std::lock_guard<std::mutex> lock(q->m);
+
+        if (q->head == q->tail) continue;
+
+        *job = (k == 0) ? q->head++ : --q->tail;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void run_worker(Pool* p, size_t self, Batch* bt)
+{
+    Output* saved_res = res_out;
+    Output* saved_err = quiet_records();
+
+    size_t j;
+    while (take_job(p, self, &j)) job_run(bt, &p->jobs[j]);
+
+    res_out = saved_res;
+    err_out = saved_err;
+}
+
+// gives a worker of bt its own memo where bt has one; memos are per
+// worker, a shared one would need locking on every hit
+static void worker_memo_open(Batch* bt, size_t slots)
+{
+    if (bt->memo) bt->memo = bt->ops->memo_open(slots);
+}
+
+// out: worst status, memo and --stats counters of this worker
+static void run_thief(Pool* p, size_t self, RunStats* out)
+{
+    Batch bt = p->proto;
+
+    Arena arena;
+    arena_open(&arena);
+    bt.arena = &arena;
+
+    bt.chunk = bt.ops->alloc(&arena);
+    if (!bt.chunk) {
+        arena_close(&arena);
+        return; // the other workers steal this one's share
+    }
+
+    worker_memo_open(&bt, p->memo_slots);
+
+    if (p->stats) stats_attach(&out->stats);
+    run_worker(p, self, &bt);
+    stats_attach(nullptr);
+
+    out->worst = bt.worst;
+    bt.ops->memo_close(bt.memo, &out->hits, &out->misses);
+    arena_close(&arena);
+}
+
+// evaluates [b, e) on threads workers, in jobs of about block bytes, and
+// writes the results to res_out in input order
+static void evaluate_parallel(Batch* bt, const char* b, const char* e,
+                              int threads, size_t block, size_t memo_slots,
+                              RunStats* ms)
+{
+    if (bt->format == FORMAT_BIN) {
+        if ((size_t)(e - b) < BIN_HEADER_SIZE) {
+            batch_finish(bt, b, e);
+            return;
+        }
+
+        evaluate_records(bt, b, b + BIN_HEADER_SIZE);
+        if (bt->stopped) return;
+        b += BIN_HEADER_SIZE;
+    }
+
+    // every job has at least job_size bytes but the last; the lists live
+    // until the end of this batch
+    Arena* arena = bt->arena;
+    size_t mark = arena_mark(arena);
+
+    size_t job_size = block;
+    if (bt->format == FORMAT_BIN) {
+        job_size = (block + BIN_REQUEST_SIZE - 1) / BIN_REQUEST_SIZE *
+                   BIN_REQUEST_SIZE;
+    }
+    size_t job_max = (size_t)(e - b) / job_size + 1;
+    size_t workers = (size_t)threads;
+
+    Pool p;
+    p.proto = *bt;
+    p.memo_slots = memo_slots;
+    p.stats = stats_current();
+    p.jobs = (Job*)arena_alloc(arena, job_max * sizeof(Job));
+    p.job_n = 0;
+    p.queues = (JobQueue*)arena_alloc(arena, workers * sizeof(JobQueue));
+    RunStats* stats = (RunStats*)arena_alloc(arena, workers * sizeof(RunStats));
+    if (!p.jobs || !p.queues || !stats) {
+        arena_reset(arena, mark);
+        err_out = &std_err;
+        print_error("out of memory");
+        err_out = nullptr;
+        batch_status(bt, 2);
+        return;
+    }
+
+    // split at line or record boundaries
+    while (b != e) {
+        const char* je = e;
+        if ((size_t)(e - b) > job_size) {
+            je = b + job_size;
+            if (bt->format == FORMAT_TEXT) {
+                const char* nl = (const char*)memchr(je, '\n', (size_t)(e - je));
+                je = nl ? nl + 1 : e;
+            }
+        }
+
+        Job* job = &p.jobs[p.job_n++];
+        job->b = b;
+        job->e = je;
+        job->last = (je == e);
+        job->out.base = nullptr;
+
+        b = je;
+    }
+
+    if (workers > p.job_n) workers = p.job_n ? p.job_n : 1;
+
+    p.queue_n = workers;
+    for (size_t w = 0; w < workers; ++w) {
+        new (&p.queues[w]) JobQueue();
+        p.queues[w].head = w * p.job_n / workers;
+        p.queues[w].tail = (w + 1) * p.job_n / workers;
+        new (&stats[w]) RunStats();
+    }
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers);
+    for (size_t w = 1; w < workers; ++w) {
+        pool.emplace_back(run_thief, &p, w, &stats[w]);
+    }
+
+    run_worker(&p, 0, bt);
+
+    for (auto& t : pool) t.join();
+
+    for (size_t w = 0; w < workers; ++w) {
+        batch_status(bt, stats[w].worst);
+        ms->hits += stats[w].hits;
+        ms->misses += stats[w].misses;
+        if (p.stats) stats_merge(p.stats, &stats[w].stats);
+        p.queues[w].~JobQueue();
+    }
+
+    for (size_t j = 0; j < p.job_n; ++j) {
+        Job* job = &p.jobs[j];
+        if (job->out.failed) {
+            err_out = &std_err;
+            print_error("out of memory");
+            err_out = nullptr;
+            batch_status(bt, 2);
+        } else {
+            out_write(res_out, job->out.base, job->out.len);
+        }
+        out_close(&job->out);
+    }
+
+    arena_reset(arena, mark);
+}
+
+// an input block of evaluate_piped(), and its results once evaluated
+struct Block
+{
+    char* buf;
+    size_t cap;
+    Job job; // [b, e) of buf, then the results in out
+};
+
+// the stages of evaluate_piped(): the reader fills block k and hands it to
+// evaluator k % workers, which hands it on to the writer, which writes the
+// results in block order and hands the block back to the reader. Nothing
+// is buffered outside the blocks, so memory stays flat however long the
+// input is, and a writer held up by stdout stops the reader as soon as
+// the free ring is empty
+struct Pipe
+{
+    Batch proto; // settings every evaluator starts from
+    size_t memo_slots;
+    Stats* stats;
+    Block* blocks;
+    size_t block_n;
+    SpscRing* todo; // reader to evaluator, one per evaluator
+    SpscRing* done; // evaluator to writer, one per evaluator
+    SpscRing* free; // writer to reader
+    size_t workers;
+    Output* out;
+    std::atomic<size_t> total; // blocks handed out; final once eof is set
+    std::atomic<int> eof;
+    std::atomic<int> stop; // the output has failed, read no more
+    int worst;             // the writer's
+};
+
+// every ring has room for every block, so a push never waits
+static void pipe_push(SpscRing* r, Block* k)
+{
+    unsigned round = 0;
+    while (!ring_push(r, k)) ring_backoff(&round);
+}
+
+// return: the next block from r, or nullptr once eof is set and r is empty
+static Block* pipe_pop(Pipe* p, SpscRing* r)
+{
+    unsigned round = 0;
+    for (;;) {
+        Block* k = (Block*)ring_pop(r);
+        if (k) return k;
+
+        // eof is set after the last push, so look once more
+        if (p->eof.load(std::memory_order_acquire)) return (Block*)ring_pop(r);
+
+        ring_backoff(&round);
+    }
+}
+
+// out: worst status, memo and --stats counters of evaluator self
+static void pipe_evaluate(Pipe* p, size_t self, RunStats* out)
+{
+    Batch bt = p->proto;
+
+    Arena arena;
+    arena_open(&arena);
+    bt.arena = &arena;
+    bt.chunk = bt.ops->alloc(&arena);
+
+    worker_memo_open(&bt, p->memo_slots);
+
+    // the reader takes the binary header off the first block
+    bt.header_seen = 1;
+
+    if (p->stats) stats_attach(&out->stats);
+    quiet_records();
+
+    Block* k;
+    while ((k = pipe_pop(p, &p->todo[self])) != nullptr) {
+        Job* job = &k->job;
+        if (!bt.chunk || job_run(&bt, job) != 0) {
+            job->out = {-1, nullptr, 0, 0, OUT_MEM, ENOMEM};
+        }
+
+        pipe_push(&p->done[self], k);
+    }
+
+    stats_attach(nullptr);
+
+    out->worst = bt.worst;
+    bt.ops->memo_close(bt.memo, &out->hits, &out->misses);
+    arena_close(&arena);
+}
+
+// writes out the results of every block in order, and flushes whenever the
+// next block is not ready, so that a slow input still gets its results
+static void pipe_write(Pipe* p)
+{
+    for (size_t k = 0;; ++k) {
+        SpscRing* r = &p->done[k % p->workers];
+
+        // the evaluators may still hold blocks once the reader is done
+        Block* blk;
+        unsigned round = 0;
+        while (!(blk = (Block*)ring_pop(r))) {
+            if (p->eof.load(std::memory_order_acquire) &&
+                k == p->total.load(std::memory_order_relaxed)) {
+                return;
+            }
+            if (round == 0 && out_flush(p->out) != 0) p->stop.store(1);
+            ring_backoff(&round);
+        }
+
+        Output* o = &blk->job.out;
+        if (o->failed) {
+            print_error("out of memory");
+            if (p->worst < 2) p->worst = 2;
+        } else {
+            out_write(p->out, o->base, o->len);
+        }
+        out_close(o);
+
+        if (p->out->failed) p->stop.store(1);
+
+        pipe_push(p->free, blk);
+    }
+}
+
+// return: the end of the last whole line or record in [b, e)
+static const char* block_cut(const Batch* bt, const char* b, const char* e)
+{
+    size_t n = (size_t)(e - b);
+
+    if (bt->format == FORMAT_BIN) {
+        return b + n / BIN_REQUEST_SIZE * BIN_REQUEST_SIZE;
+    }
+
+    const char* nl = (const char*)memrchr(b, '\n', n);
+
+    return nl ? nl + 1 : b;
+}
+
+// return: 0 - ok; -1 - out of memory
+static int block_reserve(Block* k, size_t n)
+{
+    if (k->cap >= n) return 0;
+
+    size_t cap = k->cap;
+    while (cap < n) cap *= 2;
+
+    char* grown = (char*)realloc(k->buf, cap);
+    if (!grown) return -1;
+
+    k->buf = grown;
+    k->cap = cap;
+
+    return 0;
+}
+
+// hands [start, end) of k to the next evaluator
+static void pipe_send(Pipe* p, size_t* sent, Block* k, size_t start,
+                      size_t end, int last)
+{
+    k->job.b = k->buf + start;
+    k->job.e = k->buf + end;
+    k->job.last = last;
+
+    pipe_push(&p->todo[*sent % p->workers], k);
+    ++*sent;
+}
+
+// the reader: cuts fd into blocks at line or record boundaries until the
+// input ends, the header is bad or the output has failed; a block goes
+// out once it is full or nothing more is ready to be read
+// return: 0 - ok; -1 - read error (errno set)
+static int pipe_read(Pipe* p, Batch* bt, int fd)
+{
+    size_t sent = 0;
+    size_t start = 0; // the first record of k, past any binary header
+    size_t len = 0;
+    int rc = 0;
+
+    Block* k = (Block*)ring_pop(p->free);
+    while (!p->stop.load(std::memory_order_relaxed)) {
+        // a single line longer than the block
+        if (len == k->cap && block_reserve(k, k->cap * 2) != 0) {
+            errno = ENOMEM;
+            rc = -1;
+            break;
+        }
+
+        ssize_t got = read(fd, k->buf + len, k->cap - len);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+
+        int end = (got == 0);
+        len += (size_t)got;
+        if (!end && len < k->cap && input_ready(fd)) continue;
+
+        if (bt->format == FORMAT_BIN && !bt->header_seen) {
+            if (len < BIN_HEADER_SIZE) {
+                if (!end) continue;
+                batch_finish(bt, k->buf, k->buf + len);
+                break;
+            }
+
+            evaluate_records(bt, k->buf, k->buf + BIN_HEADER_SIZE);
+            if (bt->stopped) break;
+            start = BIN_HEADER_SIZE;
+        }
+
+        if (end) {
+            pipe_send(p, &sent, k, start, len, 1);
+            break;
+        }
+
+        size_t cut = (size_t)(block_cut(bt, k->buf + start, k->buf + len) -
+                              k->buf);
+        if (cut == start) continue;
+
+        // the partial line or record after cut starts the next block
+        Block* next;
+        unsigned round = 0;
+        while (!(next = (Block*)ring_pop(p->free))) {
+            if (p->stop.load(std::memory_order_relaxed)) break;
+            ring_backoff(&round);
+        }
+        if (!next) break;
+
+        // next is not handed back: only pipe_write() pushes to free, and
+        // evaluate_piped() frees every block's buffer at the end anyway
+        if (block_reserve(next, len - cut) != 0) {
+            errno = ENOMEM;
+            rc = -1;
+            break;
+        }
+        memcpy(next->buf, k->buf + cut, len - cut);
+
+        pipe_send(p, &sent, k, start, cut, 0);
+
+        k = next;
+        len -= cut;
+        start = 0;
+    }
+
+    p->total.store(sent, std::memory_order_relaxed);
+    p->eof.store(1, std::memory_order_release);
+
+    return rc;
+}
+
+// evaluates fd, which read() streams, on threads evaluators in blocks of
+// o->block bytes with at most o->queue of them per evaluator, and writes
+// the results to res_out in input order as they are ready; see Pipe
+// return: 0 - ok; -1 - read error (errno set)
+static int evaluate_piped(Batch* bt, int fd, int threads, const Options* o,
+                          RunStats* ms)
+{
+    Arena* arena = bt->arena;
+    size_t mark = arena_mark(arena);
+
+    size_t workers = (size_t)threads;
+
+    // one more block for the reader to fill and one to carry its tail to
+    size_t block_n = workers * (size_t)o->queue + 2;
+    size_t cap = ring_capacity(block_n);
+    size_t rings = 2 * workers + 1;
+
+    Pipe* p = (Pipe*)arena_alloc(arena, sizeof(Pipe));
+    void** slots = (void**)arena_alloc(arena, rings * cap * sizeof(void*));
+    SpscRing* ring = (SpscRing*)arena_alloc(arena, rings * sizeof(SpscRing));
+    Block* blocks = (Block*)arena_alloc(arena, block_n * sizeof(Block));
+    RunStats* stats = (RunStats*)arena_alloc(arena, workers * sizeof(RunStats));
+
+    size_t made = 0;
+    if (p && slots && ring && blocks && stats) {
+        for (; made < block_n; ++made) {
+            blocks[made].cap = (size_t)o->block;
+            blocks[made].buf = (char*)malloc(blocks[made].cap);
+            if (!blocks[made].buf) break;
+        }
+    }
+
+    if (made != block_n) {
+        for (size_t i = 0; i < made; ++i) free(blocks[i].buf);
+        arena_reset(arena, mark);
+        err_out = &std_err;
+        print_error("out of memory");
+        err_out = nullptr;
+        batch_status(bt, 2);
+        return 0;
+    }
+
+    new (p) Pipe();
+    p->proto = *bt;
+    p->memo_slots = (size_t)o->cache;
+    p->stats = stats_current();
+    p->blocks = blocks;
+    p->block_n = block_n;
+    p->workers = workers;
+    p->out = res_out;
+    p->total.store(0);
+    p->eof.store(0);
+    p->stop.store(0);
+    p->worst = 0;
+
+    for (size_t r = 0; r < rings; ++r) {
+        new (&ring[r]) SpscRing();
+        ring_open(&ring[r], slots + r * cap, cap);
+    }
+    p->todo = ring;
+    p->done = ring + workers;
+    p->free = ring + 2 * workers;
+
+    for (size_t i = 0; i < block_n; ++i) ring_push(p->free, &blocks[i]);
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers + 1);
+    for (size_t w = 0; w < workers; ++w) {
+        new (&stats[w]) RunStats();
+        pool.emplace_back(pipe_evaluate, p, w, &stats[w]);
+    }
+    pool.emplace_back(pipe_write, p);
+
+    int rc = pipe_read(p, bt, fd);
+    int saved = errno;
+
+    for (auto& t : pool) t.join();
+
+    batch_status(bt, p->worst);
+    for (size_t w = 0; w < workers; ++w) {
+        batch_status(bt, stats[w].worst);
+        ms->hits += stats[w].hits;
+        ms->misses += stats[w].misses;
+        if (p->stats) stats_merge(p->stats, &stats[w].stats);
+    }
+
+    for (size_t i = 0; i < block_n; ++i) free(blocks[i].buf);
+    for (size_t r = 0; r < rings; ++r) ring[r].~SpscRing();
+    p->~Pipe();
+    arena_reset(arena, mark);
+
+    errno = saved;
+
+    return rc;
+}
+
+// return: 0 - ok; -1 - read error (errno set)
+static int evaluate_threaded(Batch* bt, int fd, int mappable, size_t size,
+                             int threads, const Options* o, RunStats* ms)
+{
+    const char* b;
+    int rc = mappable ? input_map(fd, size, &b) : 1;
+    if (rc < 0) return -1;
+
+    if (rc == 0) {
+        evaluate_parallel(bt, b, b + size, threads, (size_t)o->block,
+                          (size_t)o->cache, ms);
+        munmap((void*)b, size);
+        return 0;
+    }
+
+    // pipes, sockets and the rest may never end, so they are streamed
+    return evaluate_piped(bt, fd, threads, o, ms);
+}
+
+// chunk must come from chunk_ops(o)->alloc(arena)
+static void batch_init(Batch* bt, const Options* o, void* chunk, Arena* arena)
+{
+    bt->chunk = chunk;
+    bt->arena = arena;
+    bt->ops = chunk_ops(o);
+    bt->memo = nullptr;
+    bt->program = o->compiled;
+    bt->kernels = o->kernels ? o->kernels : kernels_best();
+    bt->err = nullptr;
+    bt->metrics = nullptr;
+    bt->arrived = 0;
+    bt->format = o->format;
+    bt->bigint = o->bigint;
+    bt->group = o->group;
+    bt->fixed = o->fixed;
+    bt->header_seen = 0;
+    bt->stopped = 0;
+    bt->worst = 0;
+}
+
+// return: worst per-line status, same codes as a single invocation
+static int run_batch(const Options* o)
+{
+    Arena arena;
+    arena_open(&arena);
+
+    Batch bt;
+    batch_init(&bt, o, chunk_ops(o)->alloc(&arena), &arena);
+    if (!bt.chunk) {
+        print_error("out of memory");
+        arena_close(&arena);
+        return 2;
     }
 
-    if (d->op == '/' && d->b == 0) {
-        print_error("division by zero");
-        return 2;
+    int in = STDIN_FILENO;
+    if (o->input) {
+        in = open(o->input, O_RDONLY);
+        if (in < 0) {
+            print_error("cannot open %s: %s", o->input, strerror(errno));
+            arena_close(&arena);
+            return 2;
+        }
     }
 
-    return 0;
+    struct stat st;
+    int mappable = (fstat(in, &st) == 0 && S_ISREG(st.st_mode));
+
+    Output out;
+    if (o->output) {
+        // untouched pages of the sparse file cost nothing
+        size_t hint = BATCH_BLOCK_SIZE;
+        if (mappable) hint += result_hint((size_t)st.st_size);
+
+        if (out_open(&out, o->output, hint) != 0) {
+            print_error("cannot open %s: %s", o->output, strerror(errno));
+            arena_close(&arena);
+            if (in != STDIN_FILENO) close(in);
+            return 2;
+        }
+        res_out = &out;
+    }
+
+    // binary results carry a status byte instead of an error message
+    if (bt.format == FORMAT_BIN) {
+        print_bin_header();
+    } else {
+        bt.err = res_out;
+    }
+
+    // the memo is only a shortcut, so without memory for it go without
+    RunStats rs = {};
+    if (o->cache) bt.memo = bt.ops->memo_open((size_t)o->cache);
+
+    Output* saved_err = quiet_records();
+
+    int rc;
+    if (o->threads != 1) {
+        int threads = o->threads;
+        if (threads == 0) threads = (int)std::thread::hardware_concurrency();
+        if (threads < 1) threads = 1;
+
+        rc = evaluate_threaded(&bt, in, mappable, (size_t)st.st_size, threads,
+                               o, &rs);
+    } else if (mappable) {
+        rc = evaluate_mapped(&bt, in, (size_t)st.st_size);
+    } else {
+        rc = evaluate_stream(&bt, in);
+    }
+
+    err_out = saved_err;
+
+    if (rc != 0) {
+        print_error("read failed: %s", strerror(errno));
+        bt.worst = 2;
+    }
+
+    if (res_out == &out) {
+        res_out = &std_out;
+        if (out_close(&out) != 0) {
+            print_error("write failed: %s: %s", o->output, strerror(errno));
+            bt.worst = 2;
+        }
+    }
+
+    bt.ops->memo_close(bt.memo, &rs.hits, &rs.misses);
+    if (o->cache) print_memo_stats(&rs);
+
+    arena_close(&arena);
+    if (in != STDIN_FILENO) close(in);
+
+    return bt.worst;
 }
 
-// return: 0 - ok; 2 - runtime error
-static int calculate(CalcData* d)
+// a client of --serve; requests are evaluated as soon as they are complete,
+// so any number of them may be in flight on one connection
+struct Conn
 {
-    int rc = mathlib::MATH_OK;
+    int fd;
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    Output out; // results not yet sent
+    size_t sent;
+    Batch bt;
+    int eof;
+    unsigned events;
+    Conn* prev; // the list of open connections, closed on the way out
+    Conn* next;
+};
 
-    switch (d->op) {
-    case '+':
-        rc = mathlib::math_add(d->a, d->b, &d->result);
-        break;
-    case '-':
-        rc = mathlib::math_sub(d->a, d->b, &d->result);
-        break;
-    case 'x':
-        rc = mathlib::math_mul(d->a, d->b, &d->result);
-        break;
-    case '/':
-        rc = mathlib::math_div(d->a, d->b, &d->result);
-        break;
-    case '^':
-        rc = mathlib::math_pow(d->a, d->b, &d->result);
-        break;
-    case '!':
-        rc = mathlib::math_fact(d->a, &d->result);
-        break;
-    default:
+static const size_t SERVE_READ_SIZE = 64 << 10;
+
+// stop reading from a client that does not read its results
+static const size_t SERVE_OUT_HIGH_WATER = 4 << 20;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void on_stop_signal(int)
+{
+    serve_stop = 1;
+}
+
+// addr is unix:PATH or tcp:[HOST:]PORT; return: listening socket, or -1
+static int listen_on(const char* addr)
+{
+    int fd = -1;
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        const char* path = addr + 5;
+
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+            print_error("socket path too long: %s", path);
+            return -1;
+        }
+        strcpy(sa.sun_path, path);
+
+        // replace a stale socket, but never any other kind of file
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+            print_error("cannot bind %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    } else if (strncmp(addr, "tcp:", 4) == 0) {
+        char host[256];
+        const char* port = strrchr(addr + 4, ':');
+        const char* node = nullptr;
+
+        if (port) {
+            size_t n = (size_t)(port - (addr + 4));
+            if (n >= sizeof(host)) {
+                print_error("host name too long: %s", addr + 4);
+                return -1;
+            }
+            memcpy(host, addr + 4, n);
+            host[n] = '\0';
+            node = host;
+            ++port;
+        } else {
+            port = addr + 4;
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        struct addrinfo* res = nullptr;
+        int gai = getaddrinfo(node, port, &hints, &res);
+        if (gai != 0) {
+            print_error("cannot resolve %s: %s", addr + 4, gai_strerror(gai));
+            return -1;
+        }
+
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family,
+                        ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+            if (fd < 0) continue;
+
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            print_error("cannot bind %s: %s", addr + 4, strerror(errno));
+            return -1;
+        }
+    } else {
+        print_error("listen address must be unix:PATH or tcp:[HOST:]PORT: %s",
+                    addr);
+        return -1;
+    }
+
+    if (fd < 0 || listen(fd, SOMAXCONN) != 0) {
+        print_error("cannot listen on %s: %s", addr, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void conn_link(Conn** head, Conn* c)
+{
+    c->prev = nullptr;
+    c->next = *head;
+    if (*head) (*head)->prev = c;
+    *head = c;
+}
+
+static void conn_unlink(Conn** head, Conn* c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        *head = c->next;
+    }
+    if (c->next) c->next->prev = c->prev;
+}
+
+static void conn_close(Conn* c)
+{
+    close(c->fd);
+    out_close(&c->out);
+    free(c->in);
+    free(c);
+}
+
+static size_t conn_pending(const Conn* c)
+{
+    return c->out.len - c->sent;
+}
+
+// return: 0 - keep the connection; -1 - it is done or broken
+static int conn_send(Conn* c)
+{
+    while (conn_pending(c) != 0) {
+        ssize_t put = send(c->fd, c->out.base + c->sent, conn_pending(c),
+                           MSG_NOSIGNAL);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->sent += (size_t)put;
+    }
+
+    c->out.len = 0;
+    c->sent = 0;
+
+    if (c->out.failed) return -1;
+
+    return (c->eof || c->bt.stopped) ? -1 : 0;
+}
+
+// evaluates whatever complete requests arrived; return: see conn_send()
+static int conn_read(Conn* c)
+{
+    res_out = &c->out;
+
+    while (!c->eof && conn_pending(c) < SERVE_OUT_HIGH_WATER) {
+        if (c->in_cap - c->in_len < SERVE_READ_SIZE) {
+            // only a line longer than the buffer keeps it from draining
+            size_t cap = c->in_cap ? c->in_cap * 2 : SERVE_READ_SIZE * 2;
+            char* grown = (char*)realloc(c->in, cap);
+            if (!grown) {
+                res_out = &std_out;
+                return -1;
+            }
+            c->in = grown;
+            c->in_cap = cap;
+        }
+
+        ssize_t got = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            res_out = &std_out;
+            return -1;
+        }
+
+        if (got == 0) {
+            c->eof = 1;
+            batch_finish(&c->bt, c->in, c->in + c->in_len);
+            c->in_len = 0;
+            break;
+        }
+
+        c->in_len += (size_t)got;
+        if (c->bt.metrics) c->bt.arrived = metrics_now();
+
+        const char* tail = batch_block(&c->bt, c->in, c->in + c->in_len);
+        c->in_len -= (size_t)(tail - c->in);
+        memmove(c->in, tail, c->in_len);
+    }
+
+    res_out = &std_out;
+
+    return conn_send(c);
+}
+
+// return: 0 - ok; -1 - epoll_ctl failed
+static int conn_update(int ep, Conn* c)
+{
+    unsigned want = 0;
+    if (!c->eof && conn_pending(c) < SERVE_OUT_HIGH_WATER) want |= EPOLLIN;
+    if (conn_pending(c) != 0) want |= EPOLLOUT;
+
+    if (want == c->events) return 0;
+
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.ptr = c;
+    c->events = want;
+
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// links new connections into *head; return: connections added
+static size_t conn_accept(int ep, int lfd, const Options* o, void* chunk,
+                          Arena* arena, void* memo, MetricsShard* metrics,
+                          Conn** head)
+{
+    size_t added = 0;
+
+    for (;;) {
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return added;
+
+        Conn* c = (Conn*)calloc(1, sizeof(Conn));
+        if (!c || out_open_mem(&c->out, SERVE_READ_SIZE) != 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->events = EPOLLIN;
+
+        // the event loop is single-threaded and batch_block() always
+        // leaves the chunk empty, so every connection shares one, and the
+        // memo with it
+        batch_init(&c->bt, o, chunk, arena);
+        c->bt.memo = memo;
+        c->bt.metrics = metrics;
+        if (o->format == FORMAT_BIN) {
+            res_out = &c->out;
+            print_bin_header();
+            res_out = &std_out;
+            c->events |= EPOLLOUT;
+        } else {
+            c->bt.err = &c->out;
+        }
+
+        struct epoll_event ev;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            conn_close(c);
+            continue;
+        }
+        conn_link(head, c);
+        added++;
+    }
+}
+
+// bytes of c that --metrics counts as queued
+static size_t conn_queued(const Conn* c)
+{
+    return c->in_len + conn_pending(c);
+}
+
+// answers one scrape on fd; anything but GET /metrics gets a 404
+static void metrics_answer(int fd, const MetricsShard* shards, size_t n,
+                           uint64_t start)
+{
+    // a scraper that stalls only holds up the next scrape
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char req[4096];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        ssize_t got = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+
+        len += (size_t)got;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    req[len] = '\0';
+
+    static const char PATH[] = "GET /metrics";
+    const size_t path_len = sizeof(PATH) - 1;
+    int found = (strncmp(req, PATH, path_len) == 0 &&
+                 (req[path_len] == ' ' || req[path_len] == '?'));
+
+    std::string body = found ? metrics_render(shards, n, metrics_now() - start)
+                             : std::string("not found\n");
+
+    char head[256];
+    int hn = snprintf(head, sizeof(head),
+                      "HTTP/1.1 %s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %zu\r\n"
+                      "Connection: close\r\n\r\n",
+                      found ? "200 OK" : "404 Not Found",
+                      found ? "application/openmetrics-text; version=1.0.0; "
+                              "charset=utf-8"
+                            : "text/plain",
+                      body.size());
+
+    std::string resp(head, (size_t)hn);
+    resp += body;
+
+    size_t sent = 0;
+    while (sent < resp.size()) {
+        ssize_t put =
+            send(fd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) break;
+        sent += (size_t)put;
+    }
+}
+
+// the --metrics thread: answers scrapes one at a time from the shards'
+// relaxed loads until wake becomes readable
+static void metrics_serve(int lfd, int wake, const MetricsShard* shards,
+                          size_t n, uint64_t start)
+{
+    struct pollfd fds[2];
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        if (fds[1].revents != 0) return;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+
+        metrics_answer(fd, shards, n, start);
+        close(fd);
+    }
+}
+
+// the socket file of a unix: listen address, removed on the way out
+static void unlink_listen_path(const char* addr)
+{
+    if (strncmp(addr, "unix:", 5) == 0) unlink(addr + 5);
+}
+
+// return: 0 - stopped by SIGINT/SIGTERM; 2 - could not serve
+static int run_serve(const Options* o)
+{
+    Arena arena;
+    arena_open(&arena);
+
+    void* chunk = chunk_ops(o)->alloc(&arena);
+    if (!chunk) {
+        print_error("out of memory");
+        arena_close(&arena);
+        return 2;
+    }
+
+    // the requests of one round of events are its batch
+    size_t mark = arena_mark(&arena);
+
+    int lfd = listen_on(o->serve);
+    if (lfd < 0) {
+        arena_close(&arena);
         return 2;
     }
 
-    if (rc != mathlib::MATH_OK) {
-        print_math_error(rc);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev) != 0) {
+        print_error("epoll: %s", strerror(errno));
+        if (ep >= 0) close(ep);
+        close(lfd);
+        arena_close(&arena);
         return 2;
     }
 
+    sigset_t stop, saved;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+
+    // the event loop is the one worker, so there is one shard
+    MetricsShard* metrics = nullptr;
+    int mfd = -1;
+    int wake[2] = {-1, -1};
+    std::thread scraper;
+    if (o->metrics) {
+        metrics = new (std::nothrow) MetricsShard();
+        mfd = listen_on(o->metrics);
+        if (!metrics || mfd < 0 || pipe2(wake, O_CLOEXEC) != 0) {
+            if (!metrics) {
+                print_error("out of memory");
+            } else if (mfd >= 0) {
+                print_error("pipe: %s", strerror(errno));
+            }
+            if (mfd >= 0) {
+                close(mfd);
+                unlink_listen_path(o->metrics);
+            }
+            delete metrics;
+            close(ep);
+            close(lfd);
+            unlink_listen_path(o->serve);
+            arena_close(&arena);
+            return 2;
+        }
+
+        // SIGINT and SIGTERM must reach this thread's epoll_pwait()
+        pthread_sigmask(SIG_BLOCK, &stop, &saved);
+        scraper = std::thread(metrics_serve, mfd, wake[0], metrics, (size_t)1,
+                              metrics_now());
+        pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // the stop signals are let in only during epoll_pwait(), so one that
+    // arrives just after serve_stop is checked still ends the wait
+    pthread_sigmask(SIG_BLOCK, &stop, &saved);
+
+    const ChunkOps* ops = chunk_ops(o);
+    void* memo = o->cache ? ops->memo_open((size_t)o->cache) : nullptr;
+
+    Output* saved_err = quiet_records();
+
+    int rc = 0;
+    Conn* open_conns = nullptr;
+    size_t conns = 0;
+    size_t queued = 0;
+    struct epoll_event events[64];
+    while (!serve_stop) {
+        int n = epoll_pwait(ep, events, 64, -1, &saved);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_out = saved_err;
+            print_error("epoll: %s", strerror(errno));
+            rc = 2;
+            break;
+        }
+
+        uint64_t busy = metrics ? metrics_now() : 0;
+
+        for (int i = 0; i < n; ++i) {
+            Conn* c = (Conn*)events[i].data.ptr;
+            if (!c) {
+                conns += conn_accept(ep, lfd, o, chunk, &arena, memo,
+                                     metrics, &open_conns);
+                continue;
+            }
+
+            queued -= conn_queued(c);
+
+            int crc = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                crc = conn_read(c);
+            } else if (events[i].events & EPOLLOUT) {
+                crc = conn_send(c);
+            }
+
+            if (crc != 0 || conn_update(ep, c) != 0) {
+                conn_unlink(&open_conns, c);
+                conn_close(c);
+                conns--;
+            } else {
+                queued += conn_queued(c);
+            }
+        }
+        arena_reset(&arena, mark);
+
+        if (metrics) {
+            uint64_t hits, misses;
+            ops->memo_counts(memo, &hits, &misses);
+            metrics_set(&metrics->cache_hits, hits);
+            metrics_set(&metrics->cache_misses, misses);
+            metrics_set(&metrics->connections, conns);
+            metrics_set(&metrics->queued_bytes, queued);
+            metrics_add(&metrics->busy_ns, metrics_now() - busy);
+        }
+    }
+
+    // open connections are dropped; their results so far have been sent
+    // as far as the clients read them
+    while (open_conns) {
+        Conn* c = open_conns;
+        open_conns = c->next;
+        conn_close(c);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+
+    err_out = saved_err;
+    close(ep);
+    close(lfd);
+    unlink_listen_path(o->serve);
+    arena_close(&arena);
+
+    if (metrics) {
+        // the scraper sees the hangup and returns
+        close(wake[1]);
+        scraper.join();
+        close(wake[0]);
+        close(mfd);
+        unlink_listen_path(o->metrics);
+        delete metrics;
+    }
+
+    RunStats rs = {};
+    rs.worst = rc;
+    ops->memo_close(memo, &rs.hits, &rs.misses);
+    if (o->cache) print_memo_stats(&rs);
+
+    return rc;
+}
+
+template <typename T>
+static int run_rpn(const Options* o, const char* prog)
+{
+    int n = o->operand_count;
+    Token toks[RPN_TOKENS_MAX];
+
+    for (int i = 0; i < n && i < RPN_TOKENS_MAX; ++i) {
+        toks[i].b = o->operands[i];
+        toks[i].e = toks[i].b + strlen(toks[i].b);
+    }
+
+    T result;
+    uint64_t t = stats_begin();
+    calc::Status st = eval_rpn(toks, n, &result, o->fixed);
+    stats_end(STAGE_COMPUTE, t);
+    stats_count(0, st);
+
+    if (st != calc::STATUS_OK) {
+        int rc = calc::status_exit_code(st);
+        if (rc == 1) print_help(prog);
+        return rc;
+    }
+
+    t = stats_begin();
+    print_rpn_result(toks, n, result, o->fixed);
+    stats_end(STAGE_OUTPUT, t);
+
     return 0;
 }
 
-static int run(int argc, char** argv)
+// one expression from the command line, in T arithmetic
+template <typename T>
+static int run_single(const Options* o, const char* prog)
 {
-    CalcData d;
-    int want_help = 0;
+    if (o->operand_count > 3) return run_rpn<T>(o, prog);
 
-    int prc = parse(&d, argc, argv, &want_help);
-    if (want_help) {
-        print_help(argv[0]);
-        return 0;
+    calc::CalcDataT<T> d;
+    int n = o->operand_count;
+    Token args[3];
+
+    for (int i = 0; i < n && i < 3; ++i) {
+        args[i].b = o->operands[i];
+        args[i].e = args[i].b + strlen(args[i].b);
     }
 
-    if (prc != 0) {
-        print_help(argv[0]);
+    uint64_t t = stats_begin();
+    if (parse_operands(&d, n, args, o->fixed) != 0) {
+        stats_count(0, calc::STATUS_USAGE);
+        print_help(prog);
         return 1;
     }
 
-    switch (check(&d)) {
+    t = stats_lap(STAGE_PARSE, t);
+    calc::Status st = calc::check(&d);
+    stats_end(STAGE_CHECK, t);
+    stats_count(d.op, st);
+    if (st != calc::STATUS_OK) print_status(st);
+
+    switch (calc::status_exit_code(st)) {
     case 0:
         break;
     case 1:
-        print_help(argv[0]);
+        print_help(prog);
         return 1;
     case 2:
         return 2;
@@ -303,18 +3393,143 @@ static int run(int argc, char** argv)
         return 2;
     }
 
-    int calc_rc = calculate(&d);
-    if (calc_rc != 0) {
-        return 2;
+    t = stats_begin();
+    st = compute_value(&d, o->fixed);
+    stats_end(STAGE_COMPUTE, t);
+
+    if constexpr (!std::is_floating_point<T>::value) {
+        if (st == calc::STATUS_OVERFLOW && o->bigint &&
+            print_bigint_result(&d, (MemoCache<T>*)nullptr) == 0) {
+            return 0;
+        }
     }
 
-    print_result(&d);
+    if (st != calc::STATUS_OK) {
+        print_status(st);
+        return calc::status_exit_code(st);
+    }
+
+    t = stats_begin();
+    print_result(&d, o->fixed);
+    stats_end(STAGE_OUTPUT, t);
 
     return 0;
 }
 
+// return: 0 - ok; 1 - bad --program, reported
+static int program_open(Program* pg, const Options* o)
+{
+    const char* src = o->program;
+    pg->n = tokenize(src, src + strlen(src), pg->toks, RPN_TOKENS_MAX);
+    if (pg->n > RPN_TOKENS_MAX) {
+        print_error("--program: too many tokens, at most %d", RPN_TOKENS_MAX);
+        return 1;
+    }
+
+    int pos = 0;
+    calc::Status st = chunk_ops(o)->compile(pg, &pos);
+    if (st == calc::STATUS_OK) return 0;
+
+    const Token* t = &pg->toks[pos];
+    if (st == calc::STATUS_USAGE) {
+        print_error("--program: not %s or $1..$%d: %.*s",
+                    o->real ? "a number" : "an integer", calc::RPN_ARGS_MAX,
+                    token_len(t), t->b);
+    } else if (pos == pg->n) {
+        print_error("--program: %s", calc::status_message(st));
+    } else {
+        print_error("--program: %s at token %d: %.*s",
+                    calc::status_message(st), pos + 1, token_len(t), t->b);
+    }
+
+    return 1;
+}
+
+// return: 0 - ok; 1 - usage error; 2 - runtime error
+static int run_mode(const Options* o, const char* prog)
+{
+    if (o->serve) return run_serve(o);
+    if (o->batch) return run_batch(o);
+    if (o->real) return run_single<double>(o, prog);
+
+    switch (o->width) {
+    case 64:
+        return run_single<int64_t>(o, prog);
+#if CALC_HAVE_INT128
+    case 128:
+        return run_single<calc::int128>(o, prog);
+#endif
+    default:
+        return run_single<int>(o, prog);
+    }
+}
+
+// the --stats JSON line; stage ticks are converted at the rate they ran at
+// over the whole run, since wall and t0
+static void print_stats(const Stats* s,
+                        std::chrono::steady_clock::time_point wall,
+                        uint64_t t0)
+{
+    uint64_t ns = (uint64_t)std::chrono::duration_cast<
+                      std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - wall)
+                      .count();
+    uint64_t ticks = stats_begin() - t0;
+
+    std::string json =
+        stats_json(s, ns, ticks ? (double)ns / (double)ticks : 0.0);
+    out_write(&std_err, json.data(), json.size());
+}
+
+static int run(int argc, char** argv)
+{
+    Options o;
+
+    int prc = parse(argc, argv, &o);
+    if (o.help) {
+        print_help(argv[0]);
+        return 0;
+    }
+
+    if (prc != 0) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    Program pg;
+    if (o.program) {
+        if (program_open(&pg, &o) != 0) {
+            print_help(argv[0]);
+            return 1;
+        }
+        o.compiled = &pg;
+    }
+
+    if (!o.stats) return run_mode(&o, argv[0]);
+
+    static Stats stats;
+    stats_attach(&stats);
+
+    auto wall = std::chrono::steady_clock::now();
+    uint64_t t = stats_begin();
+
+    int rc = run_mode(&o, argv[0]);
+
+    print_stats(&stats, wall, t);
+    stats_attach(nullptr);
+
+    return rc;
+}
+
 int main(int argc, char** argv)
 {
-    return run(argc, argv);
+    int rc = run(argc, argv);
+
+    if (out_flush(&std_out) != 0) {
+        print_error("write failed: %s", strerror(errno));
+        if (rc == 0) rc = 2;
+    }
+
+    return rc;
 }
 
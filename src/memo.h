@@ -0,0 +1,205 @@
+#pragma once
+
+#include "calculator.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// Memo of computed expressions for batch and server mode, keyed on the
+// operands and op. Fixed-width results live in 64-byte lines of slots; a
+// key only probes its own line and, when that is full, evicts the slot its
+// hash picks. --bigint digits go to a small direct-mapped side table.
+// Not thread-safe: each batch worker has its own.
+
+static const size_t MEMO_LINE = 64;
+
+// bigint results longer than this are recomputed rather than kept; with
+// at most MEMO_BIG_SLOTS_MAX of them the side table stays under 64 MiB
+static const size_t MEMO_BIG_MAX_DIGITS = 1 << 14;
+static const size_t MEMO_BIG_SLOTS_MAX = 4096;
+
+template <typename T>
+struct MemoSlot
+{
+    T a;
+    T b;
+    T result;
+    char op; // 0 - empty
+    uint8_t status;
+};
+
+template <typename T>
+struct MemoBigSlot
+{
+    T a;
+    T b;
+    char op; // 0 - empty
+    std::string digits;
+};
+
+template <typename T>
+struct MemoCache
+{
+    static const size_t WAYS = MEMO_LINE / sizeof(MemoSlot<T>);
+
+    struct alignas(MEMO_LINE) Line
+    {
+        MemoSlot<T> slots[WAYS];
+    };
+
+    Line* lines;
+    size_t mask; // line count - 1
+    std::vector<MemoBigSlot<T>> big; // sized on first use
+    size_t big_slots;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+template <typename T>
+static uint64_t memo_fold(T v)
+{
+    if constexpr (sizeof(T) > sizeof(uint64_t)) {
+        return (uint64_t)v ^ (uint64_t)(v >> 64);
+    } else {
+        return (uint64_t)(int64_t)v;
+    }
+}
+
+template <typename T>
+static uint64_t memo_hash(T a, T b, char op)
+{
+    uint64_t h = memo_fold(a) * 0x9e3779b97f4a7c15ull;
+    h ^= memo_fold(b) + 0x632be59bd9b4e019ull + (h << 6) + (h >> 2);
+    h ^= (uint64_t)(unsigned char)op;
+
+    // murmur3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// slots is rounded up to whole lines and a power of two of them
+// return: the memo, or nullptr when out of memory
+template <typename T>
+static MemoCache<T>* memo_open(size_t slots)
+{
+    size_t lines = 1;
+    while (lines * MemoCache<T>::WAYS < slots) lines *= 2;
+
+    MemoCache<T>* c = new (std::nothrow) MemoCache<T>();
+    if (!c) return nullptr;
+
+    size_t size = lines * sizeof(typename MemoCache<T>::Line);
+    c->lines = (typename MemoCache<T>::Line*)aligned_alloc(MEMO_LINE, size);
+    if (!c->lines) {
+        delete c;
+        return nullptr;
+    }
+
+    memset((void*)c->lines, 0, size);
+    c->mask = lines - 1;
+
+    c->big_slots = 1;
+    while (c->big_slots < slots / 4 && c->big_slots < MEMO_BIG_SLOTS_MAX) {
+        c->big_slots *= 2;
+    }
+
+    c->hits = 0;
+    c->misses = 0;
+
+    return c;
+}
+
+template <typename T>
+static void memo_close(MemoCache<T>* c)
+{
+    if (!c) return;
+
+    free(c->lines);
+    delete c;
+}
+
+// return: 1 - hit, d->result and *status are set; 0 - miss
+template <typename T>
+static int memo_find(MemoCache<T>* c, calc::CalcDataT<T>* d,
+                     calc::Status* status)
+{
+    uint64_t h = memo_hash(d->a, d->b, d->op);
+    MemoSlot<T>* s = c->lines[h & c->mask].slots;
+
+    for (size_t i = 0; i < MemoCache<T>::WAYS; ++i) {
+        if (s[i].op == d->op && s[i].a == d->a && s[i].b == d->b) {
+            d->result = s[i].result;
+            *status = (calc::Status)s[i].status;
+            c->hits++;
+            return 1;
+        }
+    }
+
+    c->misses++;
+
+    return 0;
+}
+
+template <typename T>
+static void memo_store(MemoCache<T>* c, const calc::CalcDataT<T>* d,
+                       calc::Status status)
+{
+    uint64_t h = memo_hash(d->a, d->b, d->op);
+    MemoSlot<T>* s = c->lines[h & c->mask].slots;
+
+    size_t way = (size_t)(h >> 32) % MemoCache<T>::WAYS;
+    for (size_t i = 0; i < MemoCache<T>::WAYS; ++i) {
+        if (s[i].op == 0) {
+            way = i;
+            break;
+        }
+    }
+
+    s[way].a = d->a;
+    s[way].b = d->b;
+    s[way].result = d->result;
+    s[way].op = d->op;
+    s[way].status = (uint8_t)status;
+}
+
+// return: the kept digits of d, or nullptr on a miss
+template <typename T>
+static const std::string* memo_find_big(MemoCache<T>* c,
+                                        const calc::CalcDataT<T>* d)
+{
+    if (c->big.empty()) c->big.resize(c->big_slots);
+
+    MemoBigSlot<T>* s =
+        &c->big[memo_hash(d->a, d->b, d->op) & (c->big_slots - 1)];
+    if (s->op == d->op && s->a == d->a && s->b == d->b) {
+        c->hits++;
+        return &s->digits;
+    }
+
+    c->misses++;
+
+    return nullptr;
+}
+
+template <typename T>
+static void memo_store_big(MemoCache<T>* c, const calc::CalcDataT<T>* d,
+                           const std::string& digits)
+{
+    if (digits.size() > MEMO_BIG_MAX_DIGITS) return;
+
+    MemoBigSlot<T>* s =
+        &c->big[memo_hash(d->a, d->b, d->op) & (c->big_slots - 1)];
+    s->a = d->a;
+    s->b = d->b;
+    s->op = d->op;
+    s->digits = digits;
+}
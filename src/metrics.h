@@ -0,0 +1,367 @@
+#pragma once
+
+#include "calculator.h"
+#include "stats.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <time.h>
+
+// --metrics: counters of the server, scraped as OpenMetrics text. Each
+// thread that serves requests owns one shard and is its only writer; the
+// scraping thread only loads, so neither side takes a lock and the hot
+// path does plain relaxed stores.
+
+typedef std::atomic<uint64_t> MetricsCounter;
+
+// latency is kept per op: the six ops, RPN lines and --program rows, and
+// anything else (usage errors, unknown ops)
+enum
+{
+    METRICS_OP_RPN = 6,
+    METRICS_OP_OTHER,
+    METRICS_OPS,
+};
+
+static const char* const METRICS_OP_NAMES[METRICS_OPS] = {
+    "+", "-", "x", "/", "^", "!", "rpn", "other"};
+
+// bucket b holds latencies up to 2^(b + 8) ns, 256 ns to about 1 s; the
+// last one is +Inf
+static const int METRICS_BUCKETS = 24;
+static const int METRICS_BUCKET_SHIFT = 8;
+
+// mathlib error each status comes from, for the code label; the ones that
+// never reach mathlib keep their own name
+static const char* const METRICS_STATUS_CODES[STATS_STATUSES] = {
+    "MATH_OK",
+    "USAGE",
+    "UNKNOWN_OP",
+    "NOT_UNARY",
+    "MATH_ERR_DIV_BY_ZERO",
+    "MATH_ERR_OVERFLOW",
+    "MATH_ERR_INVALID_ARG",
+    "MATH_ERR_INVALID_ARG",
+    "MATH_ERR_INVALID_ARG",
+    "MATH_ERR",
+    "MISSING_OPERAND",
+    "EXTRA_OPERAND",
+    "STACK_FULL",
+};
+
+struct alignas(64) MetricsShard
+{
+    MetricsCounter latency[METRICS_OPS][METRICS_BUCKETS];
+    MetricsCounter latency_ns[METRICS_OPS]; // sum
+    MetricsCounter status[STATS_STATUSES];
+    MetricsCounter cache_hits;
+    MetricsCounter cache_misses;
+    MetricsCounter busy_ns; // handling events rather than waiting for them
+
+    // gauges
+    MetricsCounter connections;
+    MetricsCounter queued_bytes; // read but not answered, or not yet sent
+};
+
+static inline uint64_t metrics_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// only the owning thread may call these on its shard
+static inline void metrics_add(MetricsCounter* c, uint64_t v)
+{
+    c->store(c->load(std::memory_order_relaxed) + v,
+             std::memory_order_relaxed);
+}
+
+static inline void metrics_set(MetricsCounter* c, uint64_t v)
+{
+    c->store(v, std::memory_order_relaxed);
+}
+
+static inline int metrics_op(char op)
+{
+    switch (op) {
+    case '+':
+        return 0;
+    case '-':
+        return 1;
+    case 'x':
+        return 2;
+    case '/':
+        return 3;
+    case '^':
+        return 4;
+    case '!':
+        return 5;
+    case 0:
+        return METRICS_OP_RPN;
+    default:
+        return METRICS_OP_OTHER;
+    }
+}
+
+// one request of op answered with st, ns after it arrived
+static inline void metrics_request(MetricsShard* m, char op, calc::Status st,
+                                   uint64_t ns)
+{
+    int b = 0;
+    if (ns > 1) b = 64 - __builtin_clzll(ns - 1) - METRICS_BUCKET_SHIFT;
+    if (b < 0) b = 0;
+    if (b >= METRICS_BUCKETS) b = METRICS_BUCKETS - 1;
+
+    int k = metrics_op(op);
+    metrics_add(&m->latency[k][b], 1);
+    metrics_add(&m->latency_ns[k], ns);
+    metrics_add(&m->status[st < STATS_STATUSES ? st : calc::STATUS_MATH_ERROR],
+                1);
+}
+
+static inline uint64_t metrics_load(const MetricsCounter* c)
+{
+    return c->load(std::memory_order_relaxed);
+}
+
+static void metrics_u64(std::string* out, uint64_t v)
+{
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v);
+    out->append(buf, (size_t)n);
+}
+
+static void metrics_f64(std::string* out, double v)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.9g", v);
+    out->append(buf, (size_t)n);
+}
+
+static double metrics_bucket_le(int b)
+{
+    return (double)((uint64_t)1 << (b + METRICS_BUCKET_SHIFT)) * 1e-9;
+}
+
+// return: the q quantile of n latencies in hist, interpolated within its
+// bucket as histogram_quantile() does; the +Inf bucket reports its lower
+// bound
+static double metrics_quantile(const uint64_t* hist, uint64_t n, double q)
+{
+    double rank = q * (double)n;
+    uint64_t below = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; ++b) {
+        if (hist[b] == 0 || (double)(below + hist[b]) < rank) {
+            below += hist[b];
+            continue;
+        }
+
+        if (b == METRICS_BUCKETS - 1) return metrics_bucket_le(b - 1);
+
+        double lo = b ? metrics_bucket_le(b - 1) : 0.0;
+        double hi = metrics_bucket_le(b);
+        return lo + (hi - lo) * (rank - (double)below) / (double)hist[b];
+    }
+
+    return 0.0;
+}
+
+static void metrics_family(std::string* out, const char* name,
+                           const char* type, const char* help)
+{
+    *out += "# TYPE ";
+    *out += name;
+    *out += ' ';
+    *out += type;
+    *out += "\n# HELP ";
+    *out += name;
+    *out += ' ';
+    *out += help;
+    *out += '\n';
+}
+
+// return: the shards summed and rendered as OpenMetrics text; uptime_ns is
+// how long the server has been running
+static std::string metrics_render(const MetricsShard* shards, size_t n,
+                                  uint64_t uptime_ns)
+{
+    uint64_t hist[METRICS_OPS][METRICS_BUCKETS] = {};
+    uint64_t sum_ns[METRICS_OPS] = {};
+    uint64_t status[STATS_STATUSES] = {};
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t conns = 0;
+    uint64_t queued = 0;
+
+    for (size_t s = 0; s < n; ++s) {
+        const MetricsShard* m = &shards[s];
+        for (int k = 0; k < METRICS_OPS; ++k) {
+            for (int b = 0; b < METRICS_BUCKETS; ++b) {
+                hist[k][b] += metrics_load(&m->latency[k][b]);
+            }
+            sum_ns[k] += metrics_load(&m->latency_ns[k]);
+        }
+        for (int i = 0; i < STATS_STATUSES; ++i) {
+            status[i] += metrics_load(&m->status[i]);
+        }
+        hits += metrics_load(&m->cache_hits);
+        misses += metrics_load(&m->cache_misses);
+        conns += metrics_load(&m->connections);
+        queued += metrics_load(&m->queued_bytes);
+    }
+
+    uint64_t count[METRICS_OPS] = {};
+    uint64_t requests = 0;
+    for (int k = 0; k < METRICS_OPS; ++k) {
+        for (int b = 0; b < METRICS_BUCKETS; ++b) count[k] += hist[k][b];
+        requests += count[k];
+    }
+
+    std::string out;
+
+    metrics_family(&out, "calculator_requests", "counter",
+                   "Requests answered.");
+    out += "calculator_requests_total ";
+    metrics_u64(&out, requests);
+    out += '\n';
+
+    metrics_family(&out, "calculator_request_duration_seconds", "histogram",
+                   "Time from a request arriving to its answer being "
+                   "written, by op.");
+    for (int k = 0; k < METRICS_OPS; ++k) {
+        uint64_t cum = 0;
+        for (int b = 0; b < METRICS_BUCKETS; ++b) {
+            cum += hist[k][b];
+            out += "calculator_request_duration_seconds_bucket{op=\"";
+            out += METRICS_OP_NAMES[k];
+            out += "\",le=\"";
+            if (b == METRICS_BUCKETS - 1) {
+                out += "+Inf";
+            } else {
+                metrics_f64(&out, metrics_bucket_le(b));
+            }
+            out += "\"} ";
+            metrics_u64(&out, cum);
+            out += '\n';
+        }
+
+        out += "calculator_request_duration_seconds_count{op=\"";
+        out += METRICS_OP_NAMES[k];
+        out += "\"} ";
+        metrics_u64(&out, count[k]);
+        out += "\ncalculator_request_duration_seconds_sum{op=\"";
+        out += METRICS_OP_NAMES[k];
+        out += "\"} ";
+        metrics_f64(&out, (double)sum_ns[k] * 1e-9);
+        out += '\n';
+    }
+
+    // the same data again as a summary, for dashboards that want p50, p99
+    // and p999 without histogram_quantile()
+    static const double QUANTILES[] = {0.5, 0.99, 0.999};
+    metrics_family(&out, "calculator_request_latency_seconds", "summary",
+                   "Quantiles of calculator_request_duration_seconds, by "
+                   "op.");
+    for (int k = 0; k < METRICS_OPS; ++k) {
+        if (count[k] == 0) continue;
+
+        for (double q : QUANTILES) {
+            out += "calculator_request_latency_seconds{op=\"";
+            out += METRICS_OP_NAMES[k];
+            out += "\",quantile=\"";
+            metrics_f64(&out, q);
+            out += "\"} ";
+            metrics_f64(&out, metrics_quantile(hist[k], count[k], q));
+            out += '\n';
+        }
+
+        out += "calculator_request_latency_seconds_count{op=\"";
+        out += METRICS_OP_NAMES[k];
+        out += "\"} ";
+        metrics_u64(&out, count[k]);
+        out += "\ncalculator_request_latency_seconds_sum{op=\"";
+        out += METRICS_OP_NAMES[k];
+        out += "\"} ";
+        metrics_f64(&out, (double)sum_ns[k] * 1e-9);
+        out += '\n';
+    }
+
+    metrics_family(&out, "calculator_errors", "counter",
+                   "Failed requests, by mathlib error code and status.");
+    for (int i = 1; i < STATS_STATUSES; ++i) {
+        out += "calculator_errors_total{code=\"";
+        out += METRICS_STATUS_CODES[i];
+        out += "\",status=\"";
+        out += STATUS_KEYS[i];
+        out += "\"} ";
+        metrics_u64(&out, status[i]);
+        out += '\n';
+    }
+
+    metrics_family(&out, "calculator_cache_hits", "counter",
+                   "--cache lookups that found the result.");
+    out += "calculator_cache_hits_total ";
+    metrics_u64(&out, hits);
+    out += '\n';
+
+    metrics_family(&out, "calculator_cache_misses", "counter",
+                   "--cache lookups that did not.");
+    out += "calculator_cache_misses_total ";
+    metrics_u64(&out, misses);
+    out += '\n';
+
+    metrics_family(&out, "calculator_cache_hit_ratio", "gauge",
+                   "Hits over lookups since the start.");
+    out += "calculator_cache_hit_ratio ";
+    metrics_f64(&out,
+                hits + misses ? (double)hits / (double)(hits + misses) : 0.0);
+    out += '\n';
+
+    metrics_family(&out, "calculator_connections", "gauge",
+                   "Open client connections.");
+    out += "calculator_connections ";
+    metrics_u64(&out, conns);
+    out += '\n';
+
+    metrics_family(&out, "calculator_queue_bytes", "gauge",
+                   "Request bytes not yet answered and answer bytes not yet "
+                   "sent.");
+    out += "calculator_queue_bytes ";
+    metrics_u64(&out, queued);
+    out += '\n';
+
+    metrics_family(&out, "calculator_worker_busy_seconds", "counter",
+                   "Time each worker spent handling events.");
+    for (size_t s = 0; s < n; ++s) {
+        out += "calculator_worker_busy_seconds_total{worker=\"";
+        metrics_u64(&out, s);
+        out += "\"} ";
+        metrics_f64(&out, (double)metrics_load(&shards[s].busy_ns) * 1e-9);
+        out += '\n';
+    }
+
+    metrics_family(&out, "calculator_worker_utilization", "gauge",
+                   "Busy time over uptime, by worker.");
+    for (size_t s = 0; s < n; ++s) {
+        out += "calculator_worker_utilization{worker=\"";
+        metrics_u64(&out, s);
+        out += "\"} ";
+        metrics_f64(&out, uptime_ns ? (double)metrics_load(&shards[s].busy_ns) /
+                                          (double)uptime_ns
+                                    : 0.0);
+        out += '\n';
+    }
+
+    metrics_family(&out, "calculator_uptime_seconds", "gauge",
+                   "Time since the server started.");
+    out += "calculator_uptime_seconds ";
+    metrics_f64(&out, (double)uptime_ns * 1e-9);
+    out += "\n# EOF\n";
+
+    return out;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <time.h>
+
+// Bounded lock-free ring of pointers between two threads, one pushing and
+// one popping, for the stages of the batch stream pipeline. Each side owns
+// one index and keeps a copy of the other's, so a push or a pop only reads
+// the other side's cache line when the copy says the ring looks full or
+// empty.
+//
+// Neither side blocks: push and pop fail instead, and the caller waits
+// with ring_backoff(), which spins a little and then sleeps, so that a
+// stage waiting on an idle pipe costs next to no CPU.
+
+static const size_t RING_LINE = 64;
+
+struct SpscRing
+{
+    alignas(RING_LINE) std::atomic<size_t> head; // next slot to pop
+    size_t tail_seen;                            // popper's copy of tail
+    alignas(RING_LINE) std::atomic<size_t> tail; // next slot to push
+    size_t head_seen;                            // pusher's copy of head
+    alignas(RING_LINE) void** slots;
+    size_t mask;
+};
+
+// return: smallest power of two of at least n
+static size_t ring_capacity(size_t n)
+{
+    size_t cap = 1;
+    while (cap < n) cap *= 2;
+
+    return cap;
+}
+
+// slots must hold cap pointers, cap from ring_capacity()
+static void ring_open(SpscRing* r, void** slots, size_t cap)
+{
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail_seen = 0;
+    r->tail.store(0, std::memory_order_relaxed);
+    r->head_seen = 0;
+    r->slots = slots;
+    r->mask = cap - 1;
+}
+
+// pusher only; return: 1 - pushed; 0 - the ring is full
+static int ring_push(SpscRing* r, void* p)
+{
+    size_t t = r->tail.load(std::memory_order_relaxed);
+
+    if (t - r->head_seen > r->mask) {
+        r->head_seen = r->head.load(std::memory_order_acquire);
+        if (t - r->head_seen > r->mask) return 0;
+    }
+
+    r->slots[t & r->mask] = p;
+    r->tail.store(t + 1, std::memory_order_release);
+
+    return 1;
+}
+
+// popper only; return: the oldest pointer, or nullptr if the ring is empty
+static void* ring_pop(SpscRing* r)
+{
+    size_t h = r->head.load(std::memory_order_relaxed);
+
+    if (h == r->tail_seen) {
+        r->tail_seen = r->tail.load(std::memory_order_acquire);
+        if (h == r->tail_seen) return nullptr;
+    }
+
+    void* p = r->slots[h & r->mask];
+    r->head.store(h + 1, std::memory_order_release);
+
+    return p;
+}
+
+// one round of waiting on a full or empty ring; *round counts the rounds
+// of this wait and starts at 0. Sleeps grow to 1 ms, which is also the
+// latency a stage adds once it has been idle that long
+static void ring_backoff(unsigned* round)
+{
+    unsigned n = (*round)++;
+
+    if (n < 64) {
+        std::this_thread::yield();
+        return;
+    }
+
+    unsigned shift = n - 64 < 10 ? n - 64 : 10;
+    struct timespec ts = {0, (long)1000 << shift};
+    nanosleep(&ts, nullptr);
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "calculator.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// --stats: ticks spent in each stage, a log2 histogram of ticks per record
+// for each, and counts per op and per status. Counters are per thread and
+// merged into the main thread's once the workers are done.
+//
+// Built only with CALC_STATS; otherwise every hook below is an empty inline
+// function and the evaluation loops carry no trace of it.
+
+#ifndef CALC_STATS
+#define CALC_STATS 0
+#endif
+
+enum StatStage
+{
+    STAGE_PARSE,
+    STAGE_CHECK,
+    STAGE_COMPUTE,
+    STAGE_OUTPUT,
+    STAGE_COUNT,
+};
+
+static const char* const STAGE_NAMES[STAGE_COUNT] = {"parse", "check",
+                                                     "compute", "output"};
+
+// bucket b counts records that took [2^(b-1), 2^b) ticks; bucket 0 is 0
+static const int STATS_BUCKETS = 48;
+
+static const int STATS_STATUSES = calc::STATUS_STACK_FULL + 1;
+
+// JSON keys of the calc::Status values
+static const char* const STATUS_KEYS[STATS_STATUSES] = {
+    "ok",
+    "usage",
+    "unknown_op",
+    "not_unary",
+    "div_by_zero",
+    "overflow",
+    "invalid_arg",
+    "negative_exp",
+    "negative_fact",
+    "math_error",
+    "missing_operand",
+    "extra_operand",
+    "stack_full",
+};
+
+struct StageStats
+{
+    uint64_t records;
+    uint64_t ticks;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+struct Stats
+{
+    StageStats stages[STAGE_COUNT];
+    uint64_t ops[256]; // by op char; 0 is an RPN line or a --program row
+    uint64_t status[STATS_STATUSES];
+};
+
+#if CALC_STATS
+
+// the counters of this thread, or nullptr when --stats is off
+static thread_local Stats* stats_local = nullptr;
+
+// rdtsc where there is one, steady_clock nanoseconds elsewhere
+static inline uint64_t stats_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+static inline void stats_add(StatStage s, uint64_t ticks, uint64_t records)
+{
+    StageStats* st = &stats_local->stages[s];
+    st->records += records;
+    st->ticks += ticks;
+
+    // records timed together, a kernel column, count at their average
+    uint64_t per = ticks / records;
+    int b = per ? 64 - __builtin_clzll(per) : 0;
+    if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+    st->hist[b] += records;
+}
+
+#endif
+
+// points this thread's hooks at s, or turns them off with nullptr
+// return: the Stats attached before, to put back afterwards
+static inline Stats* stats_attach(Stats* s)
+{
+#if CALC_STATS
+    Stats* prev = stats_local;
+    stats_local = s;
+    return prev;
+#else
+    (void)s;
+    return nullptr;
+#endif
+}
+
+// return: this thread's Stats, or nullptr when --stats is off
+static inline Stats* stats_current()
+{
+#if CALC_STATS
+    return stats_local;
+#else
+    return nullptr;
+#endif
+}
+
+// return: a start time for stats_end(), or 0 when --stats is off
+static inline uint64_t stats_begin()
+{
+#if CALC_STATS
+    return stats_local ? stats_now() : 0;
+#else
+    return 0;
+#endif
+}
+
+// charges the time since t0 to records of stage s
+static inline void stats_end(StatStage s, uint64_t t0, uint64_t records = 1)
+{
+#if CALC_STATS
+    if (t0 != 0 && records != 0) stats_add(s, stats_now() - t0, records);
+#else
+    (void)s;
+    (void)t0;
+    (void)records;
+#endif
+}
+
+// stats_end() of one record of s, and the start time of the next stage
+static inline uint64_t stats_lap(StatStage s, uint64_t t0)
+{
+#if CALC_STATS
+    if (t0 == 0) return 0;
+
+    uint64_t t = stats_now();
+    stats_add(s, t - t0, 1);
+
+    return t;
+#else
+    (void)s;
+    return t0;
+#endif
+}
+
+static inline void stats_count(char op, calc::Status st)
+{
+#if CALC_STATS
+    if (!stats_local) return;
+
+    stats_local->ops[(unsigned char)op]++;
+    stats_local->status[st < STATS_STATUSES ? st : calc::STATUS_MATH_ERROR]++;
+#else
+    (void)op;
+    (void)st;
+#endif
+}
+
+static void stats_merge(Stats* into, const Stats* s)
+{
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        into->stages[i].records += s->stages[i].records;
+        into->stages[i].ticks += s->stages[i].ticks;
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            into->stages[i].hist[b] += s->stages[i].hist[b];
+        }
+    }
+
+    for (int i = 0; i < 256; ++i) into->ops[i] += s->ops[i];
+    for (int i = 0; i < STATS_STATUSES; ++i) into->status[i] += s->status[i];
+}
+
+static void json_u64(std::string* out, uint64_t v)
+{
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v);
+    out->append(buf, (size_t)n);
+}
+
+// return: s as one line of JSON; ns_per_tick converts stage ticks, as
+// measured over the whole run against the wall clock
+static std::string stats_json(const Stats* s, uint64_t wall_ns,
+                              double ns_per_tick)
+{
+    char buf[32];
+    std::string out = "{\"wall_ns\":";
+    json_u64(&out, wall_ns);
+
+    snprintf(buf, sizeof(buf), "%.6g", ns_per_tick);
+    out += ",\"ns_per_tick\":";
+    out += buf;
+
+    out += ",\"stages\":{";
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const StageStats* st = &s->stages[i];
+        if (i != 0) out += ',';
+
+        out += '"';
+        out += STAGE_NAMES[i];
+        out += "\":{\"records\":";
+        json_u64(&out, st->records);
+        out += ",\"ticks\":";
+        json_u64(&out, st->ticks);
+        out += ",\"ns\":";
+        json_u64(&out, (uint64_t)((double)st->ticks * ns_per_tick));
+
+        // [bucket upper bound in ticks, records] of the non-empty buckets
+        out += ",\"hist\":[";
+        int first = 1;
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            if (st->hist[b] == 0) continue;
+            if (!first) out += ',';
+            first = 0;
+
+            out += '[';
+            json_u64(&out, b ? (uint64_t)1 << b : 0);
+            out += ',';
+            json_u64(&out, st->hist[b]);
+            out += ']';
+        }
+        out += "]}";
+    }
+
+    out += "},\"ops\":{";
+    int first = 1;
+    for (int c = 0; c < 256; ++c) {
+        if (s->ops[c] == 0) continue;
+        if (!first) out += ',';
+        first = 0;
+
+        // unknown ops may be any byte; those outside printable ASCII, and
+        // the two JSON would need escaped, are spelled as a code
+        if (c == 0) {
+            out += "\"rpn\":";
+        } else if (c > ' ' && c < 0x7f && c != '"' && c != '\\') {
+            out += '"';
+            out += (char)c;
+            out += "\":";
+        } else {
+            snprintf(buf, sizeof(buf), "\"0x%02x\":", c);
+            out += buf;
+        }
+        json_u64(&out, s->ops[c]);
+    }
+
+    out += "},\"status\":{";
+    first = 1;
+    for (int i = 0; i < STATS_STATUSES; ++i) {
+        if (s->status[i] == 0) continue;
+        if (!first) out += ',';
+        first = 0;
+
+        out += '"';
+        out += STATUS_KEYS[i];
+        out += "\":";
+        json_u64(&out, s->status[i]);
+    }
+    out += "}}\n";
+
+    return out;
+}